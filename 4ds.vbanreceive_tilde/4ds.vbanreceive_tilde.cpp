@@ -0,0 +1,263 @@
+#include "4ds.vbanreceive_tilde.h"
+
+#include <asio/ip/udp.hpp>
+#include <asio/ip/address.hpp>
+
+#include <algorithm>
+
+// Number of signal outlets when no instantiation argument is given
+static constexpr int sDefaultOutletCount = 8;
+
+// Packets taken from the queue at once by the audio thread
+static constexpr size_t sInsertBatchSize = 64;
+
+// Receive buffer of the socket, holds the packets of a burst while the network thread is not scheduled
+static constexpr int sReceiveBufferSize = 1 << 20;
+
+
+VbanReceiver::VbanReceiver(const atoms &args)
+{
+	// The first argument sets the number of signal outlets, one per channel of the stream
+	int outletCount = sDefaultOutletCount;
+	if (!args.empty())
+		outletCount = std::max<int>(1, std::min<int>(args[0], VBAN_CHANNELS_MAX_NB));
+
+	// Create outlets
+	for (auto i = 0; i < outletCount; i++)
+	{
+		auto an_outlet = std::make_unique<outlet<>>(this, "(signal) Output signal " + std::to_string(i + 1), "signal");
+		mOutlets.push_back(std::move(an_outlet));
+	}
+}
+
+
+VbanReceiver::~VbanReceiver()
+{
+	stopReceiveThread();
+}
+
+
+std::unique_ptr<asio::ip::udp::socket> VbanReceiver::openSocket()
+{
+	asio::error_code asio_error_code;
+	asio::ip::address group;
+	if (!mMulticastGroup.empty())
+	{
+		group = asio::ip::make_address(mMulticastGroup, asio_error_code);
+		if (asio_error_code || !group.is_multicast())
+		{
+			cout << mMulticastGroup << " is not a multicast address" << endl;
+			return nullptr;
+		}
+	}
+
+	// Dual stack, unless the multicast group is an IPv4 address
+	bool ipv6 = mMulticastGroup.empty() || group.is_v6();
+	auto socket = std::make_unique<asio::ip::udp::socket>(mIOContext);
+	socket->open(ipv6 ? asio::ip::udp::v6() : asio::ip::udp::v4(), asio_error_code);
+	if (asio_error_code)
+	{
+		cout << asio_error_code.message() << endl;
+		return nullptr;
+	}
+	if (ipv6)
+	{
+		socket->set_option(asio::ip::v6_only(false), asio_error_code);
+		if (asio_error_code)
+			cout << "Unable to enable dual stack: " << asio_error_code.message() << endl;
+	}
+
+	// Several receivers on this machine can listen to the same multicast group
+	socket->set_option(asio::socket_base::reuse_address(true), asio_error_code);
+	socket->set_option(asio::socket_base::receive_buffer_size(sReceiveBufferSize), asio_error_code);
+	if (asio_error_code)
+		cout << "Unable to set receive buffer size: " << asio_error_code.message() << endl;
+
+	socket->bind(asio::ip::udp::endpoint(ipv6 ? asio::ip::udp::v6() : asio::ip::udp::v4(), static_cast<unsigned short>(mPort)), asio_error_code);
+	if (asio_error_code)
+	{
+		cout << "Unable to receive on port " << mPort << ": " << asio_error_code.message() << endl;
+		return nullptr;
+	}
+
+	if (!mMulticastGroup.empty())
+	{
+		socket->set_option(asio::ip::multicast::join_group(group), asio_error_code);
+		if (asio_error_code)
+		{
+			cout << "Unable to join multicast group " << mMulticastGroup << ": " << asio_error_code.message() << endl;
+			return nullptr;
+		}
+	}
+
+#ifdef __linux__
+	// Arrival times of packets received in a batch come from the kernel
+	if (!PacketReceiver::enableTimestamps(*socket, asio_error_code))
+		cout << "Unable to enable kernel timestamps: " << asio_error_code.message() << endl;
+	asio_error_code.clear();
+#endif
+
+	// The network thread waits for the socket to become readable, then receives until it is empty
+	socket->non_blocking(true, asio_error_code);
+	if (asio_error_code)
+	{
+		cout << asio_error_code.message() << endl;
+		return nullptr;
+	}
+
+	cout << "Receiving on port: " << mPort << endl;
+	return socket;
+}
+
+
+void VbanReceiver::setupDSP()
+{
+	// Determine samplerate
+	bool supported = false;
+	for (int i = 0; i < VBAN_SR_MAXNUMBER; i++)
+		if (samplerate() == VBanSRList[i])
+			supported = true;
+	if (!supported)
+	{
+		cout << "Invalid samplerate" << endl;
+		return;
+	}
+	cout << "Setting samplerate: " << samplerate() << endl;
+
+	stopReceiveThread();
+	double maximumLatency = latency_max;
+	int capacity = JitterBuffer::getCapacity(samplerate(), std::max(maximumLatency, 0.0) / 1000.0, static_cast<int>(vector_size()));
+	mJitterBuffer.setup(samplerate(), static_cast<int>(mOutlets.size()), capacity);
+	mJitterBuffer.resetCounters();
+	mQueue.resize(std::max<int>(queue_size, 1));
+	mReceiver.resetCounters();
+
+	mDspReady = true;
+	startReceiveThread();
+}
+
+
+void VbanReceiver::startReceiveThread()
+{
+	// Receivers with shards enabled share the sockets and threads of the port
+	if (mShardCount > 0 && mMulticastGroup.empty())
+	{
+		std::string error;
+		mShared = SharedReceiver::get(mPort, mShardCount, mPinShards, error);
+		if (mShared == nullptr)
+		{
+			cout << "Unable to receive on port " << mPort << ": " << error << endl;
+			return;
+		}
+		mRoute = mShared->subscribe(mStreamName, mQueue);
+		if (mRoute < 0)
+		{
+			cout << "Unable to receive more than " << SharedReceiver::sMaxRoutes << " streams on port " << mPort << endl;
+			mShared.reset();
+			return;
+		}
+		cout << "Receiving on port: " << mPort << " with " << mShared->getShardCount() << " threads" << endl;
+		return;
+	}
+
+	mSocket = openSocket();
+	if (mSocket == nullptr)
+		return;
+
+	// The io_uring receive is bound to the socket, it is set up again with every new socket
+	std::string error;
+	if (!mReceiver.setUringEnabled(*mSocket, mUringEnabled, error))
+		cout << error << ", falling back to socket" << endl;
+#ifdef VBAN_HAS_IO_URING
+	int descriptor = mReceiver.getUringDescriptor();
+	if (descriptor >= 0)
+		mUringDescriptor.assign(descriptor);
+#endif
+
+	mIOContext.restart();
+	waitForPackets();
+	mReceiveThread = std::thread([this]() { mIOContext.run(); });
+}
+
+
+void VbanReceiver::stopReceiveThread()
+{
+	if (mShared != nullptr)
+	{
+		mShared->unsubscribe(mRoute);
+		mShared.reset();
+		mRoute = -1;
+	}
+
+	mIOContext.stop();
+	if (mReceiveThread.joinable())
+		mReceiveThread.join();
+
+#ifdef VBAN_HAS_IO_URING
+	if (mUringDescriptor.is_open())
+		mUringDescriptor.release();
+#endif
+	if (mSocket != nullptr)
+	{
+		std::string error;
+		mReceiver.setUringEnabled(*mSocket, false, error);
+	}
+	mSocket.reset();
+}
+
+
+void VbanReceiver::restartReceiveThread()
+{
+	// The socket is opened once the queue exists
+	if (!mDspReady)
+		return;
+	stopReceiveThread();
+	startReceiveThread();
+}
+
+
+void VbanReceiver::waitForPackets()
+{
+	// Called on the network thread, apart from the first time
+	auto receive = [this](const asio::error_code& error) {
+		if (error)
+			return;
+
+		asio::error_code asio_error_code;
+		mReceiver.receiveQueue(mQueue, *mSocket, asio_error_code);
+		if (asio_error_code)
+			cout << "Error receiving message: " << asio_error_code.message() << endl;
+		waitForPackets();
+	};
+
+#ifdef VBAN_HAS_IO_URING
+	// Completions of the io_uring receive make the ring readable
+	if (mUringDescriptor.is_open())
+	{
+		mUringDescriptor.async_wait(asio::posix::stream_descriptor::wait_read, receive);
+		return;
+	}
+#endif
+	mSocket->async_wait(asio::ip::udp::socket::wait_read, receive);
+}
+
+
+void VbanReceiver::operator()(audio_bundle input, audio_bundle output)
+{
+	auto now = JitterBuffer::Clock::now();
+
+	// Packets that arrived since the previous signal vector
+	PacketQueue::Packet* packets[sInsertBatchSize];
+	size_t count;
+	while ((count = mQueue.peek(packets, sInsertBatchSize)) > 0)
+	{
+		for (size_t i = 0; i < count; i++)
+			mJitterBuffer.insert(*packets[i]);
+		mQueue.pop(count);
+	}
+
+	mJitterBuffer.read(output.samples(), static_cast<int>(output.channel_count()), static_cast<int>(output.frame_count()), now);
+}
+
+
+MIN_EXTERNAL(VbanReceiver);
@@ -0,0 +1,252 @@
+#pragma once
+
+#include "c74_min.h"
+
+#include <vban/vban.h>
+
+#include "jitterbuffer.h"
+#include "packetqueue.h"
+#include "packetreceiver.h"
+#include "sharedreceiver.h"
+
+#include <asio/ts/internet.hpp>
+#include <asio/io_service.hpp>
+#include <asio/ip/multicast.hpp>
+#ifdef VBAN_HAS_IO_URING
+#include <asio/posix/stream_descriptor.hpp>
+#endif
+#include <asio/system_error.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define VERSION "0.01"
+
+using namespace c74::min;
+
+
+class VbanReceiver : public object<VbanReceiver>, public vector_operator<>
+{
+public:
+	~VbanReceiver();
+	VbanReceiver(const atoms &args = {});
+
+	/**
+	 * Plays the received stream on the audio outputs
+	 * @param input Multichannel input buffer
+	 * @param output Multichannel output buffer
+	 */
+	void operator()(audio_bundle input, audio_bundle output);
+
+	MIN_DESCRIPTION { "Receive audio stream over vban." };
+	MIN_TAGS { "VBAN, Network, UDP" };
+	MIN_AUTHOR { "4DSound" };
+	MIN_RELATED { "4ds.vbansend~" };
+
+	inlet<> input { this, "(anything) Messages" };
+
+private:
+	// Declared before the attributes that configure them, their setters are called on construction
+	JitterBuffer mJitterBuffer;
+	PacketReceiver mReceiver;
+
+	// Socket settings, only accessed from the main thread
+	int mPort = 13251;
+	std::string mMulticastGroup;
+	std::string mStreamName = "Stream1";
+	bool mUringEnabled = false;
+	int mShardCount = 0;
+	bool mPinShards = false;
+	bool mDspReady = false;		// The receive thread only runs once the queue and the jitter buffer are set up
+
+public:
+
+	message<> port { this, "port", "Set the port number to receive on",
+		MIN_FUNCTION{
+			mPort = args[0];
+			cout << "Setting port: " << args[0] << endl;
+			restartReceiveThread();
+			return {};
+		}
+	};
+
+	message<> stream { this, "stream", "Set the name of the stream to receive",
+		MIN_FUNCTION{
+			cout << "Setting stream name: " << args[0] << endl;
+			mStreamName = static_cast<std::string>(args[0]);
+			mReceiver.setStreamName(mStreamName);
+			if (mShared != nullptr)
+				restartReceiveThread();
+			return {};
+		}
+	};
+
+	attribute<symbol> multicast_group { this, "multicast_group", "",
+		description{ "Multicast group to join, IPv4 or IPv6 address. Empty to receive unicast packets only." },
+		setter{ MIN_FUNCTION{
+			symbol group = args[0];
+			mMulticastGroup = group.c_str();
+			restartReceiveThread();
+			return args;
+		}}
+	};
+
+	attribute<number> loss { this, "loss", 1.0,
+		description{ "Percentage of packets that may arrive too late to be played. Lower values buffer more to absorb network jitter." },
+		setter{ MIN_FUNCTION{
+			double percentage = args[0];
+			mJitterBuffer.setLossTarget(std::max(0.0, std::min(percentage, 100.0)) / 100.0);
+			return args;
+		}}
+	};
+
+	attribute<number> latency_min { this, "latency_min", 0.0,
+		description{ "Minimum latency in milliseconds added for network jitter." },
+		setter{ MIN_FUNCTION{
+			double latency = args[0];
+			mJitterBuffer.setMinimumLatency(std::max(latency, 0.0) / 1000.0);
+			return args;
+		}}
+	};
+
+	attribute<number> latency_max { this, "latency_max", 100.0,
+		description{ "Maximum latency in milliseconds added for network jitter, packets that arrive later are lost. The buffer is sized for it on the next dspsetup." },
+		setter{ MIN_FUNCTION{
+			double latency = args[0];
+			mJitterBuffer.setMaximumLatency(std::max(latency, 0.0) / 1000.0);
+			return args;
+		}}
+	};
+
+	attribute<number> latency { this, "latency", 0.0,
+		description{ "Time in milliseconds between the arrival of the fastest packets and their playback." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mJitterBuffer.getLatency() * 1000.0 }; } }
+	};
+
+	attribute<bool> drift_compensation { this, "drift_compensation", true,
+		description{ "Play the stream at the rate of the sender by resampling, so clock drift doesn't change the latency. Otherwise samples are played unchanged and the latency is corrected by skipping samples or inserting silence." },
+		setter{ MIN_FUNCTION{
+			mJitterBuffer.setDriftCompensation(args[0]);
+			return args;
+		}}
+	};
+
+	attribute<number> drift { this, "drift", 0.0,
+		description{ "Estimated clock drift of the sender relative to this computer in parts per million, positive when the sender runs faster. Only measured with drift compensation." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mJitterBuffer.getDrift() * 1e6 }; } }
+	};
+
+	attribute<bool> batch { this, "batch", true,
+		description{ "Receive all packets waiting on the socket with a single call, stamped with the time the kernel received them (Linux only)." },
+		setter{ MIN_FUNCTION{
+			mReceiver.setBatchingEnabled(args[0]);
+			return args;
+		}}
+	};
+
+	attribute<bool> io_uring { this, "io_uring", false,
+		description{ "Receive packets with a multishot receive through io_uring into buffers provided to the kernel, falls back to waiting on the socket when unavailable (Linux only). Takes effect when the socket is opened." },
+		setter{ MIN_FUNCTION{
+			mUringEnabled = args[0];
+			restartReceiveThread();
+			return args;
+		}}
+	};
+
+	attribute<int> shards { this, "shards", 0,
+		description{ "Number of sockets, each served by its own thread, that receive the port for all receivers in this process with shards enabled. Packets are handed to the receivers by stream name, senders are spread over the threads (Linux only, other platforms use one socket). 0 receives on a socket of its own. Multicast streams always use a socket of their own." },
+		setter{ MIN_FUNCTION{
+			mShardCount = std::max<int>(args[0], 0);
+			restartReceiveThread();
+			return args;
+		}}
+	};
+
+	attribute<bool> pin_shards { this, "pin_shards", false,
+		description{ "Pin the threads of the shards to cores of their own, from the last core down so the first cores stay free for the audio threads. Ports opened later continue below the cores of the previous ones (Linux only). Takes effect when the port is opened." },
+		setter{ MIN_FUNCTION{
+			mPinShards = args[0];
+			restartReceiveThread();
+			return args;
+		}}
+	};
+
+	attribute<int> queue_size { this, "queue_size", 512,
+		description{ "Maximum number of packets waiting for the audio thread. Takes effect on the next dspsetup." }
+	};
+
+	attribute<int> late { this, "late", 0,
+		description{ "Number of packets that arrived after their samples were played." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mJitterBuffer.getLateCount() }; } }
+	};
+
+	attribute<int> lost { this, "lost", 0,
+		description{ "Number of packets that were missing when their samples were played, not counting the gaps of silent streams." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mJitterBuffer.getLostCount() }; } }
+	};
+
+	attribute<int> adjustments { this, "adjustments", 0,
+		description{ "Number of times samples were skipped or silence was inserted to change the latency." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mJitterBuffer.getAdjustmentCount() }; } }
+	};
+
+	attribute<int> dropped { this, "dropped", 0,
+		description{ "Number of packets dropped because the audio thread could not keep up." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mShared != nullptr ? mShared->getDropCount(mRoute) : mReceiver.getDropCount() }; } }
+	};
+
+	attribute<int> rejected { this, "rejected", 0,
+		description{ "Number of packets of the stream with a samplerate or sample format that can't be played." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mJitterBuffer.getRejectedCount() }; } }
+	};
+
+	// Post to max window, but only when the class is loaded the first time
+	message<> maxclass_setup{this, "maxclass_setup",
+		MIN_FUNCTION{
+			cout << "4ds.vbanreceive~ " << VERSION << endl;
+			return {};
+		}
+	};
+
+	message<> dspsetup {this, "dspsetup",
+		MIN_FUNCTION{
+			setupDSP();
+			return {};
+		}
+	};
+
+private:
+	std::unique_ptr<asio::ip::udp::socket> openSocket();
+	void setupDSP();
+	void startReceiveThread();
+	void stopReceiveThread();
+	void restartReceiveThread();
+	void waitForPackets();
+
+private:
+	std::vector<std::unique_ptr<outlet<>>> mOutlets;
+
+	// Packets waiting for the audio thread, received by the network thread
+	PacketQueue					mQueue;
+	asio::io_context			mIOContext;
+	std::unique_ptr<asio::ip::udp::socket> mSocket;
+#ifdef VBAN_HAS_IO_URING
+	asio::posix::stream_descriptor mUringDescriptor { mIOContext };	// Ring of the io_uring receive, not owned
+#endif
+	std::thread					mReceiveThread;
+
+	// Sockets and threads shared with the other receivers on the port, instead of a socket of its own
+	std::shared_ptr<SharedReceiver> mShared;
+	int mRoute = -1;
+};
@@ -0,0 +1,445 @@
+#include "c74_min_unittest.h"
+
+#include "jitterbuffer.h"
+#include "packetqueue.h"
+#include "resampler.h"
+#include "sharedreceiver.h"
+
+#include <asio/io_context.hpp>
+#include <asio/ts/internet.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Arrival traces of a 48 kHz stereo int16 stream of 64 frame packets, replayed through a JitterBuffer the way the
+// audio thread drives it: signal vectors of 64 frames, called back in bursts of an I/O vector of 512 frames.
+
+static constexpr double sSampleRate = 48000.0;
+static constexpr int sChannelCount = 2;
+static constexpr int sPacketFrameCount = 64;
+static constexpr int sFrameCount = 64;
+static constexpr int sIoFrameCount = 512;
+static constexpr int sRampLength = 30000;
+
+
+struct Arrival
+{
+	double mTime;			// Seconds since the stream started
+	int64_t mPacket;
+};
+
+
+struct NetworkProfile
+{
+	const char* mName;
+	double mMeanJitter;			// Mean of the exponentially distributed queueing delay in seconds
+	double mSpikeProbability;	// Probability of a packet being held up by a further mSpikeDelay
+	double mSpikeDelay;
+};
+
+
+struct ReplayResult
+{
+	double mLatency;			// Mean latency reported once the statistics settled
+	double mLateFraction;
+	int mLostCount;
+	int mAdjustmentCount;		// Adjustments once the statistics settled
+	int mDiscontinuityCount;	// Steps in the ramp the stream carries, other than where packets were late or lost
+};
+
+
+static std::vector<Arrival> makeTrace(const NetworkProfile& profile, double duration)
+{
+	std::mt19937 random(42);
+	std::exponential_distribution<double> jitter(1.0 / profile.mMeanJitter);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+	std::vector<Arrival> trace;
+	auto packetCount = static_cast<int64_t>(duration * sSampleRate / sPacketFrameCount);
+	for (int64_t packet = 0; packet < packetCount; packet++)
+	{
+		// A constant network delay of 2 ms, the queueing delay and the occasional spike
+		double delay = 0.002 + jitter(random) + (uniform(random) < profile.mSpikeProbability ? profile.mSpikeDelay : 0.0);
+		trace.push_back({ static_cast<double>((packet + 1) * sPacketFrameCount) / sSampleRate + delay, packet });
+	}
+	std::sort(trace.begin(), trace.end(), [](const Arrival& a, const Arrival& b) { return a.mTime < b.mTime; });
+	return trace;
+}
+
+
+static void makePacket(int64_t index, PacketQueue::Packet& packet)
+{
+	VBanHeader header = {};
+	std::memcpy(&header.vban, "VBAN", 4);
+	header.format_SR = 3;
+	header.format_nbs = sPacketFrameCount - 1;
+	header.format_nbc = sChannelCount - 1;
+	header.format_bit = VBAN_BITFMT_16_INT;
+	header.nuFrame = static_cast<uint32_t>(index + 1000);
+	std::memcpy(packet.header(), &header, VBAN_HEADER_SIZE);
+
+	// Every channel carries a ramp of the frame position, offset by the channel
+	auto payload = packet.payload();
+	for (int frame = 0; frame < sPacketFrameCount; frame++)
+	{
+		for (int channel = 0; channel < sChannelCount; channel++)
+		{
+			auto value = static_cast<int16_t>((index * sPacketFrameCount + frame + channel) % sRampLength + 1);
+			std::memcpy(payload + (frame * sChannelCount + channel) * 2, &value, 2);
+		}
+	}
+	packet.mPayloadSize = static_cast<size_t>(sPacketFrameCount * sChannelCount * 2);
+}
+
+
+// Latency the buffer adds on top of the jitter: the I/O vector, the packet holding the last frame of a callback and the
+// one after it, the taps of the interpolation and half the hysteresis of the playback position, which grows with the jitter
+static double getLatencyOverhead(double jitter)
+{
+	return static_cast<double>(sIoFrameCount + 2 * sPacketFrameCount + Resampler::sTapCount + std::max(sFrameCount, sPacketFrameCount) / 2) / sSampleRate + jitter / 8.0;
+}
+
+
+static ReplayResult replay(const std::vector<Arrival>& trace, double duration, double maximumLatency, bool driftCompensation)
+{
+	JitterBuffer buffer;
+	buffer.setup(sSampleRate, sChannelCount, JitterBuffer::getCapacity(sSampleRate, maximumLatency, sFrameCount));
+	buffer.setMaximumLatency(maximumLatency);
+	buffer.setLossTarget(0.01);
+	buffer.setDriftCompensation(driftCompensation);
+
+	auto base = JitterBuffer::Clock::time_point(std::chrono::seconds(1000));
+	auto at = [base](double time) { return base + std::chrono::duration_cast<JitterBuffer::Clock::duration>(std::chrono::duration<double>(time)); };
+
+	PacketQueue::Packet packet;
+	std::vector<double> samples(static_cast<size_t>(sChannelCount * sFrameCount));
+	double* output[sChannelCount] = { samples.data(), samples.data() + sFrameCount };
+
+	ReplayResult result = {};
+	double latencySum = 0.0;
+	int latencyCount = 0;
+	int previous = 0;
+	int previousLost = 0;
+	int settledAdjustmentCount = 0;
+	size_t next = 0;
+	auto callbackCount = static_cast<int64_t>((duration - 0.1) * sSampleRate / sFrameCount);
+	for (int64_t callback = 0; callback < callbackCount; callback++)
+	{
+		// The callbacks of an I/O vector all run when it starts
+		double time = static_cast<double>(callback * sFrameCount / sIoFrameCount * sIoFrameCount) / sSampleRate;
+		for (; next < trace.size() && trace[next].mTime <= time; next++)
+		{
+			makePacket(trace[next].mPacket, packet);
+			packet.mArrivalTime = at(trace[next].mTime);
+			buffer.insert(packet);
+		}
+		buffer.read(output, sChannelCount, sFrameCount, at(time));
+
+		int lost = buffer.getLateCount() + buffer.getLostCount() + buffer.getAdjustmentCount();
+		for (int frame = 0; frame < sFrameCount; frame++)
+		{
+			auto value = static_cast<int>(std::lround(output[0][frame] * 32767.0));
+			if (value != 0 && previous != 0 && value != previous % sRampLength + 1 && lost == previousLost)
+				result.mDiscontinuityCount++;
+			previous = value;
+		}
+		previousLost = lost;
+
+		if (time <= 5.0)
+			settledAdjustmentCount = buffer.getAdjustmentCount();
+		else
+		{
+			latencySum += buffer.getLatency();
+			latencyCount++;
+		}
+	}
+
+	result.mLatency = latencySum / std::max(latencyCount, 1);
+	result.mLateFraction = static_cast<double>(buffer.getLateCount()) / static_cast<double>(trace.size());
+	result.mLostCount = buffer.getLostCount();
+	result.mAdjustmentCount = buffer.getAdjustmentCount() - settledAdjustmentCount;
+	return result;
+}
+
+
+TEST_CASE("JitterBuffer plays replayed network traces within the loss target")
+{
+	static const NetworkProfile profiles[] = {
+		{ "wired", 0.0001, 0.0, 0.0 },
+		{ "wireless", 0.002, 0.001, 0.03 },
+		{ "congested", 0.01, 0.0, 0.0 },
+	};
+	constexpr double duration = 30.0;
+	constexpr double maximumLatency = 0.1;
+
+	for (const auto& profile : profiles)
+	{
+		for (bool driftCompensation : { false, true })
+		{
+			auto trace = makeTrace(profile, duration);
+			auto result = replay(trace, duration, maximumLatency, driftCompensation);
+			WARN(profile.mName << (driftCompensation ? " resampled" : " copied") << ": added latency " << result.mLatency * 1000.0 << " ms, late "
+				<< result.mLateFraction * 100.0 << "%, lost " << result.mLostCount << ", adjustments " << result.mAdjustmentCount);
+
+			// The 99th percentile of the delays arrives in time, and the latency isn't much more than that takes
+			std::vector<double> delays;
+			for (const auto& arrival : trace)
+				delays.push_back(arrival.mTime - static_cast<double>((arrival.mPacket + 1) * sPacketFrameCount) / sSampleRate);
+			std::sort(delays.begin(), delays.end());
+			double jitter = delays[delays.size() * 99 / 100] - delays.front();
+
+			INFO(profile.mName << (driftCompensation ? " resampled" : " copied"));
+			REQUIRE(result.mLateFraction < 0.02);
+			REQUIRE(result.mLatency < std::min(jitter, maximumLatency) + getLatencyOverhead(jitter));
+			REQUIRE(result.mAdjustmentCount <= 3);
+
+			// Interpolated frames are close to the ramp but not exact
+			if (!driftCompensation)
+				REQUIRE(result.mDiscontinuityCount == 0);
+		}
+	}
+}
+
+
+TEST_CASE("JitterBuffer adds up to the maximum latency")
+{
+	// Far more jitter than the maximum latency, so the latency is limited by it and not by the capacity
+	const NetworkProfile profile = { "overloaded", 0.05, 0.0, 0.0 };
+	constexpr double duration = 20.0;
+	auto trace = makeTrace(profile, duration);
+
+	for (double maximumLatency : { 0.02, 0.1, 0.2 })
+	{
+		for (bool driftCompensation : { false, true })
+		{
+			auto result = replay(trace, duration, maximumLatency, driftCompensation);
+			WARN("maximum latency " << maximumLatency * 1000.0 << " ms" << (driftCompensation ? " resampled" : " copied") << ": added latency " << result.mLatency * 1000.0 << " ms");
+			INFO("maximum latency " << maximumLatency << (driftCompensation ? " resampled" : " copied"));
+			REQUIRE(result.mLatency > maximumLatency);
+			REQUIRE(result.mLatency < maximumLatency + getLatencyOverhead(maximumLatency));
+		}
+	}
+}
+
+
+// A stream from a sender that runs ppm fast or slow with 1 ms of jitter, played in callbacks of frameCount frames
+class DriftingStream
+{
+public:
+	DriftingStream(double ppm, int frameCount) :
+		mSamples(static_cast<size_t>(frameCount)),
+		mPpm(ppm),
+		mFrameCount(frameCount)
+	{
+		mBuffer.setup(sSampleRate, 1, JitterBuffer::getCapacity(sSampleRate, 0.1, frameCount));
+	}
+
+	// Plays the next callback, without output only the playback position moves
+	void play(bool output)
+	{
+		double time = static_cast<double>(mCallback * mFrameCount) / sSampleRate;
+		for (;; mNextPacket++)
+		{
+			double sent = static_cast<double>((mNextPacket + 1) * sPacketFrameCount) / sSampleRate / (1.0 + mPpm * 1e-6);
+			if (sent > time + 0.01)
+				break;
+			mArrivals.push({ sent + 0.001 + mJitter(mRandom), mNextPacket });
+		}
+		for (; !mArrivals.empty() && mArrivals.top().first <= time; mArrivals.pop())
+		{
+			makePacket(mArrivals.top().second, mPacket);
+			mPacket.mArrivalTime = at(mArrivals.top().first);
+			mBuffer.insert(mPacket);
+		}
+		double* channels[1] = { mSamples.data() };
+		mBuffer.read(channels, output ? 1 : 0, mFrameCount, at(time));
+		mCallback++;
+	}
+
+	// Seconds played
+	double getTime() const { return static_cast<double>(mCallback * mFrameCount) / sSampleRate; }
+
+	JitterBuffer mBuffer;
+	std::vector<double> mSamples;
+
+private:
+	using Event = std::pair<double, int64_t>;
+
+	static JitterBuffer::Clock::time_point at(double time)
+	{
+		auto base = JitterBuffer::Clock::time_point(std::chrono::seconds(1000));
+		return base + std::chrono::duration_cast<JitterBuffer::Clock::duration>(std::chrono::duration<double>(time));
+	}
+
+	double mPpm;
+	int mFrameCount;
+	int64_t mCallback = 0;
+	int64_t mNextPacket = 0;
+	std::priority_queue<Event, std::vector<Event>, std::greater<Event>> mArrivals;		// Generated as the stream is played
+	std::mt19937 mRandom = std::mt19937(7);
+	std::exponential_distribution<double> mJitter = std::exponential_distribution<double>(1000.0);
+	PacketQueue::Packet mPacket;
+};
+
+
+TEST_CASE("JitterBuffer follows a drifting clock")
+{
+	// Once the drift has been estimated the latency stays within the hysteresis without skipping frames or inserting
+	// silence. The rate control doesn't depend on the samples, so the stream runs without playing them until there
+	// was no adjustment for a few minutes after the estimate had time to settle, up to an hour. The latency is the
+	// callback, the taps and the jitter, played in the middle of a hysteresis of at least a callback.
+	constexpr double maximumDuration = 3600.0;
+	constexpr double settleTime = 60.0;
+	constexpr double settledDuration = 180.0;
+	constexpr double playedDuration = 10.0;
+	constexpr int frameCount = 1024;
+
+	for (double ppm : { 200.0, -200.0 })
+	{
+		INFO(ppm << " ppm");
+
+		// The latency is measured since the estimate settled, or the last adjustment after it
+		DriftingStream stream(ppm, frameCount);
+		double minimumLatency = 1e30;
+		double maximumLatency = 0.0;
+		int adjustmentCount = 0;
+		double lastAdjustment = settleTime;
+		while (stream.getTime() < maximumDuration && stream.getTime() - lastAdjustment < settledDuration)
+		{
+			stream.play(false);
+			double time = stream.getTime();
+			if (time <= settleTime || stream.mBuffer.getAdjustmentCount() != adjustmentCount)
+			{
+				adjustmentCount = stream.mBuffer.getAdjustmentCount();
+				lastAdjustment = std::max(lastAdjustment, time);
+				minimumLatency = 1e30;
+				maximumLatency = 0.0;
+			}
+			minimumLatency = std::min(minimumLatency, stream.mBuffer.getLatency());
+			maximumLatency = std::max(maximumLatency, stream.mBuffer.getLatency());
+		}
+
+		WARN(ppm << " ppm: settled after " << lastAdjustment << " s, drift estimate " << stream.mBuffer.getDrift() * 1e6 << " ppm, latency "
+			<< minimumLatency * 1000.0 << " to " << maximumLatency * 1000.0 << " ms, adjustments " << adjustmentCount);
+		REQUIRE(stream.getTime() - lastAdjustment >= settledDuration);
+		REQUIRE(maximumLatency - minimumLatency < static_cast<double>(frameCount) / sSampleRate);
+		REQUIRE(maximumLatency < static_cast<double>(2 * frameCount) / sSampleRate + 0.01);
+		REQUIRE(std::abs(stream.mBuffer.getDrift() * 1e6 - ppm) < 20.0);
+
+		// Played end to end for a few seconds the stream is resampled at the same positions, and is not silent
+		DriftingStream played(ppm, frameCount);
+		DriftingStream unplayed(ppm, frameCount);
+		double level = 0.0;
+		while (played.getTime() < playedDuration)
+		{
+			played.play(true);
+			unplayed.play(false);
+			REQUIRE(played.mBuffer.getLatency() == unplayed.mBuffer.getLatency());
+			REQUIRE(played.mBuffer.getDrift() == unplayed.mBuffer.getDrift());
+			for (auto sample : played.mSamples)
+				level = std::max(level, std::abs(sample));
+		}
+		REQUIRE(level > 0.0);
+	}
+}
+
+
+TEST_CASE("Resampler kernels match the scalar kernel")
+{
+	// Random samples and fractions, the positions and channel counts of the jitter buffer and its wrapped copy
+	std::mt19937 random(3);
+	std::uniform_real_distribution<float> sample(-1.0f, 1.0f);
+	std::uniform_real_distribution<double> fraction(0.0, 1.0);
+	constexpr int length = 1024;
+	std::vector<std::vector<float>> signal(64, std::vector<float>(length));
+	std::vector<const float*> channels;
+	for (auto& channel : signal)
+	{
+		for (auto& value : channel)
+			value = sample(random);
+		channels.push_back(channel.data());
+	}
+
+	auto scalar = Resampler::getScalarKernel();
+	for (int index = 0; Resampler::getSupportedKernel(index) != nullptr; index++)
+	{
+		auto kernel = Resampler::getSupportedKernel(index);
+		INFO(Resampler::getSupportedInstructionSet(index));
+		for (int channelCount : { 1, 2, 3, 8, 64 })
+		{
+			std::vector<float> expected(static_cast<size_t>(channelCount));
+			std::vector<float> actual(static_cast<size_t>(channelCount));
+			for (int i = 0; i < 200; i++)
+			{
+				auto offset = static_cast<size_t>(i * (length - Resampler::sTapCount) / 199);
+				double position = i % 10 == 0 ? static_cast<double>(i % 20 == 0) : fraction(random);
+				scalar(channels.data(), offset, position, channelCount, expected.data());
+				kernel(channels.data(), offset, position, channelCount, actual.data());
+				for (int channel = 0; channel < channelCount; channel++)
+				{
+					// The kernels sum the taps in another order
+					INFO("channels " << channelCount << " offset " << offset << " fraction " << position << " channel " << channel);
+					REQUIRE(std::abs(actual[static_cast<size_t>(channel)] - expected[static_cast<size_t>(channel)]) < 1e-5f);
+				}
+			}
+		}
+	}
+}
+
+TEST_CASE("SharedReceiver moves a stream to the socket it arrives on")
+{
+	// The stream is sent from one port after the other, like a sender that is restarted. The kernel spreads the ports
+	// over the sockets of the shards, so the stream arrives on other shards and has to be taken over by them.
+	constexpr int port = 23990;
+	constexpr int senderCount = 8;
+	constexpr int packetCount = 20;
+	std::string error;
+	auto receiver = SharedReceiver::get(port, 4, false, error);
+	INFO(error);
+	REQUIRE(receiver != nullptr);
+
+	PacketQueue queue;
+	queue.resize(256);
+	int route = receiver->subscribe("Moving", queue);
+	REQUIRE(route >= 0);
+
+	VBanHeader header = {};
+	std::memcpy(&header.vban, "VBAN", 4);
+	std::memcpy(header.streamname, "Moving", 6);
+	char datagram[VBAN_HEADER_SIZE + 64] = {};
+	std::memcpy(datagram, &header, VBAN_HEADER_SIZE);
+
+	asio::io_context context;
+	asio::ip::udp::endpoint endpoint(asio::ip::address_v4::loopback(), port);
+	int received = 0;
+	for (int i = 0; i < senderCount; i++)
+	{
+		asio::ip::udp::socket sender(context);
+		sender.open(asio::ip::udp::v4());
+		for (int packet = 0; packet < packetCount; packet++)
+			sender.send_to(asio::buffer(datagram), endpoint);
+
+		// Wait for the packets, then leave the stream idle long enough for another shard to take it over
+		auto start = std::chrono::steady_clock::now();
+		while (std::chrono::steady_clock::now() - start < std::chrono::duration<double>(SharedReceiver::sOwnerTimeout * 1.5))
+		{
+			for (; queue.front() != nullptr; queue.pop())
+				received++;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		INFO("sender " << i);
+		REQUIRE(received == (i + 1) * packetCount);
+	}
+	REQUIRE(receiver->getDropCount(route) == 0);
+	receiver->unsubscribe(route);
+}
@@ -0,0 +1,149 @@
+#include "packetqueue.h"
+#include "packetreceiver.h"
+
+#include <asio/io_context.hpp>
+#include <asio/ts/internet.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Receives bursts of packets over loopback with every receive path of PacketReceiver and reports the time spent per
+ * packet. Every burst is sent before it is received, like the packets that wait on the socket while the network
+ * thread is not scheduled, and is received the way the network thread does it: until the socket is empty.
+ * Packets the socket buffer could not hold are reported as lost, they are not part of the time.
+ * When built with io_uring support the packets are also received through io_uring. Its multishot receive copies the
+ * datagrams into the provided buffers while the burst is sent, so part of its cost is in the time of the sender, which
+ * is reported as well. Bursts larger than the provided buffers end the receive and take a resubmission.
+ *
+ * Usage: 4ds.vbanreceive_tilde_receive_benchmark [packet count] [payload size]
+ */
+
+struct Mode
+{
+	const char* mName;
+	bool mBatching;
+	bool mUring;
+};
+
+static const Mode sModes[] = {
+	{ "receive_from", false, false },
+	{ "recvmmsg", true, false },
+#ifdef VBAN_HAS_IO_URING
+	{ "io_uring", true, true },
+#endif
+};
+
+static constexpr size_t sBurstSizes[] = { 1, 8, 64, 512 };
+static constexpr int sTrialCount = 5;
+
+
+struct Result
+{
+	double mNanoseconds;
+	double mSendNanoseconds;		// Time spent per packet sending the bursts
+	size_t mLost;
+};
+
+
+// Best time per packet over a few trials, the others were disturbed by the rest of the system
+static Result run(const Mode& mode, size_t packetCount, size_t payloadSize, size_t burstSize)
+{
+	asio::io_context context;
+	asio::ip::udp::socket socket(context, asio::ip::udp::endpoint(asio::ip::address_v4::loopback(), 0));
+	socket.set_option(asio::socket_base::receive_buffer_size(8 * 1024 * 1024));
+	socket.non_blocking(true);
+	asio::error_code errorCode;
+	PacketReceiver::enableTimestamps(socket, errorCode);
+
+	asio::ip::udp::socket sender(context);
+	sender.open(asio::ip::udp::v4());
+	auto endpoint = socket.local_endpoint();
+
+	VBanHeader header = VBanHeader();
+	std::memcpy(&header.vban, "VBAN", 4);
+	std::memcpy(header.streamname, "Stream1", 7);
+	std::vector<char> datagram(VBAN_HEADER_SIZE + payloadSize);
+	std::memcpy(datagram.data(), &header, VBAN_HEADER_SIZE);
+
+	PacketReceiver receiver;
+	receiver.setBatchingEnabled(mode.mBatching);
+	std::string error;
+	if (mode.mUring && !receiver.setUringEnabled(socket, true, error))
+	{
+		std::printf("%s: %s\n", mode.mName, error.c_str());
+		return { 0.0, 0.0, 0 };
+	}
+	PacketQueue queue;
+	queue.resize(burstSize);
+
+	Result best = { 1e30, 1e30, 0 };
+	auto burstCount = std::max<size_t>(1, packetCount / burstSize);
+	for (int trial = 0; trial < sTrialCount; trial++)
+	{
+		double elapsed = 0.0;
+		double sendElapsed = 0.0;
+		size_t received = 0;
+		for (size_t burst = 0; burst < burstCount; burst++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			for (size_t packet = 0; packet < burstSize; packet++)
+				sender.send_to(asio::buffer(datagram), endpoint, 0, errorCode);
+			sendElapsed += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+			start = std::chrono::steady_clock::now();
+			while (auto count = receiver.receiveQueue(queue, socket, errorCode))
+			{
+				received += count;
+				queue.pop(count);
+			}
+			elapsed += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		}
+		best.mNanoseconds = std::min(best.mNanoseconds, elapsed / static_cast<double>(std::max<size_t>(received, 1)));
+		best.mSendNanoseconds = std::min(best.mSendNanoseconds, sendElapsed / static_cast<double>(burstCount * burstSize));
+		best.mLost += burstCount * burstSize - received;
+	}
+	if (errorCode)
+		std::printf("%s: %s\n", mode.mName, errorCode.message().c_str());
+	receiver.setUringEnabled(socket, false, error);
+	return best;
+}
+
+
+int main(int argc, char** argv)
+{
+	size_t packetCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+	size_t payloadSize = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : VBAN_DATA_MAX_SIZE;
+	payloadSize = std::min(payloadSize, PacketQueue::Packet::sMaxPayloadSize);
+
+	std::printf("%zu packets of %zu bytes per trial, ns per packet for bursts of", packetCount, payloadSize + VBAN_HEADER_SIZE);
+	for (auto burstSize : sBurstSizes)
+		std::printf(" %zu", burstSize);
+	std::printf(" packets\n");
+
+	for (const auto& mode : sModes)
+	{
+		Result results[sizeof(sBurstSizes) / sizeof(sBurstSizes[0])];
+		size_t lost = 0;
+		for (size_t i = 0; i < sizeof(sBurstSizes) / sizeof(sBurstSizes[0]); i++)
+		{
+			results[i] = run(mode, packetCount, payloadSize, sBurstSizes[i]);
+			lost += results[i].mLost;
+		}
+
+		std::printf("%-12s %-8s", mode.mName, "receive");
+		for (const auto& result : results)
+			std::printf(" %8.0f", result.mNanoseconds);
+		std::printf("   lost %zu\n", lost);
+		std::printf("%-12s %-8s", mode.mName, "send");
+		for (const auto& result : results)
+			std::printf(" %8.0f", result.mSendNanoseconds);
+		std::printf("\n");
+	}
+	return 0;
+}
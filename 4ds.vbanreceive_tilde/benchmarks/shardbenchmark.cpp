@@ -0,0 +1,127 @@
+#include "packetqueue.h"
+#include "sharedreceiver.h"
+
+#include <asio/io_context.hpp>
+#include <asio/ts/internet.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Sends streams over loopback from senders of their own to a SharedReceiver with a growing number of shards, their
+ * threads pinned to cores, and reports the packets routed per second. The kernel spreads the senders over the sockets
+ * of the shards, so the routed rate grows with the shards until the cores, or the senders, are saturated.
+ * A consumer thread drains the queues of the streams like the audio threads of the receivers do, and counts the
+ * packets that ended up in the queue of another stream.
+ *
+ * Usage: 4ds.vbanreceive_tilde_shard_benchmark [stream count] [seconds per run] [payload size]
+ */
+
+static constexpr int sShardCounts[] = { 1, 2, 4, 8 };
+static constexpr int sBasePort = 23100;
+
+
+static void run(int shardCount, int streamCount, double duration, size_t payloadSize)
+{
+	std::string error;
+	auto receiver = SharedReceiver::get(sBasePort + shardCount, shardCount, true, error);
+	if (receiver == nullptr)
+	{
+		std::printf("%d shards: %s\n", shardCount, error.c_str());
+		return;
+	}
+
+	std::vector<PacketQueue> queues(static_cast<size_t>(streamCount));
+	std::vector<int> routes;
+	for (int i = 0; i < streamCount; i++)
+	{
+		queues[static_cast<size_t>(i)].resize(4096);
+		routes.push_back(receiver->subscribe("Stream" + std::to_string(i), queues[static_cast<size_t>(i)]));
+	}
+
+	std::atomic<bool> running = { true };
+	size_t routed = 0;
+	size_t misrouted = 0;
+	std::thread consumer([&]() {
+		while (running)
+		{
+			for (int i = 0; i < streamCount; i++)
+			{
+				auto name = "Stream" + std::to_string(i);
+				auto& queue = queues[static_cast<size_t>(i)];
+				while (auto packet = queue.front())
+				{
+					if (std::strncmp(packet->header() + offsetof(VBanHeader, streamname), name.c_str(), VBAN_STREAM_NAME_SIZE) != 0)
+						misrouted++;
+					routed++;
+					queue.pop();
+				}
+			}
+		}
+	});
+
+	// One socket per stream, so the streams come from different ports
+	asio::io_context context;
+	asio::ip::udp::endpoint endpoint(asio::ip::address_v4::loopback(), static_cast<unsigned short>(sBasePort + shardCount));
+	std::vector<asio::ip::udp::socket> senders;
+	std::vector<std::vector<char>> datagrams;
+	for (int i = 0; i < streamCount; i++)
+	{
+		senders.emplace_back(context);
+		senders.back().open(asio::ip::udp::v4());
+
+		VBanHeader header = VBanHeader();
+		std::memcpy(&header.vban, "VBAN", 4);
+		auto name = "Stream" + std::to_string(i);
+		std::memcpy(header.streamname, name.data(), std::min<size_t>(name.size(), VBAN_STREAM_NAME_SIZE));
+		datagrams.emplace_back(VBAN_HEADER_SIZE + payloadSize);
+		std::memcpy(datagrams.back().data(), &header, VBAN_HEADER_SIZE);
+	}
+
+	size_t sent = 0;
+	asio::error_code errorCode;
+	auto start = std::chrono::steady_clock::now();
+	while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < duration)
+	{
+		for (int i = 0; i < streamCount; i++)
+		{
+			senders[static_cast<size_t>(i)].send_to(asio::buffer(datagrams[static_cast<size_t>(i)]), endpoint, 0, errorCode);
+			sent++;
+		}
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	running = false;
+	consumer.join();
+
+	int dropped = 0;
+	for (int route : routes)
+	{
+		dropped += receiver->getDropCount(route);
+		receiver->unsubscribe(route);
+	}
+	std::printf("%6d %7d %10zu %10zu %10.0f %10d %10zu\n", shardCount, receiver->getShardCount(), sent, routed,
+		static_cast<double>(routed) / duration / 1000.0, dropped, misrouted);
+}
+
+
+int main(int argc, char** argv)
+{
+	int streamCount = argc > 1 ? std::atoi(argv[1]) : 32;
+	double duration = argc > 2 ? std::atof(argv[2]) : 2.0;
+	size_t payloadSize = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : VBAN_DATA_MAX_SIZE;
+	payloadSize = std::min(payloadSize, PacketQueue::Packet::sMaxPayloadSize);
+
+	std::printf("%d streams of %zu byte packets, %u cores\n", streamCount, payloadSize + VBAN_HEADER_SIZE, std::thread::hardware_concurrency());
+	std::printf("%6s %7s %10s %10s %10s %10s %10s\n", "shards", "opened", "sent", "routed", "kpps", "dropped", "misrouted");
+	for (int shardCount : sShardCounts)
+		run(shardCount, streamCount, duration, payloadSize);
+	return 0;
+}
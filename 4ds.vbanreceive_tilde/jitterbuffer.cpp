@@ -0,0 +1,553 @@
+#include "jitterbuffer.h"
+
+#include "losslesscodec.h"
+#include "silencegapfiller.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+static constexpr double sInt16Scale = 32767.0;
+static constexpr double sInt24Scale = 8388607.0;
+static constexpr double sInt32Scale = 2147483647.0;
+
+// Position of an empty slot
+static constexpr int64_t sNoFrame = std::numeric_limits<int64_t>::min();
+
+
+// Sample conversion of a frame, for the formats the sender sends
+
+using FrameConverter = void (*)(const char* input, int channelCount, float* output);
+
+static void convertInt16(const char* input, int channelCount, float* output)
+{
+	for (int channel = 0; channel < channelCount; channel++)
+	{
+		int16_t value;
+		std::memcpy(&value, input + channel * 2, 2);
+		output[channel] = static_cast<float>(value / sInt16Scale);
+	}
+}
+
+
+static void convertInt24(const char* input, int channelCount, float* output)
+{
+	for (int channel = 0; channel < channelCount; channel++)
+	{
+		auto sample = reinterpret_cast<const uint8_t*>(input + channel * 3);
+		auto value = static_cast<int32_t>(static_cast<uint32_t>(sample[0]) << 8 | static_cast<uint32_t>(sample[1]) << 16 | static_cast<uint32_t>(sample[2]) << 24) >> 8;
+		output[channel] = static_cast<float>(value / sInt24Scale);
+	}
+}
+
+
+static void convertInt32(const char* input, int channelCount, float* output)
+{
+	for (int channel = 0; channel < channelCount; channel++)
+	{
+		int32_t value;
+		std::memcpy(&value, input + channel * 4, 4);
+		output[channel] = static_cast<float>(value / sInt32Scale);
+	}
+}
+
+
+static void convertFloat32(const char* input, int channelCount, float* output)
+{
+	std::memcpy(output, input, static_cast<size_t>(channelCount) * 4);
+}
+
+
+// Bytes per sample of the formats that can be played, 0 for the others
+static int getSampleSize(int resolution)
+{
+	switch (resolution)
+	{
+		case VBAN_BITFMT_16_INT: return 2;
+		case VBAN_BITFMT_24_INT: return 3;
+		case VBAN_BITFMT_32_INT: return 4;
+		case VBAN_BITFMT_32_FLOAT: return 4;
+		default: return 0;
+	}
+}
+
+
+static FrameConverter getConverter(int resolution)
+{
+	switch (resolution)
+	{
+		case VBAN_BITFMT_24_INT: return convertInt24;
+		case VBAN_BITFMT_32_INT: return convertInt32;
+		case VBAN_BITFMT_32_FLOAT: return convertFloat32;
+		default: return convertInt16;
+	}
+}
+
+
+void JitterBuffer::setup(double sampleRate, int channelCount, int capacity)
+{
+	mSampleRate = sampleRate;
+	mChannelCount = std::max(channelCount, 1);
+	mCapacity = 1;
+	while (mCapacity < capacity)
+		mCapacity <<= 1;
+
+	mSamples.assign(static_cast<size_t>(mCapacity * mChannelCount), 0.0f);
+	mFrames.assign(static_cast<size_t>(mCapacity), sNoFrame);
+	mConverted.assign(static_cast<size_t>(mChannelCount), 0.0f);
+	mDecoded.resize(VBAN_SAMPLES_MAX_NB * VBAN_CHANNELS_MAX_NB * 4);
+	mGroupMaximum.assign(sStatisticsGroupCount, 0.0);
+	mGroupMinimum.assign(sStatisticsGroupCount, 0.0);
+	mScratch.assign(sStatisticsGroupCount + 1, 0.0);
+	mWrapped.assign(static_cast<size_t>(Resampler::sTapCount * mChannelCount), 0.0f);
+	mChannels.resize(static_cast<size_t>(mChannelCount));
+	mWrappedChannels.resize(static_cast<size_t>(mChannelCount));
+	for (int channel = 0; channel < mChannelCount; channel++)
+	{
+		mChannels[static_cast<size_t>(channel)] = &mSamples[static_cast<size_t>(channel * mCapacity)];
+		mWrappedChannels[static_cast<size_t>(channel)] = &mWrapped[static_cast<size_t>(channel * Resampler::sTapCount)];
+	}
+	mInterpolated.assign(static_cast<size_t>(mChannelCount), 0.0f);
+	mStarted = false;
+	mLatency = 0.0;
+
+	// Reset here rather than when the stream starts over, the clocks are usually still the same then
+	mRate = 1.0;
+	mDriftIntegral = 0.0;
+	mDrift = 0.0;
+}
+
+
+int JitterBuffer::getCapacity(double sampleRate, double maximumLatency, int frameCount)
+{
+	return 2 * (static_cast<int>(std::ceil(maximumLatency * sampleRate)) + frameCount + VBAN_SAMPLES_MAX_NB) + 2 * VBAN_SAMPLES_MAX_NB;
+}
+
+
+void JitterBuffer::insert(const PacketQueue::Packet& packet)
+{
+	if (mCapacity == 0)
+		return;
+
+	VBanHeader header;
+	std::memcpy(&header, packet.header(), VBAN_HEADER_SIZE);
+	int sampleRateFormat = header.format_SR & VBAN_SR_MASK;
+	const char* samples = nullptr;
+	if (sampleRateFormat >= VBAN_SR_MAXNUMBER || VBanSRList[sampleRateFormat] != static_cast<long>(mSampleRate) || !decode(header, packet, samples))
+	{
+		mRejectedCount.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	// A stream with another format starts over, the codec can change with every packet
+	uint32_t format = static_cast<uint32_t>(header.format_SR | header.format_nbs << 8 | header.format_nbc << 16 | (header.format_bit & VBAN_BIT_RESOLUTION_MASK) << 24);
+	if (!mStarted || format != mFormat)
+		start(header, format, packet.mArrivalTime);
+
+	// Frame counters wrap, positions don't. A packet further away than the buffer reaches means the sender restarted.
+	auto packetIndex = mLastPacket + static_cast<int32_t>(header.nuFrame - mLastFrameCounter);
+	auto firstFrame = packetIndex * mPacketFrameCount;
+	if (mPositioned && std::abs(firstFrame - mReadFrame) >= mCapacity)
+	{
+		start(header, format, packet.mArrivalTime);
+		packetIndex = mLastPacket;
+		firstFrame = packetIndex * mPacketFrameCount;
+	}
+	if (packetIndex > mLastPacket)
+	{
+		mLastPacket = packetIndex;
+		mLastFrameCounter = header.nuFrame;
+	}
+
+	// How late the packet arrived compared to the position of its frames, including the constant network delay
+	auto endFrame = firstFrame + mPacketFrameCount;
+	double arrival = std::chrono::duration<double>(packet.mArrivalTime - mTimeBase).count() * mSampleRate;
+	addDelay(arrival - static_cast<double>(endFrame));
+
+	if (mPositioned && endFrame <= mPlayedFrame)
+	{
+		mLateCount.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	mNewestFrame = std::max(mNewestFrame, endFrame);
+	if (samples == nullptr)
+		mLastKeepAlive = std::max(mLastKeepAlive, firstFrame);
+	else
+		mLastAudioPacket = std::max(mLastAudioPacket, firstFrame);
+	write(firstFrame, samples, header.format_nbc + 1, header.format_bit & VBAN_BIT_RESOLUTION_MASK);
+}
+
+
+void JitterBuffer::read(double** output, int channelCount, int frameCount, Clock::time_point now)
+{
+	if (!mStarted)
+	{
+		for (int channel = 0; channel < channelCount; channel++)
+			std::fill(output[channel], output[channel] + frameCount, 0.0);
+		return;
+	}
+	updateStatistics();
+
+	// Latency that plays the delay quantile in time, within the limits. Until the delays have been measured
+	// for a while some jitter is assumed, so the stream doesn't start with corrections.
+	double time = std::chrono::duration<double>(now - mTimeBase).count() * mSampleRate;
+	double jitter = mDelayQuantile - mDelayMinimum;
+	if (mBlockCount * sBlockDuration < sStatisticsWindow)
+		jitter = std::max(jitter, sInitialJitter * mSampleRate);
+	double maximumJitter = std::min(mMaximumLatency * mSampleRate, static_cast<double>(mCapacity / 2 - frameCount - mPacketFrameCount));
+	jitter = std::min(std::max(jitter, mMinimumLatency * mSampleRate), maximumJitter);
+
+	// A callback needs the packets up to the one holding its last frame, interpolation needs the frames after it too.
+	// When the rate follows the stream, playback starts in the middle of the hysteresis it is kept in.
+	bool resampling = mDriftCompensation.load();
+	double target = mDelayMinimum + jitter + frameCount + mPacketFrameCount - 1;
+	double hysteresis = std::max(frameCount, mPacketFrameCount) + jitter / 4;
+	if (resampling)
+		target += Resampler::sTapCount / 2;
+	if (!mPositioned)
+	{
+		mReadFrame = static_cast<int64_t>(std::floor(time - target - (resampling ? hysteresis / 2 : 0.0)));
+		mReadPhase = 0.0;
+		mPlayedFrame = mReadFrame;
+		mReleasedFrame = mReadFrame - (Resampler::sTapCount / 2 - 1);
+		for (size_t slot = 0; slot < mFrames.size(); slot++)
+		{
+			if (mFrames[slot] != sNoFrame && mFrames[slot] < mReleasedFrame)
+				clear(slot);
+		}
+		mOffsetMinimum[0] = mOffsetMinimum[1] = time - static_cast<double>(mReadFrame);
+		mPositioned = true;
+	}
+
+	// Without packets, keep-alives included, the stream has stopped
+	if (mReadFrame > mNewestFrame + static_cast<int64_t>(SilenceGapFiller::sMaxGapDuration * mSampleRate))
+	{
+		mStarted = false;
+		read(output, channelCount, frameCount, now);
+		return;
+	}
+
+	// Audio callbacks come in bursts when the I/O vector is larger than the signal vector,
+	// the earliest callback of the last blocks is the one that needs the packets first
+	double offset = time - (static_cast<double>(mReadFrame) + mReadPhase);
+	mOffsetMinimum[0] = std::min(mOffsetMinimum[0], offset);
+	mBlockFrameCount += frameCount;
+	if (mBlockFrameCount >= sBlockDuration * mSampleRate)
+	{
+		mOffsetMinimum[1] = mOffsetMinimum[0];
+		mOffsetMinimum[0] = offset;
+		mBlockFrameCount = 0;
+		mBlockCount++;
+		mBlocksSinceAdjustment++;
+	}
+	adjust(std::min(mOffsetMinimum[0], mOffsetMinimum[1]) - target, hysteresis);
+	mLatency = (std::min(mOffsetMinimum[0], mOffsetMinimum[1]) - mDelayMinimum) / mSampleRate;
+
+	// Play, missing frames are silent
+	if (resampling)
+	{
+		track(std::min(mOffsetMinimum[0], mOffsetMinimum[1]) - target - hysteresis / 2, frameCount);
+		resample(output, channelCount, frameCount);
+	}
+	else
+	{
+		mRate = 1.0;
+		mReadPhase = 0.0;
+		mDriftIntegral = 0.0;
+		mDrift = 0.0;
+		copy(output, channelCount, frameCount);
+	}
+	mPlayedFrame = std::max(mPlayedFrame, mReadFrame);
+	release(mReadFrame - (Resampler::sTapCount / 2 - 1));
+}
+
+
+void JitterBuffer::start(const VBanHeader& header, uint32_t format, Clock::time_point arrival)
+{
+	mStarted = true;
+	mPositioned = false;
+	mFormat = format;
+	mPacketFrameCount = header.format_nbs + 1;
+	mLastFrameCounter = header.nuFrame;
+	mLastPacket = header.nuFrame;
+	mFirstFrame = mLastPacket * mPacketFrameCount;
+	mNewestFrame = mFirstFrame;
+	mLastAudioPacket = sNoFrame;
+	mLastKeepAlive = sNoFrame;
+	mTimeBase = arrival;
+	for (size_t slot = 0; slot < mFrames.size(); slot++)
+	{
+		if (mFrames[slot] != sNoFrame)
+			clear(slot);
+	}
+
+	// Enough groups of packets to cover the statistics window
+	double packetsPerSecond = mSampleRate / mPacketFrameCount;
+	mGroupSize = std::max(1, static_cast<int>(std::ceil(packetsPerSecond * sStatisticsWindow / sStatisticsGroupCount)));
+	mGroupIndex = 0;
+	mGroupCount = 0;
+	mGroupFill = 0;
+	mStatisticsDirty = false;
+	mBlockFrameCount = 0;
+	mBlockCount = 0;
+	mBlocksSinceAdjustment = 0;
+}
+
+
+void JitterBuffer::addDelay(double delay)
+{
+	if (mGroupFill == 0)
+	{
+		mCurrentMaximum = delay;
+		mCurrentMinimum = delay;
+	}
+	else
+	{
+		mCurrentMaximum = std::max(mCurrentMaximum, delay);
+		mCurrentMinimum = std::min(mCurrentMinimum, delay);
+	}
+	mStatisticsDirty = true;
+
+	if (++mGroupFill < mGroupSize)
+		return;
+	mGroupMaximum[static_cast<size_t>(mGroupIndex)] = mCurrentMaximum;
+	mGroupMinimum[static_cast<size_t>(mGroupIndex)] = mCurrentMinimum;
+	mGroupIndex = (mGroupIndex + 1) % sStatisticsGroupCount;
+	mGroupCount = std::min(mGroupCount + 1, sStatisticsGroupCount);
+	mGroupFill = 0;
+}
+
+
+void JitterBuffer::updateStatistics()
+{
+	if (!mStatisticsDirty)
+		return;
+	mStatisticsDirty = false;
+
+	// The latest arrival of every group, so a quantile over groups never underestimates the quantile over packets
+	auto count = static_cast<size_t>(mGroupCount);
+	std::copy(mGroupMaximum.begin(), mGroupMaximum.begin() + mGroupCount, mScratch.begin());
+	double minimum = mGroupCount > 0 ? *std::min_element(mGroupMinimum.begin(), mGroupMinimum.begin() + mGroupCount) : mCurrentMinimum;
+	if (mGroupFill > 0)
+	{
+		mScratch[count++] = mCurrentMaximum;
+		minimum = std::min(minimum, mCurrentMinimum);
+	}
+
+	double quantile = 1.0 - std::max(0.0, std::min(mLossTarget.load(), 1.0));
+	auto index = std::min(count - 1, static_cast<size_t>(std::ceil(quantile * static_cast<double>(count - 1))));
+	std::nth_element(mScratch.begin(), mScratch.begin() + static_cast<std::ptrdiff_t>(index), mScratch.begin() + static_cast<std::ptrdiff_t>(count));
+	mDelayQuantile = mScratch[index];
+	mDelayMinimum = minimum;
+}
+
+
+void JitterBuffer::adjust(double error, double hysteresis)
+{
+	// Corrections aim for the middle of the hysteresis, so noise in the measured jitter doesn't cause new ones
+	int64_t frames = 0;
+	if (error < 0.0)
+	{
+		// Too little latency: move back and play silence until the stream is reached again
+		frames = -std::min<int64_t>(static_cast<int64_t>(std::ceil(hysteresis / 2 - error)), mCapacity / 2);
+	}
+	else if (error > hysteresis && mBlocksSinceAdjustment * sBlockDuration >= sStatisticsWindow)
+	{
+		// More latency than needed for a while: skip frames
+		frames = static_cast<int64_t>(error - hysteresis / 2);
+	}
+	if (frames == 0)
+		return;
+
+	// Frames that have been played are silent when the position moves back over them
+	if (frames < 0)
+	{
+		release(mPlayedFrame);
+		mReleasedFrame = mReadFrame + frames - (Resampler::sTapCount / 2 - 1);
+	}
+
+	mReadFrame += frames;
+	mOffsetMinimum[0] -= static_cast<double>(frames);
+	mOffsetMinimum[1] -= static_cast<double>(frames);
+	mBlocksSinceAdjustment = 0;
+	mAdjustmentCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void JitterBuffer::track(double error, int frameCount)
+{
+	// Critically damped PI controller on the latency error: a step in the drift is followed within about
+	// 4 / sDriftBandwidth seconds, and moves the latency by at most sampleRate * drift / (e * sDriftBandwidth) frames
+	double proportional = 2.0 * sDriftBandwidth / mSampleRate * error;
+	double integral = mDriftIntegral + sDriftBandwidth * sDriftBandwidth / mSampleRate * error * frameCount / mSampleRate;
+	mDriftIntegral = std::max(-sMaxDrift, std::min(integral, sMaxDrift));
+	mRate = 1.0 + std::max(-sMaxDrift, std::min(mDriftIntegral + proportional, sMaxDrift));
+	mDrift.store(mDriftIntegral, std::memory_order_relaxed);
+}
+
+
+void JitterBuffer::copy(double** output, int channelCount, int frameCount)
+{
+	auto mask = mCapacity - 1;
+	int playedChannelCount = std::min(channelCount, mChannelCount);
+	for (int i = 0; i < frameCount; i++)
+	{
+		auto frame = mReadFrame + i;
+		auto slot = frame & mask;
+		if (frame >= mPlayedFrame && mFrames[static_cast<size_t>(slot)] == frame)
+		{
+			for (int channel = 0; channel < playedChannelCount; channel++)
+				output[channel][i] = mChannels[static_cast<size_t>(channel)][slot];
+			for (int channel = playedChannelCount; channel < channelCount; channel++)
+				output[channel][i] = 0.0;
+			continue;
+		}
+
+		for (int channel = 0; channel < channelCount; channel++)
+			output[channel][i] = 0.0;
+		countLoss(frame);
+	}
+	mReadFrame += frameCount;
+}
+
+
+void JitterBuffer::resample(double** output, int channelCount, int frameCount)
+{
+	auto mask = mCapacity - 1;
+	int playedChannelCount = std::min(channelCount, mChannelCount);
+	for (int i = 0; i < frameCount; i++)
+	{
+		// Interpolated from the frames around the playback position, they are consecutive in every channel
+		// unless they wrap around the end of the ring. Without channels to play only the position moves.
+		if (playedChannelCount > 0)
+		{
+			auto firstSlot = static_cast<size_t>((mReadFrame - (Resampler::sTapCount / 2 - 1)) & mask);
+			auto channels = mChannels.data();
+			auto offset = firstSlot;
+			if (firstSlot + Resampler::sTapCount > static_cast<size_t>(mCapacity))
+			{
+				auto head = static_cast<size_t>(mCapacity) - firstSlot;
+				for (int channel = 0; channel < playedChannelCount; channel++)
+				{
+					auto input = mChannels[static_cast<size_t>(channel)];
+					auto wrapped = &mWrapped[static_cast<size_t>(channel * Resampler::sTapCount)];
+					std::copy(input + firstSlot, input + mCapacity, wrapped);
+					std::copy(input, input + (Resampler::sTapCount - head), wrapped + head);
+				}
+				channels = mWrappedChannels.data();
+				offset = 0;
+			}
+			mInterpolate(channels, offset, mReadPhase, playedChannelCount, mInterpolated.data());
+			for (int channel = 0; channel < playedChannelCount; channel++)
+				output[channel][i] = mInterpolated[static_cast<size_t>(channel)];
+		}
+		for (int channel = playedChannelCount; channel < channelCount; channel++)
+			output[channel][i] = 0.0;
+
+		// Frames the position moves past have been played
+		mReadPhase += mRate;
+		while (mReadPhase >= 1.0)
+		{
+			if (mFrames[static_cast<size_t>(mReadFrame & mask)] != mReadFrame)
+				countLoss(mReadFrame);
+			mReadFrame++;
+			mReadPhase -= 1.0;
+		}
+	}
+}
+
+
+void JitterBuffer::release(int64_t endFrame)
+{
+	// Slots are silent once their frames are no longer needed, so missing frames are interpolated as silence
+	auto mask = mCapacity - 1;
+	for (auto frame = std::max(mReleasedFrame, endFrame - mCapacity); frame < endFrame; frame++)
+	{
+		auto slot = static_cast<size_t>(frame & mask);
+		if (mFrames[slot] == frame)
+			clear(slot);
+	}
+	mReleasedFrame = std::max(mReleasedFrame, endFrame);
+}
+
+
+void JitterBuffer::clear(size_t slot)
+{
+	for (int channel = 0; channel < mChannelCount; channel++)
+		mSamples[static_cast<size_t>(channel * mCapacity) + slot] = 0.0f;
+	mFrames[slot] = sNoFrame;
+}
+
+
+void JitterBuffer::countLoss(int64_t frame)
+{
+	// Missing frames count once per packet
+	if (frame >= mPlayedFrame && frame >= mFirstFrame && frame % mPacketFrameCount == 0 && !isSilenceGap(frame))
+		mLostCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+bool JitterBuffer::decode(const VBanHeader& header, const PacketQueue::Packet& packet, const char*& samples)
+{
+	int resolution = header.format_bit & VBAN_BIT_RESOLUTION_MASK;
+	int sampleSize = getSampleSize(resolution);
+	if (sampleSize == 0)
+		return false;
+
+	int frameCount = header.format_nbs + 1;
+	int channelCount = header.format_nbc + 1;
+	samples = nullptr;
+	if (SilenceGapFiller::isKeepAlive(header, packet.mPayloadSize))
+		return true;
+
+	switch (header.format_bit & VBAN_CODEC_MASK)
+	{
+		case VBAN_CODEC_PCM:
+			samples = packet.payload();
+			return packet.mPayloadSize >= static_cast<size_t>(frameCount * channelCount * sampleSize);
+		case VBAN_CODEC_USER:
+			samples = mDecoded.data();
+			return resolution != VBAN_BITFMT_32_FLOAT
+				&& LosslessCodec::decode(packet.payload(), packet.mPayloadSize, frameCount, channelCount, sampleSize, mDecoded.data());
+		default:
+			return false;
+	}
+}
+
+
+void JitterBuffer::write(int64_t firstFrame, const char* samples, int streamChannelCount, int resolution)
+{
+	auto convert = getConverter(resolution);
+	auto frameSize = static_cast<size_t>(streamChannelCount * getSampleSize(resolution));
+	int channelCount = std::min(streamChannelCount, mChannelCount);
+	auto mask = mCapacity - 1;
+	for (int i = 0; i < mPacketFrameCount; i++)
+	{
+		// Frames that have been played are not written again, frames a ring ahead would take the slot of needed frames
+		auto frame = firstFrame + i;
+		if (mPositioned && (frame < mPlayedFrame || frame >= mReleasedFrame + mCapacity))
+			continue;
+
+		auto slot = static_cast<size_t>(frame & mask);
+		mFrames[slot] = frame;
+		if (samples == nullptr)
+			std::fill(mConverted.begin(), mConverted.end(), 0.0f);
+		else
+		{
+			convert(samples + static_cast<size_t>(i) * frameSize, channelCount, mConverted.data());
+			std::fill(mConverted.begin() + channelCount, mConverted.end(), 0.0f);
+		}
+		for (int channel = 0; channel < mChannelCount; channel++)
+			mSamples[static_cast<size_t>(channel * mCapacity) + slot] = mConverted[static_cast<size_t>(channel)];
+	}
+}
+
+
+bool JitterBuffer::isSilenceGap(int64_t frame) const
+{
+	// A sender in DTX mode skips packets after a keep-alive until there is sound again
+	return mLastKeepAlive > mLastAudioPacket && frame > mLastKeepAlive;
+}
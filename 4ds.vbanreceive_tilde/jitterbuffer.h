@@ -0,0 +1,223 @@
+#pragma once
+
+#include "packetqueue.h"
+#include "resampler.h"
+
+#include <vban/vban.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Buffers a received VBAN stream for playback, with a latency that adapts to the network.
+ * Packets are written into a ring of frames at the position given by their frame counter, so packets that arrive
+ * out of order are put back in order, and packets that arrive after their frames have been played are discarded.
+ *
+ * For every packet the buffer measures how late it arrived compared to the position of its frames in the stream.
+ * The spread of these delays over the last sStatisticsWindow seconds is the jitter. The buffer keeps the playback
+ * position behind the stream by the jitter quantile that makes the loss target: with a loss target of 1% the 99th
+ * percentile of the delays still arrives in time. The playback position is corrected by skipping frames when the
+ * latency is larger than needed and by inserting silence when it is too small.
+ *
+ * The clocks of the sender and the receiver never run at exactly the same rate, so the latency drifts away from
+ * its target. With drift compensation the stream is played at a rate that keeps the latency in the middle of the
+ * hysteresis: a PI controller turns the latency error into a playback rate, and its integral estimates the drift.
+ * The frames are interpolated at the fractional playback position by a Resampler, so the latency stays bounded
+ * without skipping frames or inserting silence. These are only left for large changes of the jitter.
+ *
+ * Keep-alives and gaps of streams sent with discontinuous transmission play as silence, see SilenceGapFiller.
+ * Packets and playback are handled on the audio thread, settings can be changed from any thread.
+ */
+class JitterBuffer
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	/**
+	 * Allocates the buffer and forgets the stream. Not thread safe, the audio thread can't be running.
+	 * @param sampleRate samplerate of the audio thread, packets of streams with another samplerate are discarded
+	 * @param channelCount number of channels played, further channels of the stream are discarded
+	 * @param capacity number of frames the buffer holds at least, see getCapacity()
+	 */
+	void setup(double sampleRate, int channelCount, int capacity);
+
+	/**
+	 * The latency added for jitter is limited to half the capacity, the other half holds the packets that arrive
+	 * earlier than the slowest ones and leaves room for the corrections of the playback position.
+	 * @param sampleRate samplerate of the audio thread
+	 * @param maximumLatency upper limit in seconds for the latency added for jitter
+	 * @param frameCount largest number of frames played at once
+	 * @return capacity to set up the buffer with so it can add the maximum latency
+	 */
+	static int getCapacity(double sampleRate, double maximumLatency, int frameCount);
+
+	/**
+	 * @param fraction fraction of packets that may arrive too late to be played
+	 */
+	void setLossTarget(double fraction) { mLossTarget = fraction; }
+
+	/**
+	 * @param latency lower limit in seconds for the latency added for jitter
+	 */
+	void setMinimumLatency(double latency) { mMinimumLatency = latency; }
+
+	/**
+	 * @param latency upper limit in seconds for the latency added for jitter, packets that are later are lost
+	 */
+	void setMaximumLatency(double latency) { mMaximumLatency = latency; }
+
+	/**
+	 * @param enable whether the playback rate follows the rate of the stream, otherwise the frames are played unchanged
+	 */
+	void setDriftCompensation(bool enable) { mDriftCompensation = enable; }
+
+	/**
+	 * Adds a packet of the stream. Called from the audio thread.
+	 * @param packet a received VBAN audio packet, stamped with its arrival time
+	 */
+	void insert(const PacketQueue::Packet& packet);
+
+	/**
+	 * Plays the next frames of the stream. Called from the audio thread.
+	 * @param output one buffer of frameCount samples per channel
+	 * @param channelCount number of output buffers, channels the stream doesn't have are silent. Without output buffers
+	 *        the playback position moves without playing the frames.
+	 * @param frameCount number of frames to play
+	 * @param now time at which the frames are played
+	 */
+	void read(double** output, int channelCount, int frameCount, Clock::time_point now);
+
+	/**
+	 * @return time in seconds between the arrival of the fastest packets and their playback, can be called from any thread
+	 */
+	double getLatency() const { return mLatency.load(std::memory_order_relaxed); }
+
+	/**
+	 * @return estimated rate of the stream relative to the playback rate minus one, positive when the sender runs faster
+	 */
+	double getDrift() const { return mDrift.load(std::memory_order_relaxed); }
+
+	/**
+	 * @return number of packets that arrived after their frames were played
+	 */
+	int getLateCount() const { return mLateCount.load(); }
+
+	/**
+	 * @return number of packets that were missing when their frames were played, gaps of silent streams excluded
+	 */
+	int getLostCount() const { return mLostCount.load(); }
+
+	/**
+	 * @return number of times frames were skipped or silence was inserted to change the latency
+	 */
+	int getAdjustmentCount() const { return mAdjustmentCount.load(); }
+
+	/**
+	 * @return number of packets discarded because the buffer can't play their format
+	 */
+	int getRejectedCount() const { return mRejectedCount.load(); }
+
+	/**
+	 * Resets the counters.
+	 */
+	void resetCounters()
+	{
+		mLateCount = 0;
+		mLostCount = 0;
+		mAdjustmentCount = 0;
+		mRejectedCount = 0;
+	}
+
+private:
+	static constexpr int sStatisticsGroupCount = 1024;		// Groups of packets the jitter is measured over
+	static constexpr double sStatisticsWindow = 2.0;		// Seconds of packets the jitter is measured over
+	static constexpr double sBlockDuration = 0.5;			// Seconds of playback the earliest callback is taken over
+	static constexpr double sInitialJitter = 0.005;			// Seconds of jitter assumed until it has been measured
+	static constexpr double sDriftBandwidth = 0.1;			// Natural frequency in radians per second of the drift compensation
+	static constexpr double sMaxDrift = 0.001;				// Largest correction of the playback rate
+
+	void start(const VBanHeader& header, uint32_t format, Clock::time_point arrival);
+	void addDelay(double delay);
+	void updateStatistics();
+	void adjust(double error, double hysteresis);
+	void track(double error, int frameCount);
+	void copy(double** output, int channelCount, int frameCount);
+	void resample(double** output, int channelCount, int frameCount);
+	void release(int64_t endFrame);
+	void clear(size_t slot);
+	void countLoss(int64_t frame);
+	bool decode(const VBanHeader& header, const PacketQueue::Packet& packet, const char*& samples);
+	void write(int64_t firstFrame, const char* samples, int streamChannelCount, int resolution);
+	bool isSilenceGap(int64_t frame) const;
+
+	// Settings
+	std::atomic<double> mLossTarget = { 0.01 };
+	std::atomic<double> mMinimumLatency = { 0.0 };
+	std::atomic<double> mMaximumLatency = { 0.1 };
+	std::atomic<bool> mDriftCompensation = { true };
+
+	// Frames of the stream by position, mFrames holds the position of the frame stored in every slot.
+	// The samples are planar, a ring of mCapacity samples per channel, and silent in slots without a frame.
+	double mSampleRate = 0.0;
+	int mChannelCount = 0;
+	int64_t mCapacity = 0;
+	std::vector<float> mSamples;
+	std::vector<int64_t> mFrames;
+	std::vector<float> mConverted;		// A frame of the packet being written
+	std::vector<char> mDecoded;			// Lossless payloads are decoded into this
+
+	// Stream, only accessed from the audio thread
+	bool mStarted = false;
+	bool mPositioned = false;
+	uint32_t mFormat = 0;
+	int mPacketFrameCount = 1;
+	uint32_t mLastFrameCounter = 0;
+	int64_t mLastPacket = 0;			// Frame counter of the newest packet, not wrapped
+	int64_t mNewestFrame = 0;			// End of the newest packet
+	int64_t mLastAudioPacket = -1;		// Start of the newest packet with samples
+	int64_t mLastKeepAlive = -1;		// Start of the newest keep-alive
+	int64_t mFirstFrame = 0;			// Start of the first packet
+	int64_t mReadFrame = 0;
+	double mReadPhase = 0.0;			// Fraction of a frame the playback position is past mReadFrame
+	int64_t mPlayedFrame = 0;			// Frames before this have been played, skipped or replaced by silence
+	int64_t mReleasedFrame = 0;			// Frames before this are no longer needed for interpolation, their slots are silent
+	Clock::time_point mTimeBase;
+
+	// Arrival delays in frames, the latest and earliest arrival of every group of packets
+	std::vector<double> mGroupMaximum;
+	std::vector<double> mGroupMinimum;
+	std::vector<double> mScratch;
+	int mGroupSize = 1;
+	int mGroupIndex = 0;
+	int mGroupCount = 0;
+	int mGroupFill = 0;
+	double mCurrentMaximum = 0.0;
+	double mCurrentMinimum = 0.0;
+	bool mStatisticsDirty = false;
+	double mDelayQuantile = 0.0;
+	double mDelayMinimum = 0.0;
+
+	// Earliest callback, relative to the playback position, of the current and the previous block
+	double mOffsetMinimum[2] = {};
+	int64_t mBlockFrameCount = 0;
+	int mBlockCount = 0;
+	int mBlocksSinceAdjustment = 0;
+
+	// Playback rate relative to the stream, the integral of the controller is the drift estimate
+	double mRate = 1.0;
+	double mDriftIntegral = 0.0;
+	Resampler::Kernel mInterpolate = Resampler::getKernel();
+	std::vector<const float*> mChannels;
+	std::vector<float> mWrapped;		// Copy of the frames around the position when they wrap around the ring
+	std::vector<const float*> mWrappedChannels;
+	std::vector<float> mInterpolated;
+
+	std::atomic<double> mLatency = { 0.0 };
+	std::atomic<double> mDrift = { 0.0 };
+	std::atomic<int> mLateCount = { 0 };
+	std::atomic<int> mLostCount = { 0 };
+	std::atomic<int> mAdjustmentCount = { 0 };
+	std::atomic<int> mRejectedCount = { 0 };
+};
@@ -0,0 +1,294 @@
+#include "packetreceiver.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+// Provided buffers of io_uring, absorb the packets that arrive while the network thread is not scheduled
+static constexpr size_t sUringBufferCount = 256;
+
+
+PacketReceiver::PacketReceiver()
+{
+	setStreamName("Stream1");
+	setBatchSize(64);
+}
+
+
+void PacketReceiver::setStreamName(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(mStreamNameMutex);
+	std::memset(mPendingStreamName, 0, VBAN_STREAM_NAME_SIZE);
+	std::memcpy(mPendingStreamName, name.data(), std::min<size_t>(name.size(), VBAN_STREAM_NAME_SIZE));
+	mStreamNameDirty = true;
+}
+
+
+void PacketReceiver::setBatchSize(size_t batchSize)
+{
+	batchSize = std::max<size_t>(batchSize, 1);
+	mPackets.resize(batchSize);
+
+#ifdef __linux__
+	mMessages.resize(batchSize);
+	mIOVectors.resize(batchSize);
+	mControls.resize(batchSize);
+#endif
+
+#ifdef VBAN_HAS_IO_URING
+	mDatagrams.resize(batchSize);
+#endif
+}
+
+
+bool PacketReceiver::setUringEnabled(asio::ip::udp::socket& socket, bool enable, std::string& error)
+{
+#ifdef VBAN_HAS_IO_URING
+	mUring.shutdown();
+	if (!enable)
+		return true;
+	return mUring.init(socket.native_handle(), sUringBufferCount, VBAN_HEADER_SIZE + PacketQueue::Packet::sMaxPayloadSize, error);
+#else
+	(void)socket;
+	if (!enable)
+		return true;
+	error = "io_uring support not available in this build";
+	return false;
+#endif
+}
+
+
+int PacketReceiver::getUringDescriptor() const
+{
+#ifdef VBAN_HAS_IO_URING
+	if (mUring.isInitialized())
+		return mUring.getDescriptor();
+#endif
+	return -1;
+}
+
+
+bool PacketReceiver::enableTimestamps(asio::ip::udp::socket& socket, asio::error_code& errorCode)
+{
+#ifdef __linux__
+	int enable = 1;
+	if (setsockopt(socket.native_handle(), SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0)
+	{
+		errorCode = asio::error_code(errno, asio::system_category());
+		return false;
+	}
+	return true;
+#else
+	errorCode = asio::error::operation_not_supported;
+	return false;
+#endif
+}
+
+
+size_t PacketReceiver::receiveQueue(PacketQueue& queue, asio::ip::udp::socket& socket, asio::error_code& errorCode, size_t maxPackets)
+{
+	if (mStreamNameDirty.load())
+	{
+		std::lock_guard<std::mutex> lock(mStreamNameMutex);
+		std::memcpy(mStreamName, mPendingStreamName, VBAN_STREAM_NAME_SIZE);
+		mStreamNameDirty = false;
+	}
+
+#ifdef VBAN_HAS_IO_URING
+	if (mUring.isInitialized())
+		return receiveUring(queue, errorCode, maxPackets);
+#endif
+#ifdef __linux__
+	if (mBatchingEnabled)
+		return receiveBatches(queue, socket, errorCode, maxPackets);
+#endif
+	return receiveSingle(queue, socket, errorCode, maxPackets);
+}
+
+
+size_t PacketReceiver::receiveSingle(PacketQueue& queue, asio::ip::udp::socket& socket, asio::error_code& errorCode, size_t maxPackets)
+{
+	size_t received = 0;
+	while (received < maxPackets)
+	{
+		// The header is stored directly in front of the payload, so a datagram is received in one piece
+		auto packet = queue.acquire();
+		auto slot = packet != nullptr ? packet : &mDiscard;
+		asio::ip::udp::endpoint sender;
+		auto size = socket.receive_from(asio::buffer(slot->header(), VBAN_HEADER_SIZE + PacketQueue::Packet::sMaxPayloadSize), sender, 0, errorCode);
+		if (errorCode)
+		{
+			if (errorCode == asio::error::would_block || errorCode == asio::error::try_again)
+				errorCode.clear();
+			return received;
+		}
+		if (!accept(slot->header(), size))
+			continue;
+		if (packet == nullptr)
+		{
+			mDropCount.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+
+		packet->mPayloadSize = size - VBAN_HEADER_SIZE;
+		packet->mArrivalTime = std::chrono::steady_clock::now();
+		queue.commit();
+		received++;
+	}
+	return received;
+}
+
+
+#ifdef __linux__
+
+size_t PacketReceiver::receiveBatches(PacketQueue& queue, asio::ip::udp::socket& socket, asio::error_code& errorCode, size_t maxPackets)
+{
+	size_t received = 0;
+	while (received < maxPackets)
+	{
+		// Without free slots the single packet path receives into the discard slot
+		auto count = std::min({ queue.capacity() - queue.size(), mPackets.size(), maxPackets - received });
+		if (count == 0)
+			return received + receiveSingle(queue, socket, errorCode, maxPackets - received);
+		queue.acquire(mPackets.data(), count);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			mIOVectors[i].iov_base = mPackets[i]->header();
+			mIOVectors[i].iov_len = VBAN_HEADER_SIZE + PacketQueue::Packet::sMaxPayloadSize;
+			auto& header = mMessages[i].msg_hdr;
+			header = {};
+			header.msg_iov = &mIOVectors[i];
+			header.msg_iovlen = 1;
+			header.msg_control = mControls[i].mData;
+			header.msg_controllen = sizeof(mControls[i].mData);
+		}
+
+		int result = ::recvmmsg(socket.native_handle(), mMessages.data(), static_cast<unsigned int>(count), MSG_DONTWAIT, nullptr);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				errorCode = asio::error_code(errno, asio::system_category());
+			return received;
+		}
+
+		// One clock reading per batch, kernel timestamps are converted with it
+		auto now = std::chrono::steady_clock::now();
+		timespec realTime;
+		clock_gettime(CLOCK_REALTIME, &realTime);
+
+		// Packets of the stream are moved to the front of the batch, so they can be committed together.
+		// Only other datagrams in the middle of a batch cause a copy.
+		size_t accepted = 0;
+		for (size_t i = 0; i < static_cast<size_t>(result); i++)
+		{
+			const auto& message = mMessages[i];
+			size_t size = message.msg_len;
+			if ((message.msg_hdr.msg_flags & MSG_TRUNC) != 0 || !accept(mPackets[i]->header(), size))
+				continue;
+
+			auto packet = mPackets[accepted];
+			if (accepted != i)
+				std::memcpy(packet->header(), mPackets[i]->header(), size);
+			packet->mPayloadSize = size - VBAN_HEADER_SIZE;
+			packet->mArrivalTime = getArrivalTime(message.msg_hdr, now, realTime);
+			accepted++;
+		}
+		queue.commit(accepted);
+		received += accepted;
+
+		// The socket is empty when it returned less than asked for
+		if (static_cast<size_t>(result) < count)
+			return received;
+	}
+	return received;
+}
+
+
+std::chrono::steady_clock::time_point PacketReceiver::getArrivalTime(const msghdr& message, std::chrono::steady_clock::time_point now, const timespec& realTime)
+{
+	// The kernel timestamp uses the system clock, the time the packet waited in the socket is taken off now
+	for (auto control = CMSG_FIRSTHDR(&message); control != nullptr; control = CMSG_NXTHDR(const_cast<msghdr*>(&message), control))
+	{
+		if (control->cmsg_level != SOL_SOCKET || control->cmsg_type != SCM_TIMESTAMPNS)
+			continue;
+
+		timespec stamp;
+		std::memcpy(&stamp, CMSG_DATA(control), sizeof(stamp));
+		return getArrivalTime(stamp, now, realTime);
+	}
+	return now;
+}
+
+
+std::chrono::steady_clock::time_point PacketReceiver::getArrivalTime(const timespec& stamp, std::chrono::steady_clock::time_point now, const timespec& realTime)
+{
+	auto waited = std::chrono::seconds(realTime.tv_sec - stamp.tv_sec) + std::chrono::nanoseconds(realTime.tv_nsec - stamp.tv_nsec);
+	if (waited > std::chrono::nanoseconds::zero())
+		return now - std::chrono::duration_cast<std::chrono::steady_clock::duration>(waited);
+	return now;
+}
+
+#endif // __linux__
+
+
+#ifdef VBAN_HAS_IO_URING
+
+size_t PacketReceiver::receiveUring(PacketQueue& queue, asio::error_code& errorCode, size_t maxPackets)
+{
+	size_t received = 0;
+	while (received < maxPackets)
+	{
+		auto requested = std::min(mDatagrams.size(), maxPackets - received);
+		auto count = mUring.receive(mDatagrams.data(), requested, errorCode);
+		if (count > 0)
+		{
+			// One clock reading per batch, kernel timestamps are converted with it
+			auto now = std::chrono::steady_clock::now();
+			timespec realTime;
+			clock_gettime(CLOCK_REALTIME, &realTime);
+
+			for (size_t i = 0; i < count; i++)
+			{
+				const auto& datagram = mDatagrams[i];
+				if (datagram.mTruncated || !accept(datagram.mData, datagram.mSize))
+					continue;
+
+				auto packet = queue.acquire();
+				if (packet == nullptr)
+				{
+					mDropCount.fetch_add(1, std::memory_order_relaxed);
+					continue;
+				}
+				std::memcpy(packet->header(), datagram.mData, datagram.mSize);
+				packet->mPayloadSize = datagram.mSize - VBAN_HEADER_SIZE;
+				packet->mArrivalTime = datagram.mStamped ? getArrivalTime(datagram.mTimestamp, now, realTime) : now;
+				queue.commit();
+				received++;
+			}
+		}
+
+		// The buffers go back to the kernel once their packets are in the queue
+		mUring.recycle(errorCode);
+		if (count < requested)
+			return received;
+	}
+	return received;
+}
+
+#endif // VBAN_HAS_IO_URING
+
+
+bool PacketReceiver::accept(const char* data, size_t size)
+{
+	if (size < VBAN_HEADER_SIZE)
+		return false;
+
+	VBanHeader header;
+	std::memcpy(&header, data, VBAN_HEADER_SIZE);
+	return std::memcmp(&header.vban, "VBAN", 4) == 0
+		&& (header.format_SR & VBAN_PROTOCOL_MASK) == VBAN_PROTOCOL_AUDIO
+		&& (mStreamName[0] == 0 || std::memcmp(header.streamname, mStreamName, VBAN_STREAM_NAME_SIZE) == 0);
+}
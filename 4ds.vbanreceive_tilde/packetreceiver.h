@@ -0,0 +1,141 @@
+#pragma once
+
+#include "packetqueue.h"
+#include "uringreceiver.h"
+
+#include <asio/ts/internet.hpp>
+#include <asio/system_error.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <time.h>
+#endif
+
+/**
+ * Receives VBAN packets from a UDP socket into a PacketQueue, every packet is stamped with its arrival time.
+ * Only audio packets of the selected stream are queued, other datagrams are received into a free slot and discarded.
+ * Called from the network thread of the receiver, settings can be changed from any thread.
+ *
+ * On Linux the free slots of the queue are filled in batches with a single recvmmsg() call, every datagram lands
+ * in its slot with the header directly in front of the cache line aligned payload, and headers are checked in place.
+ * With kernel timestamps enabled the arrival time is the time the kernel received the packet rather than the time
+ * it was read from the socket, so packets read in one batch keep their own arrival times.
+ * On other platforms every packet is received with its own receive_from().
+ * When built with io_uring support the packets can be received through io_uring instead, see UringReceiver.
+ * The datagrams are then copied from the provided buffers into the free slots of the queue.
+ *
+ * Sockets are expected to be non-blocking. When the queue is full the packet is received and dropped,
+ * so the socket never fills up with stale packets.
+ */
+class PacketReceiver
+{
+public:
+	PacketReceiver();
+
+	/**
+	 * @param name name of the stream to receive, truncated to VBAN_STREAM_NAME_SIZE characters, empty to receive all streams
+	 */
+	void setStreamName(const std::string& name);
+
+	/**
+	 * Allocates the message headers for batches of the given size. Not thread safe.
+	 * @param batchSize maximum number of packets received at once
+	 */
+	void setBatchSize(size_t batchSize);
+
+	/**
+	 * Enables or disables batching. When disabled every packet is received with its own receive_from().
+	 * @param enable true to receive packets in batches
+	 */
+	void setBatchingEnabled(bool enable) { mBatchingEnabled = enable; }
+
+	/**
+	 * Enables or disables receiving through io_uring. Not thread safe, the network thread can't be running.
+	 * @param socket socket to receive on, has to stay open until io_uring is disabled again
+	 * @param enable true to receive through io_uring
+	 * @param error contains the reason when io_uring could not be enabled
+	 * @return false when io_uring was requested but is not available, the regular socket path is used in that case
+	 */
+	bool setUringEnabled(asio::ip::udp::socket& socket, bool enable, std::string& error);
+
+	/**
+	 * @return descriptor to wait on for packets while receiving through io_uring, -1 when the socket is used
+	 */
+	int getUringDescriptor() const;
+
+	/**
+	 * Asks the kernel to stamp every packet with the time it was received (Linux only).
+	 * @param socket the socket to enable timestamps on
+	 * @param errorCode contains the error if the option is not supported
+	 * @return true if packets are stamped
+	 */
+	static bool enableTimestamps(asio::ip::udp::socket& socket, asio::error_code& errorCode);
+
+	/**
+	 * Receives all packets that are waiting on the socket.
+	 * @param queue queue the packets are received into
+	 * @param socket non-blocking socket to receive from
+	 * @param errorCode contains the error when receiving failed for another reason than an empty socket
+	 * @param maxPackets maximum number of packets to queue, the socket may not be empty when it is reached
+	 * @return number of packets queued
+	 */
+	size_t receiveQueue(PacketQueue& queue, asio::ip::udp::socket& socket, asio::error_code& errorCode, size_t maxPackets = SIZE_MAX);
+
+	/**
+	 * @return number of packets dropped because the queue was full
+	 */
+	int getDropCount() const { return mDropCount.load(); }
+
+	/**
+	 * Resets the drop counter.
+	 */
+	void resetCounters() { mDropCount = 0; }
+
+private:
+	size_t receiveSingle(PacketQueue& queue, asio::ip::udp::socket& socket, asio::error_code& errorCode, size_t maxPackets);
+	bool accept(const char* data, size_t size);
+
+#ifdef __linux__
+	size_t receiveBatches(PacketQueue& queue, asio::ip::udp::socket& socket, asio::error_code& errorCode, size_t maxPackets);
+	static std::chrono::steady_clock::time_point getArrivalTime(const msghdr& message, std::chrono::steady_clock::time_point now, const timespec& realTime);
+	static std::chrono::steady_clock::time_point getArrivalTime(const timespec& stamp, std::chrono::steady_clock::time_point now, const timespec& realTime);
+
+	struct Control
+	{
+		alignas(cmsghdr) char mData[CMSG_SPACE(sizeof(timespec))];	// Kernel timestamp
+	};
+#endif
+
+#ifdef VBAN_HAS_IO_URING
+	size_t receiveUring(PacketQueue& queue, asio::error_code& errorCode, size_t maxPackets);
+#endif
+
+	std::mutex mStreamNameMutex;
+	char mPendingStreamName[VBAN_STREAM_NAME_SIZE];
+	std::atomic<bool> mStreamNameDirty = { false };
+	char mStreamName[VBAN_STREAM_NAME_SIZE] = {};		// Only accessed from the network thread
+
+	PacketQueue::Packet mDiscard;						// Received into when the queue is full
+
+	std::atomic<bool> mBatchingEnabled = { true };
+	std::atomic<int> mDropCount = { 0 };
+	std::vector<PacketQueue::Packet*> mPackets;
+
+#ifdef __linux__
+	std::vector<mmsghdr> mMessages;
+	std::vector<iovec> mIOVectors;
+	std::vector<Control> mControls;
+#endif
+
+#ifdef VBAN_HAS_IO_URING
+	UringReceiver mUring;
+	std::vector<UringReceiver::Datagram> mDatagrams;
+#endif
+};
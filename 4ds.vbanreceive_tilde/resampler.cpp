@@ -0,0 +1,267 @@
+#include "resampler.h"
+#include "cpufeatures.h"
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define VBAN_RESAMPLER_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define VBAN_RESAMPLER_NEON
+#include <arm_neon.h>
+#endif
+
+// Kernels for instruction sets beyond the baseline are compiled for their target only, MSVC doesn't need this
+#if defined(__GNUC__) || defined(__clang__)
+#define VBAN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define VBAN_TARGET(isa)
+#endif
+
+// Cutoff of the filter relative to the Nyquist frequency, and the Kaiser window shape that trades its transition
+// band for stopband attenuation. The rate only differs by a fraction of a percent, so nothing needs to be removed
+// above the cutoff: the filter only has to delay the signal by a fraction of a frame.
+static constexpr double sCutoff = 0.97;
+static constexpr double sKaiserBeta = 11.0;
+
+static constexpr double sPi = 3.14159265358979323846;
+
+static_assert(Resampler::sTapCount % 16 == 0, "The kernels sum 16 taps at a time");
+
+
+// Filter table, sPhaseCount + 1 rows of sTapCount coefficients, built once when the external is loaded
+
+static double besselI0(double x)
+{
+	// Power series, converges quickly for the arguments of the window
+	double sum = 1.0;
+	double term = 1.0;
+	for (int k = 1; k < 50 && term > sum * 1e-17; k++)
+	{
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+
+static std::vector<float> buildTable()
+{
+	constexpr int halfTapCount = Resampler::sTapCount / 2;
+	std::vector<float> table(static_cast<size_t>((Resampler::sPhaseCount + 1) * Resampler::sTapCount));
+	std::vector<double> row(Resampler::sTapCount);
+	for (int phase = 0; phase <= Resampler::sPhaseCount; phase++)
+	{
+		double fraction = static_cast<double>(phase) / Resampler::sPhaseCount;
+		double sum = 0.0;
+		for (int tap = 0; tap < Resampler::sTapCount; tap++)
+		{
+			// Distance of the frame from the position, in frames
+			double distance = static_cast<double>(tap - (halfTapCount - 1)) - fraction;
+			double x = distance / halfTapCount;
+			double window = std::fabs(x) < 1.0 ? besselI0(sKaiserBeta * std::sqrt(1.0 - x * x)) / besselI0(sKaiserBeta) : 0.0;
+			double sinc = distance == 0.0 ? 1.0 : std::sin(sPi * sCutoff * distance) / (sPi * sCutoff * distance);
+			row[static_cast<size_t>(tap)] = sCutoff * sinc * window;
+			sum += row[static_cast<size_t>(tap)];
+		}
+
+		// Every phase passes DC unchanged, so the gain doesn't ripple with the position
+		for (int tap = 0; tap < Resampler::sTapCount; tap++)
+			table[static_cast<size_t>(phase * Resampler::sTapCount + tap)] = static_cast<float>(row[static_cast<size_t>(tap)] / sum);
+	}
+	return table;
+}
+
+static const std::vector<float> sTable = buildTable();
+
+
+// Returns the row of the phase below the fraction, the coefficients lie between it and the next row by weight
+static const float* getPhase(double fraction, float& weight)
+{
+	double position = fraction * Resampler::sPhaseCount;
+	int phase = static_cast<int>(position);
+	if (phase >= Resampler::sPhaseCount)
+		phase = Resampler::sPhaseCount - 1;
+	else if (phase < 0)
+		phase = 0;
+	weight = static_cast<float>(position - phase);
+	return &sTable[static_cast<size_t>(phase * Resampler::sTapCount)];
+}
+
+
+static void interpolateScalar(const float* const* channels, size_t offset, double fraction, int channelCount, float* output)
+{
+	float weight;
+	auto lower = getPhase(fraction, weight);
+	auto upper = lower + Resampler::sTapCount;
+	float coefficients[Resampler::sTapCount];
+	for (int tap = 0; tap < Resampler::sTapCount; tap++)
+		coefficients[tap] = lower[tap] + weight * (upper[tap] - lower[tap]);
+
+	for (int channel = 0; channel < channelCount; channel++)
+	{
+		auto samples = channels[channel] + offset;
+		float sum = 0.0f;
+		for (int tap = 0; tap < Resampler::sTapCount; tap++)
+			sum += coefficients[tap] * samples[tap];
+		output[channel] = sum;
+	}
+}
+
+
+#ifdef VBAN_RESAMPLER_X86
+
+VBAN_TARGET("sse2") static void interpolateSse2(const float* const* channels, size_t offset, double fraction, int channelCount, float* output)
+{
+	float weight;
+	auto lower = getPhase(fraction, weight);
+	auto upper = lower + Resampler::sTapCount;
+	alignas(16) float coefficients[Resampler::sTapCount];
+	auto weights = _mm_set1_ps(weight);
+	for (int tap = 0; tap < Resampler::sTapCount; tap += 4)
+	{
+		auto low = _mm_loadu_ps(lower + tap);
+		_mm_store_ps(coefficients + tap, _mm_add_ps(low, _mm_mul_ps(weights, _mm_sub_ps(_mm_loadu_ps(upper + tap), low))));
+	}
+
+	for (int channel = 0; channel < channelCount; channel++)
+	{
+		// Two sums hide the latency of the additions
+		auto samples = channels[channel] + offset;
+		auto sum0 = _mm_setzero_ps();
+		auto sum1 = _mm_setzero_ps();
+		for (int tap = 0; tap < Resampler::sTapCount; tap += 8)
+		{
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_load_ps(coefficients + tap), _mm_loadu_ps(samples + tap)));
+			sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_load_ps(coefficients + tap + 4), _mm_loadu_ps(samples + tap + 4)));
+		}
+		auto sum = _mm_add_ps(sum0, sum1);
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		output[channel] = _mm_cvtss_f32(sum);
+	}
+}
+
+
+VBAN_TARGET("avx") static void interpolateAvx(const float* const* channels, size_t offset, double fraction, int channelCount, float* output)
+{
+	float weight;
+	auto lower = getPhase(fraction, weight);
+	auto upper = lower + Resampler::sTapCount;
+	alignas(32) float coefficients[Resampler::sTapCount];
+	auto weights = _mm256_set1_ps(weight);
+	for (int tap = 0; tap < Resampler::sTapCount; tap += 8)
+	{
+		auto low = _mm256_loadu_ps(lower + tap);
+		_mm256_store_ps(coefficients + tap, _mm256_add_ps(low, _mm256_mul_ps(weights, _mm256_sub_ps(_mm256_loadu_ps(upper + tap), low))));
+	}
+
+	for (int channel = 0; channel < channelCount; channel++)
+	{
+		auto samples = channels[channel] + offset;
+		auto sum0 = _mm256_setzero_ps();
+		auto sum1 = _mm256_setzero_ps();
+		for (int tap = 0; tap < Resampler::sTapCount; tap += 16)
+		{
+			sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_load_ps(coefficients + tap), _mm256_loadu_ps(samples + tap)));
+			sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_load_ps(coefficients + tap + 8), _mm256_loadu_ps(samples + tap + 8)));
+		}
+		auto sum256 = _mm256_add_ps(sum0, sum1);
+		auto sum = _mm_add_ps(_mm256_castps256_ps128(sum256), _mm256_extractf128_ps(sum256, 1));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		output[channel] = _mm_cvtss_f32(sum);
+	}
+}
+
+#endif // VBAN_RESAMPLER_X86
+
+
+#ifdef VBAN_RESAMPLER_NEON
+
+static void interpolateNeon(const float* const* channels, size_t offset, double fraction, int channelCount, float* output)
+{
+	float weight;
+	auto lower = getPhase(fraction, weight);
+	auto upper = lower + Resampler::sTapCount;
+	float coefficients[Resampler::sTapCount];
+	for (int tap = 0; tap < Resampler::sTapCount; tap += 4)
+	{
+		auto low = vld1q_f32(lower + tap);
+		vst1q_f32(coefficients + tap, vmlaq_n_f32(low, vsubq_f32(vld1q_f32(upper + tap), low), weight));
+	}
+
+	for (int channel = 0; channel < channelCount; channel++)
+	{
+		auto samples = channels[channel] + offset;
+		auto sum0 = vdupq_n_f32(0.0f);
+		auto sum1 = vdupq_n_f32(0.0f);
+		for (int tap = 0; tap < Resampler::sTapCount; tap += 8)
+		{
+			sum0 = vmlaq_f32(sum0, vld1q_f32(coefficients + tap), vld1q_f32(samples + tap));
+			sum1 = vmlaq_f32(sum1, vld1q_f32(coefficients + tap + 4), vld1q_f32(samples + tap + 4));
+		}
+		output[channel] = vaddvq_f32(vaddq_f32(sum0, sum1));
+	}
+}
+
+#endif // VBAN_RESAMPLER_NEON
+
+
+// Kernel selection, done once when the external is loaded
+
+struct ResamplerKernelInfo
+{
+	Resampler::Kernel mKernel;
+	const char* mName;
+};
+
+
+// The kernels the CPU supports, fastest first
+static std::vector<ResamplerKernelInfo> getSupportedKernels()
+{
+	std::vector<ResamplerKernelInfo> kernels;
+#if defined(VBAN_RESAMPLER_X86)
+	if (CpuFeatures::hasAvx2())
+		kernels.push_back({ interpolateAvx, "AVX" });
+	kernels.push_back({ interpolateSse2, "SSE2" });
+#elif defined(VBAN_RESAMPLER_NEON)
+	kernels.push_back({ interpolateNeon, "NEON" });
+#else
+	kernels.push_back({ interpolateScalar, "scalar" });
+#endif
+	return kernels;
+}
+
+static const std::vector<ResamplerKernelInfo> sSupportedKernels = getSupportedKernels();
+static const Resampler::Kernel sKernel = sSupportedKernels.front().mKernel;
+
+
+Resampler::Kernel Resampler::getKernel()
+{
+	return sKernel;
+}
+
+
+Resampler::Kernel Resampler::getScalarKernel()
+{
+	return interpolateScalar;
+}
+
+
+Resampler::Kernel Resampler::getSupportedKernel(int index)
+{
+	if (index < 0 || index >= static_cast<int>(sSupportedKernels.size()))
+		return nullptr;
+	return sSupportedKernels[static_cast<size_t>(index)].mKernel;
+}
+
+
+const char* Resampler::getSupportedInstructionSet(int index)
+{
+	if (index < 0 || index >= static_cast<int>(sSupportedKernels.size()))
+		return nullptr;
+	return sSupportedKernels[static_cast<size_t>(index)].mName;
+}
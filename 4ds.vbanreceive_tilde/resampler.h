@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * Interpolates planar audio at fractional positions, for playing a stream at a rate slightly different from the one
+ * it was sent at. Every output frame is a windowed sinc filter of sTapCount frames around the position: the filter
+ * is tabulated for sPhaseCount fractions and interpolated linearly between them.
+ * The kernels interpolate the coefficients once per frame, then take their dot product with the consecutive samples
+ * of every channel, so they are vectorized across the taps whatever the number of channels.
+ * The fastest kernel the CPU supports is selected once, when the external is loaded.
+ */
+class Resampler
+{
+public:
+	static constexpr int sTapCount = 64;
+	static constexpr int sPhaseCount = 512;
+
+	/**
+	 * Interpolates every channel c at fraction, from 0 up to 1, between sample sTapCount / 2 - 1 and the next one of the
+	 * sTapCount consecutive samples starting at channels[c][offset], and writes the result to output[c].
+	 */
+	using Kernel = void (*)(const float* const* channels, size_t offset, double fraction, int channelCount, float* output);
+
+	/**
+	 * @return the fastest kernel on this CPU
+	 */
+	static Kernel getKernel();
+
+	/**
+	 * @return the scalar reference kernel
+	 */
+	static Kernel getScalarKernel();
+
+	/**
+	 * Gives access to the kernels of every instruction set the CPU supports, to test them against the scalar kernel.
+	 * @param index index of the instruction set, 0 is the one getKernel() selected
+	 * @return the kernel, nullptr when the CPU supports fewer instruction sets
+	 */
+	static Kernel getSupportedKernel(int index);
+
+	/**
+	 * @param index index of the instruction set, as for getSupportedKernel()
+	 * @return name of the instruction set, nullptr when the CPU supports fewer instruction sets
+	 */
+	static const char* getSupportedInstructionSet(int index);
+};
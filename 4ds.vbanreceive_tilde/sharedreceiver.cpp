@@ -0,0 +1,321 @@
+#include "sharedreceiver.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#endif
+
+// Packets a thread receives before routing them
+static constexpr size_t sArenaSize = 64;
+
+// Receive buffer of every socket
+static constexpr int sReceiveBufferSize = 1 << 20;
+
+// Receivers by port, an expired receiver is replaced by the next one that opens the port
+static std::mutex sRegistryMutex;
+static std::map<int, std::weak_ptr<SharedReceiver>> sRegistry;
+
+// Threads pinned by all ports, the next thread gets the core below the previous one
+static int sPinnedThreadCount = 0;
+
+
+/**
+ * Pins a thread to one of the cores the process may run on, counting down from the last core.
+ * Threads with consecutive indices get different cores.
+ */
+static void pinThread(std::thread& thread, int index)
+{
+#ifdef __linux__
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+	int coreCount = CPU_COUNT(&allowed);
+	if (coreCount <= 1)
+		return;
+
+	int skip = index % coreCount;
+	for (int core = CPU_SETSIZE - 1; core >= 0; core--)
+	{
+		if (!CPU_ISSET(core, &allowed) || skip-- > 0)
+			continue;
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(core, &cpus);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+		return;
+	}
+#endif
+}
+
+
+std::shared_ptr<SharedReceiver> SharedReceiver::get(int port, int shardCount, bool pinThreads, std::string& error)
+{
+	std::lock_guard<std::mutex> lock(sRegistryMutex);
+	auto receiver = sRegistry[port].lock();
+	if (receiver != nullptr)
+		return receiver;
+
+	receiver = std::shared_ptr<SharedReceiver>(new SharedReceiver(port));
+	if (!receiver->open(shardCount, pinThreads, error))
+		return nullptr;
+	sRegistry[port] = receiver;
+	return receiver;
+}
+
+
+SharedReceiver::SharedReceiver(int port) :
+	mPort(port)
+{
+}
+
+
+SharedReceiver::~SharedReceiver()
+{
+	for (auto& shard : mShards)
+	{
+		shard->mIOContext.stop();
+		if (shard->mThread.joinable())
+			shard->mThread.join();
+		shard->mSocket.reset();
+	}
+}
+
+
+bool SharedReceiver::open(int shardCount, bool pinThreads, std::string& error)
+{
+#ifndef __linux__
+	// Only Linux spreads the senders over sockets bound with SO_REUSEPORT
+	shardCount = 1;
+#endif
+	shardCount = std::max<int>(shardCount, 1);
+
+	for (int i = 0; i < shardCount; i++)
+	{
+		auto shard = std::make_unique<Shard>();
+		shard->mIndex = i;
+		shard->mSocket = openSocket(shard->mIOContext, error);
+		if (shard->mSocket == nullptr)
+			return false;
+		shard->mReceiver.setStreamName("");
+		shard->mArena.resize(sArenaSize);
+		mShards.push_back(std::move(shard));
+	}
+
+	// Threads start once all sockets are bound, so the kernel spreads the senders over all of them right away
+	for (auto& shard : mShards)
+	{
+		auto current = shard.get();
+		waitForPackets(*current);
+		current->mThread = std::thread([current]() { current->mIOContext.run(); });
+		if (pinThreads)
+			pinThread(current->mThread, sPinnedThreadCount++);
+	}
+	return true;
+}
+
+
+std::unique_ptr<asio::ip::udp::socket> SharedReceiver::openSocket(asio::io_context& context, std::string& error)
+{
+	asio::error_code asio_error_code;
+	auto socket = std::make_unique<asio::ip::udp::socket>(context);
+	socket->open(asio::ip::udp::v6(), asio_error_code);
+	if (asio_error_code)
+	{
+		error = asio_error_code.message();
+		return nullptr;
+	}
+	socket->set_option(asio::ip::v6_only(false), asio_error_code);
+	if (asio_error_code)
+	{
+		error = "Unable to enable dual stack: " + asio_error_code.message();
+		return nullptr;
+	}
+	socket->set_option(asio::socket_base::reuse_address(true), asio_error_code);
+	if (asio_error_code)
+	{
+		error = "Unable to reuse address: " + asio_error_code.message();
+		return nullptr;
+	}
+	socket->set_option(asio::socket_base::receive_buffer_size(sReceiveBufferSize), asio_error_code);
+	if (asio_error_code)
+	{
+		error = "Unable to set receive buffer size: " + asio_error_code.message();
+		return nullptr;
+	}
+
+#ifdef __linux__
+	// Sockets bound to the same port with SO_REUSEPORT share its packets, by a hash of the sender address
+	int enable = 1;
+	if (setsockopt(socket->native_handle(), SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+	{
+		error = "Unable to share port: " + asio::error_code(errno, asio::system_category()).message();
+		return nullptr;
+	}
+#endif
+
+	socket->bind(asio::ip::udp::endpoint(asio::ip::udp::v6(), static_cast<unsigned short>(mPort)), asio_error_code);
+	if (asio_error_code)
+	{
+		error = asio_error_code.message();
+		return nullptr;
+	}
+
+	PacketReceiver::enableTimestamps(*socket, asio_error_code);
+	socket->non_blocking(true, asio_error_code);
+	if (asio_error_code)
+	{
+		error = asio_error_code.message();
+		return nullptr;
+	}
+	return socket;
+}
+
+
+int SharedReceiver::subscribe(const std::string& streamName, PacketQueue& queue)
+{
+	for (int i = 0; i < sMaxRoutes; i++)
+	{
+		auto& route = mRoutes[i];
+		if (route.mQueue.load() != nullptr)
+			continue;
+
+		// The name is visible to the receive threads before the queue
+		std::memset(route.mStreamName, 0, VBAN_STREAM_NAME_SIZE);
+		std::memcpy(route.mStreamName, streamName.data(), std::min<size_t>(streamName.size(), VBAN_STREAM_NAME_SIZE));
+		route.mShard = -1;
+		route.mPreviousShard = -1;
+		route.mDropCount = 0;
+		route.mQueue.store(&queue, std::memory_order_release);
+		if (i >= mRouteEnd.load())
+			mRouteEnd = i + 1;
+		return i;
+	}
+	return -1;
+}
+
+
+void SharedReceiver::unsubscribe(int route)
+{
+	mRoutes[route].mQueue.store(nullptr);
+
+	// Threads that were routing a batch may still hold the queue, a later batch can't see it
+	for (auto& shard : mShards)
+	{
+		auto epoch = shard->mEpoch.load();
+		if (epoch % 2 == 0)
+			continue;
+		while (shard->mEpoch.load() == epoch)
+			std::this_thread::yield();
+	}
+}
+
+
+void SharedReceiver::waitForPackets(Shard& shard)
+{
+	shard.mSocket->async_wait(asio::ip::udp::socket::wait_read, [this, &shard](const asio::error_code& error) {
+		if (error)
+			return;
+
+		// Batches are received into the arena and routed until the socket is empty
+		asio::error_code asio_error_code;
+		size_t count;
+		do
+		{
+			count = shard.mReceiver.receiveQueue(shard.mArena, *shard.mSocket, asio_error_code, shard.mArena.capacity());
+			route(shard);
+		} while (count == shard.mArena.capacity() && !asio_error_code);
+		waitForPackets(shard);
+	});
+}
+
+
+void SharedReceiver::route(Shard& shard)
+{
+	PacketQueue::Packet* packets[sArenaSize];
+	auto count = shard.mArena.peek(packets, sArenaSize);
+	if (count == 0)
+		return;
+
+	shard.mEpoch.fetch_add(1);
+	int routeEnd = mRouteEnd.load();
+	for (size_t i = 0; i < count; i++)
+	{
+		auto packet = packets[i];
+		auto streamName = packet->header() + offsetof(VBanHeader, streamname);
+
+		// Every receiver subscribed to the stream gets a copy
+		for (int j = 0; j < routeEnd; j++)
+		{
+			auto& route = mRoutes[j];
+			auto queue = route.mQueue.load(std::memory_order_acquire);
+			if (queue == nullptr || std::memcmp(route.mStreamName, streamName, VBAN_STREAM_NAME_SIZE) != 0)
+				continue;
+
+			if (!own(route, shard, packet->mArrivalTime))
+				continue;
+
+			auto target = queue->acquire();
+			if (target == nullptr)
+			{
+				route.mDropCount.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+			std::memcpy(target->header(), packet->header(), packet->size());
+			target->mPayloadSize = packet->mPayloadSize;
+			target->mArrivalTime = packet->mArrivalTime;
+			queue->commit();
+			route.mLastDelivery.store(packet->mArrivalTime.time_since_epoch().count(), std::memory_order_relaxed);
+		}
+	}
+	shard.mEpoch.fetch_add(1);
+	shard.mArena.pop(count);
+}
+
+
+bool SharedReceiver::own(Route& route, Shard& shard, std::chrono::steady_clock::time_point arrival)
+{
+	// A queue has a single producer, the stream is taken from the thread that received it first.
+	// Only a second sender with the same stream name, or a multicast stream, arrives on several sockets at once,
+	// the stream stays with its thread then. It moves when it arrives on another socket once its thread lost it.
+	int owner = route.mShard.load();
+	if (owner != shard.mIndex)
+	{
+		auto lastDelivery = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(route.mLastDelivery.load(std::memory_order_relaxed)));
+		if (owner != -1 && std::chrono::duration<double>(arrival - lastDelivery).count() < sOwnerTimeout)
+			return false;
+		if (!route.mShard.compare_exchange_strong(owner, shard.mIndex))
+			return false;
+
+		// The previous thread reads the owner for every packet, once it changed only the batch it was routing
+		// may still produce into the queue
+		route.mLastDelivery.store(arrival.time_since_epoch().count(), std::memory_order_relaxed);
+		if (owner != -1)
+		{
+			route.mHandoverEpoch = mShards[static_cast<size_t>(owner)]->mEpoch.load();
+			route.mPreviousShard = owner;
+		}
+	}
+
+	// Packets of a stream taken over are dropped until the batch of the previous thread is done, a wait could deadlock
+	// with a thread taking over a stream from this one
+	int previous = route.mPreviousShard.load(std::memory_order_relaxed);
+	if (previous != -1)
+	{
+		auto epoch = route.mHandoverEpoch.load(std::memory_order_relaxed);
+		if (epoch % 2 == 1 && mShards[static_cast<size_t>(previous)]->mEpoch.load() == epoch)
+		{
+			route.mDropCount.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		route.mPreviousShard.store(-1, std::memory_order_relaxed);
+	}
+	return true;
+}
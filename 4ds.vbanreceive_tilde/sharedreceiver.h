@@ -0,0 +1,121 @@
+#pragma once
+
+#include "packetqueue.h"
+#include "packetreceiver.h"
+#include "silencegapfiller.h"
+
+#include <vban/vban.h>
+
+#include <asio/ts/internet.hpp>
+#include <asio/system_error.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Receives the VBAN streams arriving on a port for all receivers in this process that share it.
+ * The port is served by several sockets bound with SO_REUSEPORT, each with a receive thread, optionally pinned to a
+ * core of its own.
+ * The kernel spreads the senders over the sockets by their address, so every stream is received by one thread.
+ * Threads receive batches into a queue of their own and route the packets by stream name to the queues of the
+ * receivers subscribed to the stream, which are consumed by their audio threads.
+ *
+ * The routes are read by the receive threads without locks. A queue is only released by unsubscribe() after
+ * every thread finished the batch it was routing.
+ * A queue is produced into by one thread at a time, the one that received the stream first. When the stream arrives
+ * on another socket, because the sender was restarted with another port for instance, that thread takes the stream
+ * over once the previous one delivered nothing for sOwnerTimeout seconds. It only produces into the queue after
+ * the previous thread finished the batch it was routing when the stream was taken over.
+ * On platforms without load balancing over SO_REUSEPORT sockets the port is served by a single socket.
+ */
+class SharedReceiver
+{
+public:
+	/**
+	 * Returns the receiver serving the port, opens it when no receiver of this process serves the port yet.
+	 * Called from the main thread.
+	 * @param port port to receive on
+	 * @param shardCount number of sockets and threads opened for the port, ignored when it is already served
+	 * @param pinThreads true to pin the threads to cores of their own, from the last core down so the first cores
+	 *        stay free for the audio threads. Ports opened later continue below the cores of the previous ones.
+	 *        Ignored when the port is already served.
+	 * @param error contains the error message when the port could not be opened
+	 * @return the receiver of the port, nullptr when it could not be opened
+	 */
+	static std::shared_ptr<SharedReceiver> get(int port, int shardCount, bool pinThreads, std::string& error);
+
+	~SharedReceiver();
+
+	/**
+	 * Routes the packets of a stream to a queue. Called from the main thread.
+	 * @param streamName name of the stream, truncated to VBAN_STREAM_NAME_SIZE characters
+	 * @param queue queue the packets are routed to, has to stay alive until it is unsubscribed
+	 * @return route of the stream, -1 when sMaxRoutes streams are already routed
+	 */
+	int subscribe(const std::string& streamName, PacketQueue& queue);
+
+	/**
+	 * Stops routing packets to a queue, returns once no receive thread uses the queue anymore. Called from the main thread.
+	 * @param route route returned by subscribe()
+	 */
+	void unsubscribe(int route);
+
+	/**
+	 * @param route route returned by subscribe()
+	 * @return number of packets of the route dropped because its queue was full
+	 */
+	int getDropCount(int route) const { return mRoutes[route].mDropCount.load(); }
+
+	/**
+	 * @return number of sockets and threads receiving on the port
+	 */
+	int getShardCount() const { return static_cast<int>(mShards.size()); }
+
+	/**
+	 * @return port the receiver serves
+	 */
+	int getPort() const { return mPort; }
+
+	static constexpr int sMaxRoutes = 64;
+	static constexpr double sOwnerTimeout = 2 * SilenceGapFiller::sKeepAliveInterval;		// Seconds without packets before another thread takes a stream over
+
+private:
+	struct Route
+	{
+		char mStreamName[VBAN_STREAM_NAME_SIZE] = {};		// Written before the queue is published
+		std::atomic<PacketQueue*> mQueue = { nullptr };
+		std::atomic<int> mShard = { -1 };					// Thread that produces into the queue
+		std::atomic<std::chrono::steady_clock::rep> mLastDelivery = { 0 };	// Arrival time of the last packet the thread produced
+		std::atomic<int> mPreviousShard = { -1 };			// Thread the stream was taken over from, until it finished its batch
+		std::atomic<uint64_t> mHandoverEpoch = { 0 };		// Epoch of the previous thread when the stream was taken over
+		std::atomic<int> mDropCount = { 0 };
+	};
+
+	struct Shard
+	{
+		int mIndex = 0;
+		asio::io_context mIOContext;
+		std::unique_ptr<asio::ip::udp::socket> mSocket;
+		std::thread mThread;
+		PacketReceiver mReceiver;
+		PacketQueue mArena;									// Packets received, waiting to be routed
+		std::atomic<uint64_t> mEpoch = { 0 };				// Odd while a batch is being routed
+	};
+
+	SharedReceiver(int port);
+	bool open(int shardCount, bool pinThreads, std::string& error);
+	std::unique_ptr<asio::ip::udp::socket> openSocket(asio::io_context& context, std::string& error);
+	void waitForPackets(Shard& shard);
+	void route(Shard& shard);
+	bool own(Route& route, Shard& shard, std::chrono::steady_clock::time_point arrival);
+
+	int mPort = 0;
+	Route mRoutes[sMaxRoutes];
+	std::atomic<int> mRouteEnd = { 0 };					// Routes after this one have never been used
+	std::vector<std::unique_ptr<Shard>> mShards;
+};
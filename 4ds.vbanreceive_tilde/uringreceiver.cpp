@@ -0,0 +1,219 @@
+#ifdef VBAN_HAS_IO_URING
+
+#include "uringreceiver.h"
+
+#include <cerrno>
+#include <cstring>
+
+// Submission entries, only the receive and its cancellation are ever submitted
+static constexpr unsigned int sRingSize = 4;
+
+// Identifies the completions of the receive
+static constexpr __u64 sReceiveData = 1;
+static constexpr __u64 sCancelData = 2;
+
+// Largest buffer ring the kernel accepts
+static constexpr unsigned int sMaxBufferCount = 32768;
+
+
+UringReceiver::~UringReceiver()
+{
+	shutdown();
+}
+
+
+bool UringReceiver::init(int socket, size_t bufferCount, size_t bufferSize, std::string& error)
+{
+	shutdown();
+
+	// The kernel indexes the provided buffers with a mask
+	mBufferCount = 1;
+	while (mBufferCount < bufferCount && mBufferCount < sMaxBufferCount)
+		mBufferCount *= 2;
+
+	// Every buffer in use has a completion waiting, the completion queue holds them all so it never overflows
+	io_uring_params params = io_uring_params();
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = 2 * mBufferCount;
+	int result = io_uring_queue_init_params(sRingSize, &mRing, &params);
+	if (result < 0)
+	{
+		error = std::string("io_uring not available: ") + std::strerror(-result);
+		return false;
+	}
+	mInitialized = true;
+
+	// Provided buffer rings need Linux 5.19 or later
+	mBufferRing = io_uring_setup_buf_ring(&mRing, mBufferCount, sBufferGroup, 0, &result);
+	if (mBufferRing == nullptr)
+	{
+		error = std::string("Unable to register io_uring provided buffers: ") + std::strerror(-result);
+		shutdown();
+		return false;
+	}
+
+	// Every buffer starts with the recvmsg header and the control data, buffers are cache line aligned
+	mMessage = msghdr();
+	mMessage.msg_controllen = CMSG_SPACE(sizeof(timespec));
+	mBufferSize = (sizeof(io_uring_recvmsg_out) + mMessage.msg_controllen + bufferSize + 63) & ~size_t(63);
+	mBuffers.assign(mBufferSize * mBufferCount, 0);
+	mTaken.clear();
+	mTaken.reserve(mBufferCount);
+
+	auto mask = io_uring_buf_ring_mask(mBufferCount);
+	for (unsigned int i = 0; i < mBufferCount; i++)
+		io_uring_buf_ring_add(mBufferRing, mBuffers.data() + i * mBufferSize, static_cast<unsigned int>(mBufferSize), static_cast<unsigned short>(i), mask, static_cast<int>(i));
+	io_uring_buf_ring_advance(mBufferRing, static_cast<int>(mBufferCount));
+
+	mSocket = socket;
+	asio::error_code errorCode;
+	if (!submitReceive(errorCode))
+	{
+		error = "Unable to start io_uring receive: " + errorCode.message();
+		shutdown();
+		return false;
+	}
+
+	// Multishot receives need Linux 6.0 or later, older kernels reject the request right away
+	io_uring_cqe* cqe = nullptr;
+	if (io_uring_peek_cqe(&mRing, &cqe) == 0 && cqe->res < 0 && !(cqe->flags & IORING_CQE_F_MORE))
+	{
+		error = std::string("io_uring multishot receive not supported by this kernel: ") + std::strerror(-cqe->res);
+		io_uring_cqe_seen(&mRing, cqe);
+		mReceiving = false;
+		shutdown();
+		return false;
+	}
+
+	return true;
+}
+
+
+void UringReceiver::shutdown()
+{
+	if (!mInitialized)
+		return;
+
+	// The receive is cancelled before its buffers go away
+	if (mReceiving)
+	{
+		auto sqe = io_uring_get_sqe(&mRing);
+		if (sqe != nullptr)
+		{
+			io_uring_prep_cancel64(sqe, sReceiveData, 0);
+			io_uring_sqe_set_data64(sqe, sCancelData);
+			io_uring_submit(&mRing);
+		}
+		while (mReceiving)
+		{
+			io_uring_cqe* cqe = nullptr;
+			int result = io_uring_wait_cqe(&mRing, &cqe);
+			if (result == -EINTR)
+				continue;
+			if (result < 0)
+				break;
+			if (io_uring_cqe_get_data64(cqe) == sReceiveData && !(cqe->flags & IORING_CQE_F_MORE))
+				mReceiving = false;
+			io_uring_cqe_seen(&mRing, cqe);
+		}
+		mReceiving = false;
+	}
+
+	if (mBufferRing != nullptr)
+		io_uring_free_buf_ring(&mRing, mBufferRing, mBufferCount, sBufferGroup);
+	mBufferRing = nullptr;
+	mTaken.clear();
+
+	io_uring_queue_exit(&mRing);
+	mInitialized = false;
+}
+
+
+size_t UringReceiver::receive(Datagram* datagrams, size_t maxCount, asio::error_code& errorCode)
+{
+	size_t count = 0;
+	io_uring_cqe* cqe = nullptr;
+	while (count < maxCount && io_uring_peek_cqe(&mRing, &cqe) == 0)
+	{
+		if (io_uring_cqe_get_data64(cqe) != sReceiveData)
+		{
+			io_uring_cqe_seen(&mRing, cqe);
+			continue;
+		}
+
+		// The receive ends when the kernel runs out of buffers, it is submitted again by recycle()
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			mReceiving = false;
+		if (cqe->res < 0 && cqe->res != -ENOBUFS)
+			errorCode = asio::error_code(-cqe->res, asio::error::get_system_category());
+
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+		{
+			auto id = static_cast<unsigned short>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			mTaken.push_back(id);
+
+			auto buffer = mBuffers.data() + id * mBufferSize;
+			auto out = cqe->res >= 0 ? io_uring_recvmsg_validate(buffer, cqe->res, &mMessage) : nullptr;
+			if (out != nullptr)
+			{
+				auto& datagram = datagrams[count++];
+				datagram.mData = static_cast<const char*>(io_uring_recvmsg_payload(out, &mMessage));
+				datagram.mSize = io_uring_recvmsg_payload_length(out, cqe->res, &mMessage);
+				datagram.mTruncated = (out->flags & MSG_TRUNC) != 0;
+				datagram.mStamped = false;
+				for (auto control = io_uring_recvmsg_cmsg_firsthdr(out, &mMessage); control != nullptr; control = io_uring_recvmsg_cmsg_nexthdr(out, &mMessage, control))
+				{
+					if (control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_TIMESTAMPNS)
+					{
+						std::memcpy(&datagram.mTimestamp, CMSG_DATA(control), sizeof(timespec));
+						datagram.mStamped = true;
+					}
+				}
+			}
+		}
+		io_uring_cqe_seen(&mRing, cqe);
+	}
+	return count;
+}
+
+
+void UringReceiver::recycle(asio::error_code& errorCode)
+{
+	if (!mTaken.empty())
+	{
+		auto mask = io_uring_buf_ring_mask(mBufferCount);
+		for (size_t i = 0; i < mTaken.size(); i++)
+			io_uring_buf_ring_add(mBufferRing, mBuffers.data() + mTaken[i] * mBufferSize, static_cast<unsigned int>(mBufferSize), mTaken[i], mask, static_cast<int>(i));
+		io_uring_buf_ring_advance(mBufferRing, static_cast<int>(mTaken.size()));
+		mTaken.clear();
+	}
+
+	if (!mReceiving)
+		submitReceive(errorCode);
+}
+
+
+bool UringReceiver::submitReceive(asio::error_code& errorCode)
+{
+	auto sqe = io_uring_get_sqe(&mRing);
+	if (sqe == nullptr)
+	{
+		errorCode = asio::error::no_buffer_space;
+		return false;
+	}
+	io_uring_prep_recvmsg_multishot(sqe, mSocket, &mMessage, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = sBufferGroup;
+	io_uring_sqe_set_data64(sqe, sReceiveData);
+
+	int result = io_uring_submit(&mRing);
+	if (result < 0)
+	{
+		errorCode = asio::error_code(-result, asio::error::get_system_category());
+		return false;
+	}
+	mReceiving = true;
+	return true;
+}
+
+#endif // VBAN_HAS_IO_URING
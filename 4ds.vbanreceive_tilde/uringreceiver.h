@@ -0,0 +1,98 @@
+#pragma once
+
+#ifdef VBAN_HAS_IO_URING
+
+#include <asio/error.hpp>
+#include <asio/error_code.hpp>
+
+#include <liburing.h>
+
+#include <string>
+#include <time.h>
+#include <vector>
+
+/**
+ * Receives datagrams through io_uring with a single multishot recvmsg.
+ * The kernel takes a buffer from a ring of provided buffers for every datagram and posts a completion, without
+ * the receive being submitted again. Completions are reaped without system calls, their buffers are handed back
+ * to the kernel once the datagrams have been copied out with recycle().
+ * The ring descriptor becomes readable when completions are waiting, so it can be waited on like the socket.
+ */
+class UringReceiver
+{
+public:
+	/**
+	 * A received datagram, its data is valid until the next call to recycle().
+	 */
+	struct Datagram
+	{
+		const char* mData = nullptr;
+		size_t mSize = 0;
+		bool mTruncated = false;		// The datagram didn't fit in the buffer
+		bool mStamped = false;			// mTimestamp holds the time the kernel received the datagram
+		timespec mTimestamp = {};
+	};
+
+	~UringReceiver();
+
+	/**
+	 * Sets up the ring and the provided buffers, and starts receiving on the socket.
+	 * Fails when io_uring, provided buffer rings or multishot receives are not supported by the kernel.
+	 * @param socket native handle of the socket to receive on, has to stay open while the receiver is initialized
+	 * @param bufferCount number of provided buffers, rounded up to a power of two
+	 * @param bufferSize maximum size of a datagram
+	 * @param error contains the error message when initialization failed
+	 * @return true on success
+	 */
+	bool init(int socket, size_t bufferCount, size_t bufferSize, std::string& error);
+
+	/**
+	 * Cancels the receive and tears down the ring.
+	 */
+	void shutdown();
+
+	/**
+	 * @return whether the receiver is ready to receive
+	 */
+	bool isInitialized() const { return mInitialized; }
+
+	/**
+	 * @return descriptor of the ring, readable when completions are waiting
+	 */
+	int getDescriptor() const { return mRing.ring_fd; }
+
+	/**
+	 * Takes the datagrams that have been received, without waiting.
+	 * @param datagrams receives at most maxCount datagrams in the order they arrived
+	 * @param maxCount maximum number of datagrams
+	 * @param errorCode contains the last error that occurred
+	 * @return number of datagrams
+	 */
+	size_t receive(Datagram* datagrams, size_t maxCount, asio::error_code& errorCode);
+
+	/**
+	 * Hands the buffers of the datagrams taken since the previous call back to the kernel,
+	 * and submits the receive again if the kernel ended it, for instance when it ran out of buffers.
+	 * @param errorCode contains the error when the receive could not be submitted
+	 */
+	void recycle(asio::error_code& errorCode);
+
+private:
+	static constexpr int sBufferGroup = 0;
+
+	bool submitReceive(asio::error_code& errorCode);
+
+	io_uring mRing;
+	io_uring_buf_ring* mBufferRing = nullptr;
+	bool mInitialized = false;
+	bool mReceiving = false;			// The multishot receive has not ended
+
+	int mSocket = -1;
+	msghdr mMessage;					// Space reserved for the name and control data in front of every datagram
+	std::vector<char> mBuffers;
+	size_t mBufferSize = 0;
+	unsigned int mBufferCount = 0;
+	std::vector<unsigned short> mTaken;	// Buffers of datagrams that haven't been recycled
+};
+
+#endif // VBAN_HAS_IO_URING
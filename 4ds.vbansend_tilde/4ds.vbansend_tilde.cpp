@@ -3,78 +3,252 @@
 #include <asio/ip/udp.hpp>
 #include <asio/ip/address.hpp>
 
+#include <algorithm>
+#include <chrono>
 
-VbanSender::VbanSender(const atoms &args) : mEncoder(*this)
+// Time the network thread sleeps when there are no packets to send
+static constexpr std::chrono::microseconds sSendThreadPollInterval(250);
+
+// Number of signal inlets when no instantiation argument is given
+static constexpr int sDefaultInletCount = 8;
+
+
+// Applies a socket option at the IPv4 level whatever the family of the socket.
+// Packets to IPv4 groups from a dual stack socket take the IPv4 multicast options, not the IPv6 ones.
+template <typename Option>
+class IPv4Option
+{
+public:
+	explicit IPv4Option(const Option& option) : mOption(option) {}
+
+	template <typename Protocol> int level(const Protocol&) const { return mOption.level(asio::ip::udp::v4()); }
+	template <typename Protocol> int name(const Protocol&) const { return mOption.name(asio::ip::udp::v4()); }
+	template <typename Protocol> const void* data(const Protocol&) const { return mOption.data(asio::ip::udp::v4()); }
+	template <typename Protocol> size_t size(const Protocol&) const { return mOption.size(asio::ip::udp::v4()); }
+
+private:
+	Option mOption;
+};
+
+
+template <typename Option>
+static void setMulticastOption(asio::ip::udp::socket& socket, bool ipv4, const Option& option, asio::error_code& errorCode)
+{
+	if (ipv4)
+		socket.set_option(IPv4Option<Option>(option), errorCode);
+	else
+		socket.set_option(option, errorCode);
+}
+
+
+VbanSender::VbanSender(const atoms &args) : mScratchPackets(PacketEncoder<VbanSender>::sMaxShards)
 {
+	// The first argument sets the number of signal inlets, the stream gets one channel per inlet
+	int inletCount = sDefaultInletCount;
+	if (!args.empty())
+	{
+		inletCount = std::max<int>(1, std::min<int>(args[0], PacketEncoder<VbanSender>::sMaxChannelCount));
+		mEncoder.setChannelCount(inletCount);
+	}
+
 	// Create inlets
-	for (auto i = 0; i < 8; i++)
+	for (auto i = 0; i < inletCount; i++)
 	{
 		auto an_inlet = std::make_unique<inlet<>>(this, "(signal) Input signal " + std::to_string(i + 1));
 		mInlets.push_back(std::move(an_inlet));
 	}
 
+	// Packets of a signal vector are collected in the queue before being sent
+	mQueue.resize(std::max<int>(queue_size, 1));
+
 	// Open the socket at default host and port
-	startSocket();
+	mConnections.reconnect();
 }
 
 
 VbanSender::~VbanSender()
 {
-	stopSocket();
+	stopSendThread();
+
+	// The kernel has to release the queue storage before it is freed
+	std::string error;
+	mTransmitter.setUringEnabled(mQueue, false, error);
 }
 
 
-void VbanSender::startSocket()
+std::unique_ptr<Connection> VbanSender::openConnection()
 {
-	std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+	// Called on the connection thread, resolving the host can take a while
+	std::vector<Destination> destinations;
+	int multicastTTL;
+	bool multicastLoopback;
+	std::string multicastInterface;
+	std::string addressFamily;
+	bool txTime;
+	bool clearResolveCache;
+	{
+		std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+		destinations.push_back({ mIP, mPort });
+		destinations.insert(destinations.end(), mDestinations.begin(), mDestinations.end());
+		multicastTTL = mMulticastTTL;
+		multicastLoopback = mMulticastLoopback;
+		multicastInterface = mMulticastInterface;
+		addressFamily = mAddressFamily;
+		txTime = mTxTime;
+		clearResolveCache = mResolveCacheDirty;
+		mResolveCacheDirty = false;
+	}
+	auto connection = std::make_unique<Connection>(mIOContext);
+
+	if (clearResolveCache)
+		mResolveCache.clear();
+
+	// resolve ip address of every destination, destinations that can't be resolved are skipped
+	bool ipv6 = false;
+	bool multicastV4 = false;
+	bool multicastV6 = false;
+	for (const auto& destination : destinations)
+	{
+		asio::ip::address address;
+		if (!resolve(destination.mHost.c_str(), addressFamily, address))
+			continue;
+		ipv6 |= address.is_v6();
+		multicastV4 |= address.is_v4() && address.is_multicast();
+		multicastV6 |= address.is_v6() && address.is_multicast();
+		connection->mEndpoints.emplace_back(address, destination.mPort);
+	}
+	if (connection->mEndpoints.empty())
+		return connection;
+
+	// The IPv6 header leaves less room for samples
+	mIPv6 = ipv6;
+	mPayloadSizeUpdate.set();
 
-	// Try open socket
+	// Try open socket, dual stack when any of the destinations is an IPv6 address
 	asio::error_code asio_error_code;
-	mSocket.open(asio::ip::udp::v4(), asio_error_code);
+	connection->mSocket.open(ipv6 ? asio::ip::udp::v6() : asio::ip::udp::v4(), asio_error_code);
 	if (asio_error_code)
 	{
 		cout << asio_error_code.message() << endl;
-		return;
+		return connection;
+	}
+	if (ipv6)
+	{
+		connection->mSocket.set_option(asio::ip::v6_only(false), asio_error_code);
+		if (asio_error_code)
+			cout << "Unable to enable dual stack: " << asio_error_code.message() << endl;
+
+		// IPv4 destinations are reached through their IPv4 mapped IPv6 address
+		for (auto& endpoint : connection->mEndpoints)
+			if (endpoint.address().is_v4())
+				endpoint.address(asio::ip::make_address_v6(asio::ip::v4_mapped, endpoint.address().to_v4()));
 	}
 
 	// Disable broadcast
-	mSocket.set_option(asio::socket_base::broadcast(false), asio_error_code);
+	connection->mSocket.set_option(asio::socket_base::broadcast(false), asio_error_code);
 	if (asio_error_code)
 	{
 		cout << asio_error_code.message() << endl;
-		return;
+		connection->mSocket.close();
+		return connection;
+	}
+
+	// Multicast options, a single packet reaches every receiver that joined the group.
+	// The groups are told apart by their original address, IPv4 groups are set up at the IPv4 level also on a dual stack socket.
+	for (bool groupV4 : { true, false })
+	{
+		if (!(groupV4 ? multicastV4 : multicastV6))
+			continue;
+
+		setMulticastOption(connection->mSocket, groupV4, asio::ip::multicast::hops(multicastTTL), asio_error_code);
+		if (asio_error_code)
+			cout << "Unable to set multicast ttl: " << asio_error_code.message() << endl;
+
+		setMulticastOption(connection->mSocket, groupV4, asio::ip::multicast::enable_loopback(multicastLoopback), asio_error_code);
+		if (asio_error_code)
+			cout << "Unable to set multicast loopback: " << asio_error_code.message() << endl;
+
+		// An IPv4 address selects the interface for IPv4 groups, IPv6 groups need the interface index
+		if (!multicastInterface.empty())
+		{
+			if (groupV4)
+			{
+				auto address = asio::ip::make_address_v4(multicastInterface, asio_error_code);
+				if (!asio_error_code)
+					setMulticastOption(connection->mSocket, groupV4, asio::ip::multicast::outbound_interface(address), asio_error_code);
+			}
+			else
+			{
+				unsigned int index = 0;
+				try { index = static_cast<unsigned int>(std::stoul(multicastInterface)); }
+				catch (const std::exception&) { asio_error_code = asio::error::invalid_argument; }
+				if (!asio_error_code)
+					connection->mSocket.set_option(asio::ip::multicast::outbound_interface(index), asio_error_code);
+			}
+			if (asio_error_code)
+				cout << "Unable to set multicast interface " << multicastInterface << ": " << asio_error_code.message() << endl;
+			asio_error_code.clear();
+		}
+	}
+
+	// Departure times per packet, the sender falls back to sending immediately when they are not supported
+	if (txTime)
+	{
+		connection->mTxTime = PacketTransmitter::enableTxTime(connection->mSocket, asio_error_code);
+		if (asio_error_code)
+			cout << "Unable to enable departure times: " << asio_error_code.message() << endl;
+		asio_error_code.clear();
 	}
 
-	// resolve ip address from endpoint
-	asio::ip::tcp::resolver resolver(mIOContext);
-	asio::ip::tcp::resolver::query query(mIP, "80");
-	asio::ip::tcp::resolver::iterator iter = resolver.resolve(query, asio_error_code);
-	asio::ip::tcp::endpoint endpoint = iter->endpoint();
-	auto address = asio::ip::address::from_string(endpoint.address().to_string(), asio_error_code);
+	// Never wait for the socket, a full send buffer is handled by the overload policy
+	connection->mSocket.non_blocking(true, asio_error_code);
 	if (asio_error_code)
 	{
 		cout << asio_error_code.message() << endl;
-		return;
+		connection->mSocket.close();
+		return connection;
 	}
 
-	mRemoteEndpoint = asio::ip::udp::endpoint(address, mPort);
-
 	// Log
-	cout << "Starting socket: IP: " << mIP << " port: " << mPort << endl;
+	for (const auto& endpoint : connection->mEndpoints)
+		cout << "Starting socket: IP: " << endpoint.address().to_string() << " port: " << endpoint.port() << endl;
+	return connection;
 }
 
 
-void VbanSender::stopSocket()
+bool VbanSender::resolve(const std::string& host, const std::string& family, asio::ip::address& address)
 {
-	std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+	// Called on the connection thread
+	auto key = family + "/" + host;
+	auto cached = mResolveCache.find(key);
+	if (cached != mResolveCache.end())
+	{
+		address = cached->second;
+		return true;
+	}
+
 	asio::error_code asio_error_code;
-	mSocket.close();
-	if (asio_error_code)
+	asio::ip::udp::resolver resolver(mIOContext);
+	auto results = resolver.resolve(host, "", asio_error_code);
+	if (asio_error_code || results.empty())
 	{
-		cout << asio_error_code.message() << endl;
-		return;
+		cout << host << ": " << (asio_error_code ? asio_error_code.message() : "No address found") << endl;
+		return false;
+	}
+
+	// Take the first address of the preferred family, or the first address when there is none
+	address = results.begin()->endpoint().address();
+	for (const auto& result : results)
+	{
+		auto candidate = result.endpoint().address();
+		if ((family == "ipv4" && candidate.is_v4()) || (family == "ipv6" && candidate.is_v6()))
+		{
+			address = candidate;
+			break;
+		}
 	}
-	cout << "Stopping socket" << endl;
+	mResolveCache[key] = address;
+	return true;
 }
 
 
@@ -92,33 +266,165 @@ void VbanSender::setupDSP()
 	}
 	cout << "Setting samplerate: " << samplerate() << endl;
 	mEncoder.setSampleRateFormat(sampleRateFormat);
+
+	// (Re)start the network thread with a queue of the requested size, once the kernel released the old queue storage
+	stopSendThread();
+	std::string error;
+	mTransmitter.setUringEnabled(mQueue, false, error);
+	mQueue.resize(std::max<int>(queue_size, 1));
+	mQueueHighWater = 0;
+	mDropCount = 0;
+	mTransmitter.resetCounters();
+	mEncoder.reset();
+
+	// Registers the new queue storage with io_uring when requested. The kernel releases packets in the background,
+	// only the network thread keeps collecting them, so the audio thread never waits for it.
+	if (io_uring && !async)
+		cout << "io_uring needs async, falling back to socket" << endl;
+	else if (!mTransmitter.setUringEnabled(mQueue, io_uring, error))
+		cout << error << ", falling back to socket" << endl;
+
+	if (async)
+		startSendThread();
+}
+
+
+void VbanSender::updatePayloadSize()
+{
+	// Fill packets up to the MTU, minus the IP, UDP and VBAN headers
+	static constexpr int sStandardMtu = 1500;
+	int mtu = mMtu;
+	int payloadSize = mtu - (mIPv6 ? 40 : 20) - 8 - VBAN_HEADER_SIZE;
+
+	// Packets only grow beyond the VBAN limit on jumbo frame networks
+	if (mtu <= sStandardMtu)
+		payloadSize = std::min<int>(payloadSize, VBAN_DATA_MAX_SIZE);
+	mEncoder.setMaxPayloadSize(payloadSize);
+	checkChannelCount();
+}
+
+
+void VbanSender::checkChannelCount()
+{
+	// A frame of every shard has to fit in a packet, small packets leave room for fewer channels
+	int maxChannelCount = mEncoder.getMaxChannelCount();
+	if (mEncoder.getChannelCount() > maxChannelCount)
+		cerr << "Only " << maxChannelCount << " of " << mEncoder.getChannelCount() << " channels fit in " << PacketEncoder<VbanSender>::sMaxShards << " streams with this format and MTU, the other channels are not sent" << endl;
+}
+
+
+void VbanSender::startSendThread()
+{
+	mSendThreadRunning = true;
+	mSendThread = std::thread([this]() { sendThreadLoop(); });
+	mAsyncActive = true;
+}
+
+
+void VbanSender::stopSendThread()
+{
+	mAsyncActive = false;
+	mSendThreadRunning = false;
+	if (mSendThread.joinable())
+		mSendThread.join();
+}
+
+
+void VbanSender::sendThreadLoop()
+{
+	while (mSendThreadRunning)
+	{
+		auto packet = mQueue.front();
+		if (packet != nullptr && mPacer.isEnabled())
+		{
+			// Send the frames that are due and wait for the departure time of the next one.
+			// The packets of all shards of a frame share a departure time.
+			auto duration = PacketPacer::getDuration(*packet);
+			auto frames = mPacer.allowance(PacketPacer::Clock::now(), duration);
+			if (frames == 0)
+			{
+				mPacer.waitForNextDeparture();
+				continue;
+			}
+			auto count = mPacer.getPacketCount(mQueue, PacketEncoder<VbanSender>::sMaxShards, frames);
+			flushQueue(count);
+			mPacer.sent(frames, duration);
+			continue;
+		}
+
+		// Wait for packets, or for the socket to accept packets again
+		if (flushQueue() == 0)
+			std::this_thread::sleep_for(sSendThreadPollInterval);
+	}
 }
 
 
-void VbanSender::sendPacket(const std::vector<char>& data)
+size_t VbanSender::flushQueue(size_t maxPackets)
 {
-	// Send the message according to the number of frames written
-	// wait for destination socket to be ready
+	// Without an open socket the packets are discarded, at the rate they would have been sent
+	auto connection = mConnections.acquire();
+	if (connection == nullptr || !connection->mSocket.is_open() || connection->mEndpoints.empty())
+	{
+		mTransmitter.pop(mQueue, std::min(mQueue.size(), maxPackets));
+		return 0;
+	}
+
+	// Send the queued packets, batched into as few system calls as possible
+	mTransmitter.setTxTimeEnabled(connection->mTxTime);
 	asio::error_code asio_error_code;
-	mSocket.send_to(asio::buffer(&data.data()[0], data.size()), mRemoteEndpoint, 0, asio_error_code);
+	auto sent = mTransmitter.sendQueue(mQueue, connection->mSocket, connection->mEndpoints, asio_error_code, maxPackets);
 	if (asio_error_code)
 	{
 		cout << "Error sending message" << endl;
 		cout << "Error: " << asio_error_code.message() << endl;
 	}
+	return sent;
 }
 
 
-void VbanSender::operator()(audio_bundle input, audio_bundle output)
+void VbanSender::acquirePackets(PacketQueue::Packet** packets, size_t count)
+{
+	bool acquired = mQueue.acquire(packets, count);
+	if (!acquired && !mAsyncActive)
+	{
+		// The queue is full with packets of this signal vector, send them to free up slots
+		flushQueue();
+		acquired = mQueue.acquire(packets, count);
+	}
+
+	// Without free slots the encoder writes into the scratch packets, which are dropped when committed
+	mDroppingPackets = !acquired;
+	if (mDroppingPackets)
+		for (size_t i = 0; i < count; i++)
+			packets[i] = &mScratchPackets[i];
+}
+
+
+void VbanSender::commitPackets(size_t count)
 {
-	// Update the socket settings
-	if (mSocketSettingsDirty.check())
+	if (mDroppingPackets)
+	{
+		mDropCount.fetch_add(static_cast<int>(count), std::memory_order_relaxed);
+		return;
+	}
+
+	mQueue.commit(count);
+	if (mAsyncActive)
 	{
-		stopSocket();
-		startSocket();
+		int depth = static_cast<int>(mQueue.size());
+		if (depth > mQueueHighWater.load(std::memory_order_relaxed))
+			mQueueHighWater.store(depth, std::memory_order_relaxed);
 	}
+}
+
 
+void VbanSender::operator()(audio_bundle input, audio_bundle output)
+{
 	mEncoder.process(input.samples(), input.channel_count(), input.frame_count());
+
+	// Send the packets of this signal vector
+	if (!mAsyncActive)
+		flushQueue();
 }
 
 MIN_EXTERNAL(VbanSender);
@@ -3,13 +3,27 @@
 #include "c74_min.h"
 
 #include <vban/vban.h>
-#include <vban/vbanstreamencoder.h>
+
+#include "connectionthread.h"
+#include "packetencoder.h"
+#include "packetpacer.h"
+#include "packetqueue.h"
+#include "packettransmitter.h"
+#include "sampleconverter.h"
 
 #include <asio/ts/buffer.hpp>
 #include <asio/ts/internet.hpp>
 #include <asio/io_service.hpp>
+#include <asio/ip/multicast.hpp>
 #include <asio/system_error.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+
 #define VERSION "0.06"
 
 using namespace c74::min;
@@ -34,6 +48,38 @@ public:
 
 	outlet<> output { this, "(signal) Output Pass thru", "signal" };
 
+private:
+	// Declared before the attributes that configure them, their setters are called on construction
+	PacketEncoder<VbanSender> mEncoder{ *this };
+	PacketTransmitter mTransmitter;
+	PacketPacer mPacer;
+	std::atomic<int> mMtu = { 1500 };
+	std::atomic<bool> mIPv6 = { false };	// Whether the current socket sends over IPv6, which has a larger header
+
+	// Socket settings
+	struct Destination
+	{
+		symbol mHost;
+		int mPort;
+	};
+	symbol mIP = "127.0.0.1";
+	int mPort = 13251;
+	std::vector<Destination> mDestinations;		// Sent to in addition to mIP and mPort
+	int mMulticastTTL = 1;
+	bool mMulticastLoopback = false;
+	std::string mMulticastInterface;
+	std::string mAddressFamily = "any";
+	bool mTxTime = false;
+	bool mResolveCacheDirty = false;
+	std::mutex mSocketSettingsMutex;
+
+	// ASIO Socket, opened on a background thread whenever the socket settings change
+	asio::io_context 			mIOContext;
+	std::map<std::string, asio::ip::address> mResolveCache;	// Only accessed on the connection thread
+	ConnectionThread			mConnections{ [this]() { return openConnection(); } };
+
+public:
+
 	message<> active { this, "active", "Start or stop the sender",
 		MIN_FUNCTION{
 			if (args[0] == 1)
@@ -46,9 +92,11 @@ public:
 
 	message<> port { this, "port", "Set the port number",
 		MIN_FUNCTION{
-			std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
-			mPort = args[0];
-			mSocketSettingsDirty.set();
+			{
+				std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+				mPort = args[0];
+			}
+			mConnections.reconnect();
 			cout << "Setting port: " << args[0] << endl;
 			return {};
 		}
@@ -56,24 +104,72 @@ public:
 
 	message<> host { this, "host", "Set the IP address",
 		MIN_FUNCTION{
-			std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
-			mIP = args[0];
-			mSocketSettingsDirty.set();
+			{
+				std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+				mIP = args[0];
+			}
+			mConnections.reconnect();
 			cout << "Setting host: " << args[0] << endl;
 			return {};
 		}
 	};
 
+	message<> add_destination { this, "add_destination", "Also send the stream to a host and port",
+		MIN_FUNCTION{
+			if (args.size() < 2)
+			{
+				cerr << "add_destination expects a host and a port" << endl;
+				return {};
+			}
+			{
+				std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+				if (mDestinations.size() + 1 >= PacketTransmitter::sMaxDestinations)
+				{
+					cerr << "Maximum number of destinations reached" << endl;
+					return {};
+				}
+				mDestinations.push_back({ args[0], args[1] });
+			}
+			mConnections.reconnect();
+			cout << "Adding destination: " << args[0] << " port: " << args[1] << endl;
+			return {};
+		}
+	};
+
+	message<> remove_destination { this, "remove_destination", "Stop sending the stream to a host and port added with add_destination",
+		MIN_FUNCTION{
+			if (args.size() < 2)
+			{
+				cerr << "remove_destination expects a host and a port" << endl;
+				return {};
+			}
+			{
+				std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+				symbol host = args[0];
+				int port = args[1];
+				mDestinations.erase(std::remove_if(mDestinations.begin(), mDestinations.end(), [&](const Destination& destination) {
+					return destination.mHost == host && destination.mPort == port;
+				}), mDestinations.end());
+			}
+			mConnections.reconnect();
+			cout << "Removing destination: " << args[0] << " port: " << args[1] << endl;
+			return {};
+		}
+	};
+
 	message<> chan { this, "channels", "Set the number of channels",
 		MIN_FUNCTION{
 			int channelCount = args[0];
-			if (channelCount > VBAN_CHANNELS_MAX_NB)
+			if (channelCount > PacketEncoder<VbanSender>::sMaxChannelCount)
 			{
 				cerr << "Channel count " << channelCount << " not allowed, clamping to maximum." << endl;
-				channelCount = VBAN_CHANNELS_MAX_NB;
+				channelCount = PacketEncoder<VbanSender>::sMaxChannelCount;
 			}
 			cout << "Setting number of channels: " << channelCount << endl;
+			if (channelCount > VBAN_CHANNELS_MAX_NB)
+				cout << "Splitting into " << (channelCount + VBAN_CHANNELS_MAX_NB - 1) / VBAN_CHANNELS_MAX_NB << " streams" << endl;
 			mEncoder.setChannelCount(channelCount);
+			checkChannelCount();
 			return {};
 		}
 	};
@@ -87,10 +183,276 @@ public:
 
 	};
 
+	attribute<symbol> address_family { this, "address_family", "any",
+		description{ "Address family preferred when a host resolves to both IPv4 and IPv6 addresses." },
+		range{ "any", "ipv4", "ipv6" },
+		setter{ MIN_FUNCTION{
+			{
+				std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+				symbol family = args[0];
+				mAddressFamily = family.c_str();
+			}
+			mConnections.reconnect();
+			return args;
+		}}
+	};
+
+	message<> resolve_hosts { this, "resolve", "Look up the addresses of all hosts again instead of using the cached addresses",
+		MIN_FUNCTION{
+			{
+				std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+				mResolveCacheDirty = true;
+			}
+			mConnections.reconnect();
+			return {};
+		}
+	};
+
+	attribute<int> multicast_ttl { this, "multicast_ttl", 1,
+		description{ "Number of router hops packets sent to a multicast group can take." },
+		setter{ MIN_FUNCTION{
+			{
+				std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+				mMulticastTTL = args[0];
+			}
+			mConnections.reconnect();
+			return args;
+		}}
+	};
+
+	attribute<bool> multicast_loopback { this, "multicast_loopback", false,
+		description{ "Also deliver packets sent to a multicast group to receivers on this machine." },
+		setter{ MIN_FUNCTION{
+			{
+				std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+				mMulticastLoopback = args[0];
+			}
+			mConnections.reconnect();
+			return args;
+		}}
+	};
+
+	attribute<symbol> multicast_interface { this, "multicast_interface", "",
+		description{ "Network interface to send multicast packets from: its IPv4 address for IPv4 groups, or its index for IPv6 groups. Empty for the system default." },
+		setter{ MIN_FUNCTION{
+			{
+				std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+				symbol address = args[0];
+				mMulticastInterface = address.c_str();
+			}
+			mConnections.reconnect();
+			return args;
+		}}
+	};
+
+	attribute<bool> txtime { this, "txtime", false,
+		description{ "Stamp packets with a departure time derived from their frame counter and the samplerate, so the fq or etf qdisc sends them at sample accurate intervals (Linux only, needs batch)." },
+		setter{ MIN_FUNCTION{
+			{
+				std::lock_guard<std::mutex> lock(mSocketSettingsMutex);
+				mTxTime = args[0];
+			}
+			mConnections.reconnect();
+			return args;
+		}}
+	};
+
+	attribute<int> txtime_delay { this, "txtime_delay", 2000,
+		description{ "Time in microseconds between sending a packet and its departure time." },
+		setter{ MIN_FUNCTION{
+			mTransmitter.setTxTimeDelay(std::max<int>(args[0], 0));
+			return args;
+		}}
+	};
+
+	attribute<bool> txtime_active { this, "txtime_active", false,
+		description{ "Whether packets are sent with a departure time, false when the socket or the kernel rejected them." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mTransmitter.isTxTimeActive() }; } }
+	};
+
+	attribute<int> txtime_missed { this, "txtime_missed", 0,
+		description{ "Number of packets the kernel reported to have missed their departure time." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mTransmitter.getTxTimeMissedCount() }; } }
+	};
+
+	attribute<symbol> format { this, "format", "int16",
+		description{ "Sample format of the stream." },
+		range{ "int16", "int24", "int32", "float32" },
+		setter{ MIN_FUNCTION{
+			symbol format = args[0];
+			if (format == "int24")
+				mEncoder.setSampleFormat(SampleConverter::Format::Int24);
+			else if (format == "int32")
+				mEncoder.setSampleFormat(SampleConverter::Format::Int32);
+			else if (format == "float32")
+				mEncoder.setSampleFormat(SampleConverter::Format::Float32);
+			else
+				mEncoder.setSampleFormat(SampleConverter::Format::Int16);
+			checkChannelCount();
+			return args;
+		}}
+	};
+
+	attribute<symbol> codec { this, "codec", "pcm",
+		description{ "Payload codec. lossless compresses integer formats per packet and sends them with the VBAN user codec, receivers have to support it. Packets that don't compress and float32 streams are sent as PCM." },
+		range{ "pcm", "lossless" },
+		setter{ MIN_FUNCTION{
+			symbol codec = args[0];
+			mEncoder.setLossless(codec == "lossless");
+			return args;
+		}}
+	};
+
+	attribute<bool> dtx { this, "dtx", false,
+		description{ "Discontinuous transmission: packets in which all channels of a stream are silent are not sent, apart from an empty keep-alive packet every 100 ms. Receivers play silence for the missing packets." },
+		setter{ MIN_FUNCTION{
+			mEncoder.setDtx(args[0]);
+			return args;
+		}}
+	};
+
+	attribute<number> dtx_threshold { this, "dtx_threshold", 0.0,
+		description{ "Level in dBFS up to which samples count as silent for dtx. 0, the default, follows the sample format: only samples sent as zero are silent, below half a step of the integer formats and exactly zero for float32, so dtx is lossless. A negative level also treats quiet noise as silence, samples above half a step of the format are then lost." },
+		setter{ MIN_FUNCTION{
+			double threshold = args[0];
+			mEncoder.setSilenceThreshold(threshold >= 0.0 ? -1.0 : std::pow(10.0, threshold / 20.0));
+			return args;
+		}}
+	};
+
+	attribute<int> dtx_skipped { this, "dtx_skipped", 0,
+		description{ "Number of silent packets that were not sent because of dtx." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mEncoder.getSkippedPacketCount() }; } }
+	};
+
+	attribute<int> mtu { this, "mtu", 1500,
+		description{ "MTU of the network. Packets are filled with as many frames as fit, up to 256. Up to 1500 bytes packets stay within the VBAN size limit, larger MTUs (jumbo frames) send larger packets that only receivers accepting them understand." },
+		setter{ MIN_FUNCTION{
+			mMtu = std::max<int>(576, std::min<int>(args[0], 9000));
+			updatePayloadSize();
+			return { mMtu.load() };
+		}}
+	};
+
+	attribute<int> frames_per_packet { this, "frames_per_packet", 0,
+		description{ "Number of frames in every packet, follows from the channel count, sample format and MTU." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mEncoder.getFramesPerPacket() }; } }
+	};
+
+	attribute<bool> async { this, "async", false,
+		description{ "Send packets from a dedicated network thread instead of the audio thread. Takes effect on the next dspsetup." }
+	};
+
+	attribute<int> queue_size { this, "queue_size", 512,
+		description{ "Maximum number of packets waiting to be sent. Takes effect on the next dspsetup." }
+	};
+
+	attribute<bool> batch { this, "batch", true,
+		description{ "Hand all packets of a signal vector to the kernel in a single call (Linux only)." },
+		setter{ MIN_FUNCTION{
+			mTransmitter.setBatchingEnabled(args[0]);
+			return args;
+		}}
+	};
+
+	attribute<bool> gso { this, "gso", false,
+		description{ "Let the kernel split equal sized packets of a batch with UDP generic segmentation offload (Linux only)." },
+		setter{ MIN_FUNCTION{
+			mTransmitter.setGsoEnabled(args[0]);
+			return args;
+		}}
+	};
+
+	attribute<bool> gso_active { this, "gso_active", false,
+		description{ "Whether packets are sent with UDP generic segmentation offload, false when the kernel rejected it." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mTransmitter.isGsoActive() }; } }
+	};
+
+	attribute<bool> io_uring { this, "io_uring", false,
+		description{ "Send packets through io_uring from registered buffers, falls back to the socket when unavailable (Linux only). Needs async. Takes effect on the next dspsetup." }
+	};
+
+	attribute<bool> pacing { this, "pacing", false,
+		description{ "Spread the packets of a signal vector evenly over its duration instead of sending them in one burst. Only applies to the async network thread." },
+		setter{ MIN_FUNCTION{
+			mPacer.setEnabled(args[0]);
+			return args;
+		}}
+	};
+
+	attribute<int> burst { this, "burst", 4,
+		description{ "Maximum number of packets sent back to back when pacing, after the network thread fell behind or was idle." },
+		setter{ MIN_FUNCTION{
+			mPacer.setBurstBudget(std::max<int>(args[0], 1));
+			return args;
+		}}
+	};
+
+	attribute<int> queue_depth { this, "queue_depth", 0,
+		description{ "Number of packets currently waiting for the network thread." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { static_cast<int>(mQueue.size()) }; } }
+	};
+
+	attribute<int> queue_highwater { this, "queue_highwater", 0,
+		description{ "Highest number of packets that have been waiting for the network thread." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mQueueHighWater.load() }; } }
+	};
+
+	attribute<symbol> overload { this, "overload", "drop_newest",
+		description{ "What to do when the socket can't accept more packets: stop sending until the next flush and drop the newest packets when the queue is full, drop the oldest queued packets, or retry for up to spin_time microseconds per flush." },
+		range{ "drop_newest", "drop_oldest", "spin" },
+		setter{ MIN_FUNCTION{
+			symbol policy = args[0];
+			if (policy == "drop_oldest")
+				mTransmitter.setOverloadPolicy(PacketTransmitter::OverloadPolicy::DropOldest);
+			else if (policy == "spin")
+				mTransmitter.setOverloadPolicy(PacketTransmitter::OverloadPolicy::Spin);
+			else
+				mTransmitter.setOverloadPolicy(PacketTransmitter::OverloadPolicy::DropNewest);
+			return args;
+		}}
+	};
+
+	attribute<int> spin_time { this, "spin_time", 200,
+		description{ "Maximum time in microseconds per flush that packets are retried with the spin overload policy." },
+		setter{ MIN_FUNCTION{
+			mTransmitter.setSpinTime(std::max<int>(args[0], 0));
+			return args;
+		}}
+	};
+
+	attribute<int> would_block { this, "would_block", 0,
+		description{ "Number of times the socket could not accept more packets." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mTransmitter.getWouldBlockCount() }; } }
+	};
+
+	attribute<int> dropped { this, "dropped", 0,
+		description{ "Number of packets dropped because the queue or the socket could not keep up." },
+		readonly{ true },
+		getter{ MIN_GETTER_FUNCTION{ return { mDropCount.load() + mTransmitter.getDropCount() }; } }
+	};
+
+	// Sizes the payload for a new connection on the main thread, it changes the encoder settings and posts to the max window
+	queue<> mPayloadSizeUpdate { this,
+		MIN_FUNCTION{
+			updatePayloadSize();
+			return {};
+		}
+	};
+
 	// Post to max window, but only when the class is loaded the first time
 	message<> maxclass_setup{this, "maxclass_setup",
 		MIN_FUNCTION{
 			cout << "4ds.vbansend~ " << VERSION << endl;
+			cout << "Sample conversion: " << SampleConverter::getInstructionSet() << endl;
 			return {};
 		}
 	};
@@ -103,27 +465,32 @@ public:
 	};
 
 public:
-	void sendPacket(const std::vector<char>& data);
+	void acquirePackets(PacketQueue::Packet** packets, size_t count);
+	void commitPackets(size_t count);
 
 private:
-	void startSocket();
-	void stopSocket();
+	std::unique_ptr<Connection> openConnection();
+	bool resolve(const std::string& host, const std::string& family, asio::ip::address& address);
 	void setupDSP();
+	void updatePayloadSize();
+	void checkChannelCount();
+	void startSendThread();
+	void stopSendThread();
+	void sendThreadLoop();
+	size_t flushQueue(size_t maxPackets = SIZE_MAX);
 
 private:
 	std::vector<std::unique_ptr<inlet<>>> mInlets;
-	vban::VBANStreamEncoder<VbanSender> mEncoder;
 
-	// Socket settings
-	symbol mIP = "127.0.0.1";
-	int mPort = 13251;
-	std::mutex mSocketSettingsMutex;
-	vban::DirtyFlag mSocketSettingsDirty;
-
-	// ASIO Socket
-	asio::io_context 			mIOContext;
-	asio::ip::udp::endpoint 	mRemoteEndpoint;
-	asio::ip::udp::socket       mSocket{ mIOContext };
+	// Packets waiting to be sent, by the network thread in async mode or at the end of the signal vector otherwise
+	PacketQueue					mQueue;
+	std::thread					mSendThread;
+	std::atomic<bool>			mSendThreadRunning = { false };
+	std::atomic<bool>			mAsyncActive = { false };
+	std::atomic<int>			mQueueHighWater = { 0 };
+	std::atomic<int>			mDropCount = { 0 };
+	std::vector<PacketQueue::Packet> mScratchPackets;	// Encoded into when the queue is full, never sent
+	bool						mDroppingPackets = false;
 };
 
 
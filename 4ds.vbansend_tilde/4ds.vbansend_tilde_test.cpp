@@ -0,0 +1,448 @@
+#include "c74_min_unittest.h"
+
+#include "interleaver.h"
+#include "packetencoder.h"
+#include "packetpacer.h"
+#include "packetqueue.h"
+#include "sampleconverter.h"
+#include "silencedetector.h"
+#include "silencegapfiller.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+
+// Counts the allocations made on the calling thread, the encoder runs on the audio thread and may never allocate.
+// Every form of the global allocator is replaced, aligned ones included: packets are over-aligned. The operators are
+// kept out of line, or GCC sees free() on memory from operator new where it inlines them and warns.
+
+#if defined(_MSC_VER)
+#define VBAN_NOINLINE __declspec(noinline)
+#else
+#define VBAN_NOINLINE __attribute__((noinline))
+#endif
+
+static thread_local int sAllocationCount = 0;
+
+VBAN_NOINLINE static void* allocate(std::size_t size, std::size_t alignment)
+{
+	// The address malloc() returned is stored in front of the aligned block
+	sAllocationCount++;
+	auto memory = static_cast<char*>(std::malloc(size + alignment + sizeof(void*)));
+	if (memory == nullptr)
+		throw std::bad_alloc();
+	auto address = reinterpret_cast<std::uintptr_t>(memory + sizeof(void*));
+	auto aligned = reinterpret_cast<char*>((address + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1));
+	std::memcpy(aligned - sizeof(void*), &memory, sizeof(void*));
+	return aligned;
+}
+
+VBAN_NOINLINE static void release(void* memory) noexcept
+{
+	if (memory == nullptr)
+		return;
+	void* block;
+	std::memcpy(&block, static_cast<char*>(memory) - sizeof(void*), sizeof(void*));
+	std::free(block);
+}
+
+VBAN_NOINLINE void* operator new(std::size_t size) { return allocate(size, alignof(std::max_align_t)); }
+VBAN_NOINLINE void* operator new[](std::size_t size) { return allocate(size, alignof(std::max_align_t)); }
+VBAN_NOINLINE void* operator new(std::size_t size, std::align_val_t alignment) { return allocate(size, static_cast<std::size_t>(alignment)); }
+VBAN_NOINLINE void* operator new[](std::size_t size, std::align_val_t alignment) { return allocate(size, static_cast<std::size_t>(alignment)); }
+VBAN_NOINLINE void operator delete(void* memory) noexcept { release(memory); }
+VBAN_NOINLINE void operator delete[](void* memory) noexcept { release(memory); }
+VBAN_NOINLINE void operator delete(void* memory, std::size_t) noexcept { release(memory); }
+VBAN_NOINLINE void operator delete[](void* memory, std::size_t) noexcept { release(memory); }
+VBAN_NOINLINE void operator delete(void* memory, std::align_val_t) noexcept { release(memory); }
+VBAN_NOINLINE void operator delete[](void* memory, std::align_val_t) noexcept { release(memory); }
+VBAN_NOINLINE void operator delete(void* memory, std::size_t, std::align_val_t) noexcept { release(memory); }
+VBAN_NOINLINE void operator delete[](void* memory, std::size_t, std::align_val_t) noexcept { release(memory); }
+
+
+// Collects the packets of an encoder in a queue, like the sender does
+class TestSender
+{
+public:
+	TestSender() : mScratchPackets(PacketEncoder<TestSender>::sMaxShards) { mQueue.resize(4096); }
+
+	void acquirePackets(PacketQueue::Packet** packets, size_t count)
+	{
+		// Packets that don't fit the queue are encoded into scratch packets and dropped
+		mDropping = !mQueue.acquire(packets, count);
+		if (mDropping)
+			for (size_t i = 0; i < count; i++)
+				packets[i] = &mScratchPackets[i];
+	}
+
+	void commitPackets(size_t count)
+	{
+		if (!mDropping)
+			mQueue.commit(count);
+	}
+
+	PacketQueue mQueue;
+
+private:
+	std::vector<PacketQueue::Packet> mScratchPackets;
+	bool mDropping = false;
+};
+
+
+// Runs the encoder over a number of signal vectors and returns the allocations it made
+static int countAllocations(PacketEncoder<TestSender>& encoder, TestSender& sender, int channelCount, int frameCount, int vectorCount)
+{
+	std::vector<std::vector<double>> samples(static_cast<size_t>(channelCount), std::vector<double>(static_cast<size_t>(frameCount)));
+	std::vector<double*> input;
+	for (auto& channel : samples)
+	{
+		for (size_t frame = 0; frame < channel.size(); frame++)
+			channel[frame] = 0.5 * std::sin(0.01 * static_cast<double>(frame + input.size()));
+		input.push_back(channel.data());
+	}
+
+	int allocationCount = 0;
+	for (int vector = 0; vector < vectorCount; vector++)
+	{
+		sAllocationCount = 0;
+		encoder.process(input.data(), channelCount, frameCount);
+		allocationCount += sAllocationCount;
+		sender.mQueue.pop(sender.mQueue.size());
+	}
+	return allocationCount;
+}
+
+
+TEST_CASE("PacketEncoder::process does not allocate")
+{
+	TestSender sender;
+	PacketEncoder<TestSender> encoder(sender);
+	encoder.setSampleRateFormat(3);
+	encoder.setMaxPayloadSize(VBAN_DATA_MAX_SIZE);
+
+	SECTION("stereo int16")
+	{
+		encoder.setChannelCount(2);
+		REQUIRE(countAllocations(encoder, sender, 2, 512, 16) == 0);
+	}
+
+	SECTION("sharded int24 with lossless compression and dtx")
+	{
+		encoder.setChannelCount(300);
+		encoder.setSampleFormat(SampleConverter::Format::Int24);
+		encoder.setLossless(true);
+		encoder.setDtx(true);
+		REQUIRE(countAllocations(encoder, sender, 300, 64, 16) == 0);
+		REQUIRE(encoder.getShardCount() > 1);
+	}
+
+	SECTION("settings changed between signal vectors")
+	{
+		std::string name = "Renamed";
+		for (int channelCount = 1; channelCount <= 64; channelCount *= 2)
+		{
+			encoder.setChannelCount(channelCount);
+			encoder.setSampleFormat(channelCount % 4 == 0 ? SampleConverter::Format::Float32 : SampleConverter::Format::Int32);
+			encoder.setStreamName(name);
+			REQUIRE(countAllocations(encoder, sender, channelCount, 256, 4) == 0);
+		}
+	}
+
+	REQUIRE(sender.mQueue.size() == 0);
+}
+
+
+TEST_CASE("PacketEncoder keeps packets within the payload size when the shards are full")
+{
+	TestSender sender;
+	PacketEncoder<TestSender> encoder(sender);
+	encoder.setSampleRateFormat(3);
+	encoder.setSampleFormat(SampleConverter::Format::Int32);
+	encoder.setMaxPayloadSize(500);
+	encoder.setChannelCount(PacketEncoder<TestSender>::sMaxChannelCount);
+
+	// 125 channels of 4 bytes fill a payload, the channels beyond 16 such streams are not sent
+	REQUIRE(encoder.getMaxChannelCount() == 16 * 125);
+	REQUIRE(countAllocations(encoder, sender, PacketEncoder<TestSender>::sMaxChannelCount, 8, 1) == 0);
+	REQUIRE(encoder.getShardCount() == PacketEncoder<TestSender>::sMaxShards);
+	sender.mQueue.pop(sender.mQueue.size());
+
+	std::vector<double> samples(1, 0.5);
+	std::vector<double*> input(PacketEncoder<TestSender>::sMaxChannelCount, samples.data());
+	encoder.process(input.data(), static_cast<int>(input.size()), 1);
+	int channelCount = 0;
+	while (auto packet = sender.mQueue.front())
+	{
+		VBanHeader header;
+		std::memcpy(&header, packet->header(), VBAN_HEADER_SIZE);
+		REQUIRE(packet->mPayloadSize <= 500);
+		REQUIRE(header.format_nbs == 0);
+		channelCount += header.format_nbc + 1;
+		sender.mQueue.pop(1);
+	}
+	REQUIRE(channelCount == encoder.getMaxChannelCount());
+}
+
+TEST_CASE("PacketPacer paces the frames of a stream with silent shards")
+{
+	TestSender sender;
+	PacketEncoder<TestSender> encoder(sender);
+	encoder.setSampleRateFormat(3);
+	encoder.setSampleFormat(SampleConverter::Format::Int32);
+	encoder.setMaxPayloadSize(500);
+	encoder.setDtx(true);
+
+	// Two shards of a frame per packet, the first one silent: only its keep-alive is sent with the first frame
+	constexpr int channelCount = 250;
+	constexpr int frameCount = 8;
+	encoder.setChannelCount(channelCount);
+	std::vector<double> silence(frameCount, 0.0);
+	std::vector<double> sound(frameCount, 0.5);
+	std::vector<double*> input(channelCount, silence.data());
+	std::fill(input.begin() + channelCount / 2, input.end(), sound.data());
+	encoder.process(input.data(), channelCount, frameCount);
+	REQUIRE(encoder.getShardCount() == 2);
+	REQUIRE(sender.mQueue.size() == frameCount + 1);
+
+	PacketPacer pacer;
+	size_t frames = 4;
+	REQUIRE(pacer.getPacketCount(sender.mQueue, PacketEncoder<TestSender>::sMaxShards, frames) == 5);
+	REQUIRE(frames == 4);
+	frames = 2 * frameCount;
+	REQUIRE(pacer.getPacketCount(sender.mQueue, PacketEncoder<TestSender>::sMaxShards, frames) == frameCount + 1);
+	REQUIRE(frames == frameCount);
+}
+
+// Samples that hit every branch of the conversion: NaN, infinities, clipping, denormals and exact steps of the formats
+static std::vector<double> makeConversionInput()
+{
+	std::vector<double> input = {
+		std::numeric_limits<double>::quiet_NaN(), -std::numeric_limits<double>::quiet_NaN(),
+		std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+		1.0, -1.0, 1.0000001, -1.0000001, 0.0, -0.0,
+		std::numeric_limits<double>::denorm_min(), -std::numeric_limits<double>::denorm_min(), 1e-310, -1e-310,
+		std::numeric_limits<double>::min(), 1e-40, -1e-45,
+		1.0 / 32767.0, -1.0 / 32767.0, 0.5 / 32767.0, 1.0 / 8388607.0, 1.0 / 2147483647.0, 0.99999999999, -0.99999999999 };
+
+	std::mt19937 random(1);
+	std::uniform_real_distribution<double> distribution(-1.5, 1.5);
+	while (input.size() < 4096)
+		input.push_back(distribution(random));
+	return input;
+}
+
+
+TEST_CASE("SampleConverter kernels match the scalar kernels")
+{
+	auto input = makeConversionInput();
+	const SampleConverter::Format formats[] = { SampleConverter::Format::Int16, SampleConverter::Format::Int24, SampleConverter::Format::Int32, SampleConverter::Format::Float32 };
+	REQUIRE(SampleConverter::getSupportedKernel(SampleConverter::Format::Int16, 0) == SampleConverter::getKernel(SampleConverter::Format::Int16));
+
+	for (int index = 0; SampleConverter::getSupportedInstructionSet(index) != nullptr; index++)
+	{
+		for (auto format : formats)
+		{
+			auto kernel = SampleConverter::getSupportedKernel(format, index);
+			auto scalarKernel = SampleConverter::getScalarKernel(format);
+			auto sampleSize = static_cast<size_t>(SampleConverter::getSampleSize(format));
+			INFO(SampleConverter::getSupportedInstructionSet(index) << " format " << static_cast<int>(format));
+
+			// Every length of the tail after the vectors, from unaligned input and output, and one long run
+			for (size_t count = 0; count <= 70; count++)
+			{
+				for (size_t offset = 0; offset < 2; offset++)
+				{
+					INFO("count " << count << " offset " << offset);
+					std::vector<char> expected(count * sampleSize + 16, 0x55);
+					std::vector<char> output(expected.size(), 0x55);
+					scalarKernel(input.data() + offset, expected.data() + offset, count);
+					kernel(input.data() + offset, output.data() + offset, count);
+					REQUIRE(output == expected);
+				}
+			}
+
+			std::vector<char> expected(input.size() * sampleSize);
+			std::vector<char> output(expected.size());
+			scalarKernel(input.data(), expected.data(), input.size());
+			kernel(input.data(), output.data(), input.size());
+			REQUIRE(output == expected);
+		}
+	}
+}
+
+
+TEST_CASE("Interleaver kernels match the scalar kernel")
+{
+	// Planar input with a distinct value for every sample, and room for an offset
+	constexpr int maxChannelCount = 256;
+	constexpr int maxFrameCount = 40;
+	std::vector<std::vector<double>> samples(maxChannelCount, std::vector<double>(maxFrameCount + 1));
+	std::vector<const double*> input;
+	for (size_t channel = 0; channel < samples.size(); channel++)
+	{
+		for (size_t frame = 0; frame < samples[channel].size(); frame++)
+			samples[channel][frame] = static_cast<double>(channel * 1000 + frame);
+		input.push_back(samples[channel].data());
+	}
+
+	REQUIRE(Interleaver::getSupportedKernel(0) == Interleaver::getKernel());
+	for (int index = 0; Interleaver::getSupportedInstructionSet(index) != nullptr; index++)
+	{
+		auto kernel = Interleaver::getSupportedKernel(index);
+		INFO(Interleaver::getSupportedInstructionSet(index));
+
+		// Every remainder of the tiles, channels of the output frames beyond channelCount stay untouched
+		for (int channelCount : { 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 12, 15, 16, 17, 23, 64, 255, 256 })
+		{
+			for (int frameCount = 0; frameCount <= maxFrameCount; frameCount++)
+			{
+				for (size_t offset = 0; offset < 2; offset++)
+				{
+					INFO("channels " << channelCount << " frames " << frameCount << " offset " << offset);
+					int outputStride = channelCount + 3;
+					std::vector<double> expected(static_cast<size_t>(frameCount * outputStride), -1.0);
+					std::vector<double> output(expected.size(), -1.0);
+					Interleaver::getScalarKernel()(input.data(), offset, channelCount, frameCount, expected.data(), outputStride);
+					kernel(input.data(), offset, channelCount, frameCount, output.data(), outputStride);
+					REQUIRE(output == expected);
+				}
+			}
+		}
+	}
+}
+
+
+TEST_CASE("SilenceDetector kernels match the scalar kernel")
+{
+	const double thresholds[] = { 0.0, SampleConverter::getZeroThreshold(SampleConverter::Format::Int16), 1e-3 };
+	const double loudSamples[] = { std::numeric_limits<double>::quiet_NaN(), -std::numeric_limits<double>::infinity(), 1.0, -1e-3, 1e-3,
+		std::nextafter(1e-3, 1.0), -std::numeric_limits<double>::denorm_min(), SampleConverter::getZeroThreshold(SampleConverter::Format::Int16), -0.0 };
+
+	REQUIRE(SilenceDetector::getSupportedKernel(0) == SilenceDetector::getKernel());
+	for (int index = 0; SilenceDetector::getSupportedInstructionSet(index) != nullptr; index++)
+	{
+		auto kernel = SilenceDetector::getSupportedKernel(index);
+		INFO(SilenceDetector::getSupportedInstructionSet(index));
+		for (auto threshold : thresholds)
+		{
+			// Quiet samples of every length, and a single sample at every position that may or may not be loud
+			for (size_t count = 0; count <= 40; count++)
+			{
+				std::vector<double> samples(count, threshold * 0.5);
+				INFO("threshold " << threshold << " count " << count);
+				REQUIRE(kernel(samples.data(), count, threshold) == SilenceDetector::getScalarKernel()(samples.data(), count, threshold));
+				for (size_t position = 0; position < count; position++)
+				{
+					for (auto loud : loudSamples)
+					{
+						samples[position] = loud;
+						INFO("sample " << loud << " at " << position);
+						REQUIRE(kernel(samples.data(), count, threshold) == SilenceDetector::getScalarKernel()(samples.data(), count, threshold));
+						samples[position] = threshold * 0.5;
+					}
+				}
+			}
+		}
+	}
+}
+
+
+// Plays the packets of a queue the way a receiver does, keep-alives and gaps of the frame counter as silence
+static std::vector<char> receive(PacketQueue& queue, SilenceGapFiller& filler, int sampleSize)
+{
+	std::vector<char> stream;
+	while (auto packet = queue.front())
+	{
+		VBanHeader header;
+		std::memcpy(&header, packet->header(), VBAN_HEADER_SIZE);
+		auto frameCount = static_cast<size_t>(header.format_nbs + 1);
+		int channelCount = header.format_nbc + 1;
+		auto frameSize = static_cast<size_t>(channelCount * sampleSize);
+
+		auto gap = static_cast<size_t>(filler.getGapFrameCount(header));
+		stream.resize(stream.size() + gap * frameSize);
+		SilenceGapFiller::fill(stream.data() + stream.size() - gap * frameSize, gap, channelCount, sampleSize);
+
+		stream.resize(stream.size() + frameCount * frameSize);
+		auto frames = stream.data() + stream.size() - frameCount * frameSize;
+		if (SilenceGapFiller::isKeepAlive(header, packet->mPayloadSize))
+			SilenceGapFiller::fill(frames, frameCount, channelCount, sampleSize);
+		else
+		{
+			REQUIRE(packet->mPayloadSize == frameCount * frameSize);
+			std::memcpy(frames, packet->payload(), packet->mPayloadSize);
+		}
+		queue.pop(1);
+	}
+	return stream;
+}
+
+
+TEST_CASE("A stream sent with dtx plays back unchanged")
+{
+	auto format = GENERATE(SampleConverter::Format::Int16, SampleConverter::Format::Int24, SampleConverter::Format::Int32, SampleConverter::Format::Float32);
+	int sampleSize = SampleConverter::getSampleSize(format);
+	INFO("format " << static_cast<int>(format));
+
+	// Bursts of sound between silences of a few keep-alive intervals. The first half of every silence has noise below
+	// the default threshold of the format, the second half noise of a few steps of the format that has to be sent.
+	// Float32 silence is zero, not negative zero, which would play back as zero: equal, but not bit for bit.
+	constexpr int channelCount = 2;
+	constexpr int frameCount = 64;
+	constexpr int vectorCount = 2000;
+	bool isFloat = format == SampleConverter::Format::Float32;
+	auto quiet = isFloat ? 0.0 : SampleConverter::getZeroThreshold(format) * 0.9;
+	auto noise = isFloat ? 1e-9 : SampleConverter::getZeroThreshold(format) * 4.0;
+	std::vector<std::vector<double>> samples(channelCount, std::vector<double>(static_cast<size_t>(frameCount * vectorCount)));
+	for (size_t frame = 0; frame < samples[0].size(); frame++)
+	{
+		bool loud = (frame / 20000) % 3 == 1;
+		auto level = (frame / 10000) % 2 == 0 ? quiet : noise;
+		for (size_t channel = 0; channel < samples.size(); channel++)
+			samples[channel][frame] = loud ? 0.5 * std::sin(0.01 * static_cast<double>(frame * (channel + 1))) : (frame % 2 == 1 && level > 0.0 ? -level : level);
+	}
+
+	// The same signal with and without dtx
+	TestSender sender;
+	TestSender dtxSender;
+	PacketEncoder<TestSender> encoder(sender);
+	PacketEncoder<TestSender> dtxEncoder(dtxSender);
+	for (auto current : { &encoder, &dtxEncoder })
+	{
+		current->setSampleRateFormat(3);
+		current->setChannelCount(channelCount);
+		current->setSampleFormat(format);
+	}
+	dtxEncoder.setDtx(true);
+
+	std::vector<char> expected;
+	std::vector<char> played;
+	SilenceGapFiller filler;
+	SilenceGapFiller dtxFiller;
+	for (int vector = 0; vector < vectorCount; vector++)
+	{
+		double* input[channelCount] = { samples[0].data() + vector * frameCount, samples[1].data() + vector * frameCount };
+		encoder.process(input, channelCount, frameCount);
+		dtxEncoder.process(input, channelCount, frameCount);
+		auto stream = receive(sender.mQueue, filler, sampleSize);
+		expected.insert(expected.end(), stream.begin(), stream.end());
+		stream = receive(dtxSender.mQueue, dtxFiller, sampleSize);
+		played.insert(played.end(), stream.begin(), stream.end());
+	}
+
+	// Packets skipped after the last keep-alive are not known to the receiver yet
+	REQUIRE(dtxEncoder.getSkippedPacketCount() > 0);
+	REQUIRE(played.size() <= expected.size());
+	REQUIRE(played.size() > expected.size() / 2);
+	auto mismatch = std::mismatch(played.begin(), played.end(), expected.begin());
+	REQUIRE(mismatch.first - played.begin() == static_cast<std::ptrdiff_t>(played.size()));
+}
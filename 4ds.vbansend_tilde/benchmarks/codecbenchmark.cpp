@@ -0,0 +1,129 @@
+#include "losslesscodec.h"
+#include "sampleconverter.h"
+
+#include <vban/vban.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+/**
+ * Compresses packets of generated signals with LosslessCodec and reports the compression ratio and the time spent per
+ * sample to encode and decode them, for every integer sample format and a few channel counts.
+ * Packets are as large as PacketEncoder makes them for a standard MTU. Like the encoder, packets that don't get
+ * smaller are counted at their PCM size. Every packet is decoded and compared with its PCM payload.
+ *
+ * Usage: 4ds.vbansend_tilde_codec_benchmark [packet count]
+ */
+
+enum class Signal
+{
+	Silence,
+	Tonal,			// A few sines with a little noise, like music
+	Stems,			// A quarter of the channels play, the others are silent, like a multitrack session
+	Noise			// White noise at full scale, doesn't compress
+};
+
+struct SignalInfo
+{
+	Signal mSignal;
+	const char* mName;
+};
+
+static const SignalInfo sSignals[] = {
+	{ Signal::Silence, "silence" },
+	{ Signal::Tonal, "tonal" },
+	{ Signal::Stems, "stems" },
+	{ Signal::Noise, "noise" },
+};
+
+static const SampleConverter::Format sFormats[] = { SampleConverter::Format::Int16, SampleConverter::Format::Int24, SampleConverter::Format::Int32 };
+static const char* sFormatNames[] = { "int16", "int24", "int32" };
+static const int sChannelCounts[] = { 2, 16, 64 };
+
+
+static double generate(Signal signal, int channel, int channelCount, int64_t frame, std::mt19937& random, std::normal_distribution<double>& noise)
+{
+	auto time = static_cast<double>(frame);
+	switch (signal)
+	{
+		case Signal::Silence:
+			return 0.0;
+		case Signal::Tonal:
+			return 0.3 * std::sin(time * 0.03 * (channel % 7 + 1)) + 0.2 * std::sin(time * 0.011 * (channel % 3 + 1)) + 0.001 * noise(random);
+		case Signal::Stems:
+			return channel < std::max(1, channelCount / 4) ? 0.3 * std::sin(time * 0.02 * (channel + 1)) + 0.001 * noise(random) : 0.0;
+		default:
+			return std::max(-1.0, std::min(1.0, 0.5 * noise(random)));
+	}
+}
+
+
+static void run(Signal signal, const char* signalName, int formatIndex, int channelCount, int packetCount)
+{
+	auto format = sFormats[formatIndex];
+	int sampleSize = SampleConverter::getSampleSize(format);
+	int frameCount = std::max(1, std::min<int>(VBAN_SAMPLES_MAX_NB, VBAN_DATA_MAX_SIZE / (channelCount * sampleSize)));
+	auto sampleCount = static_cast<size_t>(frameCount * channelCount);
+	auto convert = SampleConverter::getKernel(format);
+
+	std::mt19937 random(1);
+	std::normal_distribution<double> noise(0.0, 1.0);
+	std::vector<double> samples(sampleCount);
+	std::vector<char> pcm(sampleCount * static_cast<size_t>(sampleSize));
+	std::vector<char> compressed(pcm.size());
+	std::vector<char> decoded(pcm.size());
+
+	size_t pcmSize = 0;
+	size_t payloadSize = 0;
+	double encodeTime = 0.0;
+	double decodeTime = 0.0;
+	int compressedCount = 0;
+	int errorCount = 0;
+	for (int packet = 0; packet < packetCount; packet++)
+	{
+		for (int frame = 0; frame < frameCount; frame++)
+			for (int channel = 0; channel < channelCount; channel++)
+				samples[static_cast<size_t>(frame * channelCount + channel)] = generate(signal, channel, channelCount, static_cast<int64_t>(packet) * frameCount + frame, random, noise);
+		convert(samples.data(), pcm.data(), sampleCount);
+
+		auto start = std::chrono::steady_clock::now();
+		auto size = LosslessCodec::encode(pcm.data(), frameCount, channelCount, sampleSize, compressed.data(), pcm.size() - 1);
+		encodeTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		pcmSize += pcm.size();
+		payloadSize += size > 0 ? size : pcm.size();
+		if (size == 0)
+			continue;
+
+		compressedCount++;
+		start = std::chrono::steady_clock::now();
+		bool valid = LosslessCodec::decode(compressed.data(), size, frameCount, channelCount, sampleSize, decoded.data());
+		decodeTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (!valid || decoded != pcm)
+			errorCount++;
+	}
+
+	auto totalSamples = static_cast<double>(sampleCount) * packetCount;
+	std::printf("%-8s %-7s %8d %7d %7.3f %10.1f %10.1f %11d %7d\n", signalName, sFormatNames[formatIndex], channelCount, frameCount,
+		static_cast<double>(payloadSize) / static_cast<double>(pcmSize), encodeTime * 1e9 / totalSamples,
+		compressedCount > 0 ? decodeTime * 1e9 / (static_cast<double>(sampleCount) * compressedCount) : 0.0, compressedCount, errorCount);
+}
+
+
+int main(int argc, char** argv)
+{
+	int packetCount = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+	std::printf("%d packets per run, ratio of payload to PCM size, ns per sample\n", packetCount);
+	std::printf("%-8s %-7s %8s %7s %7s %10s %10s %11s %7s\n", "signal", "format", "channels", "frames", "ratio", "encode", "decode", "compressed", "errors");
+	for (const auto& signal : sSignals)
+		for (int formatIndex = 0; formatIndex < 3; formatIndex++)
+			for (int channelCount : sChannelCounts)
+				run(signal.mSignal, signal.mName, formatIndex, channelCount, packetCount);
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include "sampleconverter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define VBAN_BENCHMARK_TSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+/**
+ * Converts a block of samples to every sample format with the scalar kernels and the kernels of every instruction set
+ * the CPU supports, and reports the time spent per sample. On x86 the time is also given in cycles of the time stamp
+ * counter, which runs at the nominal frequency of the CPU whatever its actual clock.
+ * The block stays in the cache, so this measures the kernels and not the memory.
+ *
+ * Usage: 4ds.vbansend_tilde_conversion_benchmark [samples per block] [repetitions]
+ */
+
+static constexpr int sTrialCount = 5;
+
+
+struct Timing
+{
+	double mNanoseconds;
+	double mCycles;
+};
+
+
+// Best time per sample over a few trials, the others were disturbed by the rest of the system
+static Timing measure(SampleConverter::Kernel kernel, const std::vector<double>& input, std::vector<char>& output, size_t repetitions)
+{
+	Timing best = { 1e30, 1e30 };
+	for (int trial = 0; trial < sTrialCount; trial++)
+	{
+		auto start = std::chrono::steady_clock::now();
+#ifdef VBAN_BENCHMARK_TSC
+		auto startCycles = __rdtsc();
+#endif
+		for (size_t repetition = 0; repetition < repetitions; repetition++)
+			kernel(input.data(), output.data(), input.size());
+#ifdef VBAN_BENCHMARK_TSC
+		auto cycles = static_cast<double>(__rdtsc() - startCycles);
+#else
+		double cycles = 0.0;
+#endif
+		auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		auto samples = static_cast<double>(input.size() * repetitions);
+		best.mNanoseconds = std::min(best.mNanoseconds, seconds * 1e9 / samples);
+		best.mCycles = std::min(best.mCycles, cycles / samples);
+	}
+	return best;
+}
+
+
+int main(int argc, char** argv)
+{
+	size_t sampleCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 8192;
+	size_t repetitions = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2000;
+
+	// Audio with some clipping, like a loud signal
+	std::vector<double> input(sampleCount);
+	std::mt19937 random(1);
+	std::uniform_real_distribution<double> distribution(-1.1, 1.1);
+	for (auto& sample : input)
+		sample = distribution(random);
+	std::vector<char> output(sampleCount * 4);
+
+	const SampleConverter::Format formats[] = { SampleConverter::Format::Int16, SampleConverter::Format::Int24, SampleConverter::Format::Int32, SampleConverter::Format::Float32 };
+	const char* formatNames[] = { "int16", "int24", "int32", "float32" };
+
+	std::printf("%zu samples per block, %zu blocks, selected %s\n", sampleCount, repetitions, SampleConverter::getInstructionSet());
+	std::printf("%-8s %-8s %10s %14s %8s\n", "format", "kernels", "ns/sample", "cycles/sample", "speedup");
+	for (size_t i = 0; i < 4; i++)
+	{
+		auto scalar = measure(SampleConverter::getScalarKernel(formats[i]), input, output, repetitions);
+		std::printf("%-8s %-8s %10.3f %14.3f %8.2f\n", formatNames[i], "scalar", scalar.mNanoseconds, scalar.mCycles, 1.0);
+		for (int index = 0; SampleConverter::getSupportedInstructionSet(index) != nullptr; index++)
+		{
+			auto timing = measure(SampleConverter::getSupportedKernel(formats[i], index), input, output, repetitions);
+			std::printf("%-8s %-8s %10.3f %14.3f %8.2f\n", formatNames[i], SampleConverter::getSupportedInstructionSet(index),
+				timing.mNanoseconds, timing.mCycles, scalar.mNanoseconds / timing.mNanoseconds);
+		}
+	}
+	return 0;
+}
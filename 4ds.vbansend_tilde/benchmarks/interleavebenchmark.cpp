@@ -0,0 +1,82 @@
+#include "interleaver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * Interleaves signal vectors of 2 to 256 channels and 32 to 2048 frames with the scalar kernel and the kernels of every
+ * instruction set the CPU supports, and reports the time spent per sample.
+ * Every vector is interleaved in blocks of frames into a buffer of one block, the way PacketEncoder does it, and once
+ * as a whole into a buffer of the complete vector, which shows the cost of striding across the output.
+ *
+ * Usage: 4ds.vbansend_tilde_interleave_benchmark [samples per measurement]
+ */
+
+static constexpr int sChannelCounts[] = { 2, 8, 16, 64, 128, 256 };
+static constexpr int sVectorSizes[] = { 32, 128, 512, 2048 };
+static constexpr int sBlockFrameCount = 16;
+static constexpr int sTrialCount = 5;
+
+
+// Best time per sample over a few trials, the others were disturbed by the rest of the system
+static double measure(Interleaver::Kernel kernel, const std::vector<const double*>& input, int channelCount, int frameCount, int blockFrameCount, std::vector<double>& output, size_t sampleCount)
+{
+	auto repetitions = std::max<size_t>(1, sampleCount / static_cast<size_t>(channelCount * frameCount));
+	double best = 1e30;
+	for (int trial = 0; trial < sTrialCount; trial++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (size_t repetition = 0; repetition < repetitions; repetition++)
+			for (int frame = 0; frame < frameCount; frame += blockFrameCount)
+				kernel(input.data(), static_cast<size_t>(frame), channelCount, std::min(blockFrameCount, frameCount - frame), output.data(), channelCount);
+		auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = std::min(best, seconds * 1e9 / static_cast<double>(repetitions * static_cast<size_t>(channelCount * frameCount)));
+	}
+	return best;
+}
+
+
+static void report(const char* name, Interleaver::Kernel kernel, const std::vector<const double*>& input, std::vector<double>& output, size_t sampleCount, bool blocked)
+{
+	std::printf("%-8s %-8s", name, blocked ? "blocked" : "whole");
+	for (int channelCount : sChannelCounts)
+	{
+		for (int frameCount : sVectorSizes)
+			std::printf(" %6.3f", measure(kernel, input, channelCount, frameCount, blocked ? sBlockFrameCount : frameCount, output, sampleCount));
+		std::printf(" |");
+	}
+	std::printf("\n");
+}
+
+
+int main(int argc, char** argv)
+{
+	size_t sampleCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4000000;
+
+	constexpr int maxChannelCount = 256;
+	constexpr int maxFrameCount = 2048;
+	std::vector<std::vector<double>> samples(maxChannelCount, std::vector<double>(maxFrameCount, 0.25));
+	std::vector<const double*> input;
+	for (const auto& channel : samples)
+		input.push_back(channel.data());
+	std::vector<double> output(static_cast<size_t>(maxChannelCount * maxFrameCount));
+
+	std::printf("ns per sample, vector sizes");
+	for (int frameCount : sVectorSizes)
+		std::printf(" %d", frameCount);
+	std::printf(" for");
+	for (int channelCount : sChannelCounts)
+		std::printf(" %d", channelCount);
+	std::printf(" channels\n");
+
+	for (bool blocked : { true, false })
+	{
+		report("scalar", Interleaver::getScalarKernel(), input, output, sampleCount, blocked);
+		for (int index = 0; Interleaver::getSupportedInstructionSet(index) != nullptr; index++)
+			report(Interleaver::getSupportedInstructionSet(index), Interleaver::getSupportedKernel(index), input, output, sampleCount, blocked);
+	}
+	return 0;
+}
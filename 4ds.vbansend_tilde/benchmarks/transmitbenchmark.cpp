@@ -0,0 +1,129 @@
+#include "packetqueue.h"
+#include "packettransmitter.h"
+
+#include <asio/io_context.hpp>
+#include <asio/ts/internet.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+/**
+ * Sends packets over loopback with every send path of PacketTransmitter and reports the time spent per packet.
+ * A second thread drains the receiving socket and counts the packets that arrived, and those that arrived out of order
+ * or with the wrong size. Loopback doesn't reorder, so these show packets the send path mixed up or split wrongly.
+ *
+ * Usage: 4ds.vbansend_tilde_transmit_benchmark [packet count] [payload size]
+ */
+
+struct Mode
+{
+	const char* mName;
+	bool mBatching;
+	bool mGso;
+};
+
+static const Mode sModes[] = {
+	{ "send_to", false, false },
+	{ "sendmmsg", true, false },
+	{ "gso", true, true },
+};
+
+// Packets queued before every flush, a full batch of the transmitter
+static constexpr size_t sPacketsPerFlush = 64;
+
+
+static void run(const Mode& mode, size_t packetCount, size_t payloadSize)
+{
+	asio::io_context context;
+	asio::ip::udp::socket receiver(context, asio::ip::udp::endpoint(asio::ip::address_v4::loopback(), 0));
+	receiver.set_option(asio::socket_base::receive_buffer_size(8 * 1024 * 1024));
+	receiver.non_blocking(true);
+
+	asio::ip::udp::socket socket(context);
+	socket.open(asio::ip::udp::v4());
+	socket.set_option(asio::socket_base::send_buffer_size(8 * 1024 * 1024));
+	socket.non_blocking(true);
+	std::vector<asio::ip::udp::endpoint> endpoints = { receiver.local_endpoint() };
+
+	// Count the packets that arrive until the sender is done and the socket is empty
+	std::atomic<bool> sending = { true };
+	size_t received = 0;
+	size_t corrupt = 0;
+	std::thread drain([&]() {
+		std::vector<char> buffer(PacketQueue::Packet::sMaxPayloadSize + VBAN_HEADER_SIZE);
+		uint32_t nextFrame = 0;
+		while (true)
+		{
+			asio::error_code error;
+			auto size = receiver.receive(asio::buffer(buffer), 0, error);
+			if (!error)
+			{
+				VBanHeader header;
+				std::memcpy(&header, buffer.data(), VBAN_HEADER_SIZE);
+				if (size != payloadSize + VBAN_HEADER_SIZE || header.nuFrame < nextFrame)
+					corrupt++;
+				nextFrame = header.nuFrame + 1;
+				received++;
+			}
+			else if (!sending)
+				break;
+			else
+				std::this_thread::yield();
+		}
+	});
+
+	PacketQueue queue;
+	queue.resize(sPacketsPerFlush);
+	PacketTransmitter transmitter;
+	transmitter.setBatchingEnabled(mode.mBatching);
+	transmitter.setGsoEnabled(mode.mGso);
+
+	size_t sent = 0;
+	asio::error_code errorCode;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t packet = 0; packet < packetCount; packet += sPacketsPerFlush)
+	{
+		PacketQueue::Packet* packets[sPacketsPerFlush];
+		auto count = std::min(sPacketsPerFlush, packetCount - packet);
+		queue.acquire(packets, count);
+		for (size_t i = 0; i < count; i++)
+		{
+			VBanHeader header = VBanHeader();
+			header.nuFrame = static_cast<uint32_t>(packet + i);
+			std::memcpy(packets[i]->header(), &header, VBAN_HEADER_SIZE);
+			packets[i]->mPayloadSize = payloadSize;
+		}
+		queue.commit(count);
+		sent += transmitter.sendQueue(queue, socket, endpoints, errorCode);
+	}
+	auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	sending = false;
+	drain.join();
+
+	if (mode.mGso && !transmitter.isGsoActive())
+		std::printf("gso was rejected by the kernel, packets were sent as plain messages\n");
+	std::printf("%-10s %8.0f ns/packet %6.3f Mpps  sent %zu  received %zu  corrupt %zu  would block %d  dropped %d%s%s\n",
+		mode.mName, elapsed / packetCount, packetCount * 1e3 / elapsed, sent, received, corrupt,
+		transmitter.getWouldBlockCount(), transmitter.getDropCount(),
+		errorCode ? "  error: " : "", errorCode ? errorCode.message().c_str() : "");
+}
+
+
+int main(int argc, char** argv)
+{
+	size_t packetCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+	size_t payloadSize = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : VBAN_DATA_MAX_SIZE;
+	payloadSize = std::min(payloadSize, PacketQueue::Packet::sMaxPayloadSize);
+
+	std::printf("%zu packets of %zu bytes, %zu per flush\n", packetCount, payloadSize + VBAN_HEADER_SIZE, sPacketsPerFlush);
+	for (const auto& mode : sModes)
+		run(mode, packetCount, payloadSize);
+	return 0;
+}
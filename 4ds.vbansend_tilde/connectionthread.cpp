@@ -0,0 +1,80 @@
+#include "connectionthread.h"
+
+#include <chrono>
+
+// Interval at which the background thread checks whether a published connection has been picked up
+static constexpr std::chrono::milliseconds sConnectionPollInterval(20);
+
+
+ConnectionThread::ConnectionThread(OpenFunction open) : mOpen(std::move(open))
+{
+	mThread = std::thread([this]() { run(); });
+}
+
+
+ConnectionThread::~ConnectionThread()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mRunning = false;
+	}
+	mCondition.notify_one();
+	mThread.join();
+
+	// The sending thread has stopped by now
+	delete mRetired.exchange(nullptr);
+	delete mPending.exchange(nullptr);
+	delete mCurrent;
+}
+
+
+void ConnectionThread::reconnect()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mReconnect = true;
+	}
+	mCondition.notify_one();
+}
+
+
+Connection* ConnectionThread::acquire()
+{
+	auto pending = mPending.load(std::memory_order_acquire);
+	if (pending != nullptr)
+	{
+		// Retire the old connection before releasing the pending slot,
+		// the background thread only publishes again once it sees the slot empty.
+		mRetired.store(mCurrent, std::memory_order_relaxed);
+		mCurrent = pending;
+		mPending.store(nullptr, std::memory_order_release);
+	}
+	return mCurrent;
+}
+
+
+void ConnectionThread::run()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (mRunning)
+	{
+		mCondition.wait_for(lock, sConnectionPollInterval);
+
+		// Wait for the sending thread to pick up the previous connection
+		if (mPending.load(std::memory_order_acquire) != nullptr)
+			continue;
+
+		// Close the connection it replaced
+		delete mRetired.exchange(nullptr, std::memory_order_relaxed);
+
+		if (!mReconnect || !mRunning)
+			continue;
+		mReconnect = false;
+
+		// Open the new connection without holding the lock, so reconnect() never waits on a slow lookup
+		lock.unlock();
+		auto connection = mOpen();
+		lock.lock();
+		mPending.store(connection.release(), std::memory_order_release);
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <asio/ts/internet.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Socket and destinations the sender transmits packets to.
+ */
+struct Connection
+{
+	Connection(asio::io_context& context) : mSocket(context) { }
+
+	asio::ip::udp::socket mSocket;
+	std::vector<asio::ip::udp::endpoint> mEndpoints;
+	bool mTxTime = false;		// The socket accepts departure times
+};
+
+
+/**
+ * Opens connections on a background thread and publishes them to the thread that sends packets.
+ * Resolving and opening a connection can block, so it never happens on the sending thread:
+ * that thread only picks up a published connection with an atomic swap and hands the old one back for closing.
+ */
+class ConnectionThread
+{
+public:
+	/**
+	 * Called on the background thread to open a new connection with the current settings.
+	 * Returns a connection with a closed socket when it can't be opened, so the sender stops sending.
+	 */
+	using OpenFunction = std::function<std::unique_ptr<Connection>()>;
+
+	/**
+	 * @param open function that opens a new connection
+	 */
+	ConnectionThread(OpenFunction open);
+	~ConnectionThread();
+
+	/**
+	 * Asks the background thread to open a new connection with the current settings. Can be called from any thread.
+	 */
+	void reconnect();
+
+	/**
+	 * Called from the sending thread, never blocks.
+	 * Switches to the most recently opened connection if there is one.
+	 * @return the connection to send to, nullptr before the first connection has been opened
+	 */
+	Connection* acquire();
+
+private:
+	void run();
+
+	OpenFunction mOpen;
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	bool mRunning = true;
+	bool mReconnect = false;
+
+	Connection* mCurrent = nullptr;						// Owned by the sending thread
+	std::atomic<Connection*> mPending = { nullptr };	// Opened, not yet picked up by the sending thread
+	std::atomic<Connection*> mRetired = { nullptr };	// Replaced by the sending thread, to be closed
+};
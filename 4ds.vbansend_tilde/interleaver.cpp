@@ -0,0 +1,258 @@
+#include "interleaver.h"
+#include "cpufeatures.h"
+
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define VBAN_INTERLEAVER_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define VBAN_INTERLEAVER_NEON
+#include <arm_neon.h>
+#endif
+
+// Kernels for instruction sets beyond the baseline are compiled for their target only, MSVC doesn't need this
+#if defined(__GNUC__) || defined(__clang__)
+#define VBAN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define VBAN_TARGET(isa)
+#endif
+
+
+// Interleaves the channels and frames that don't fill a complete tile
+static void interleaveScalar(const double* const* input, size_t offset, int channelCount, int frameCount, double* output, int outputStride)
+{
+	for (int frame = 0; frame < frameCount; frame++)
+	{
+		auto outputFrame = output + static_cast<size_t>(frame) * outputStride;
+		for (int channel = 0; channel < channelCount; channel++)
+			outputFrame[channel] = input[channel][offset + frame];
+	}
+}
+
+
+// Interleaves the last channels that don't fill a complete tile, and the last frames of the tiled channels
+static void interleaveRemainder(const double* const* input, size_t offset, int channelCount, int frameCount, double* output, int outputStride, int tiledChannels, int tiledFrames)
+{
+	if (tiledChannels < channelCount)
+		interleaveScalar(input + tiledChannels, offset, channelCount - tiledChannels, frameCount, output + tiledChannels, outputStride);
+	if (tiledFrames < frameCount)
+		interleaveScalar(input, offset + tiledFrames, tiledChannels, frameCount - tiledFrames, output + static_cast<size_t>(tiledFrames) * outputStride, outputStride);
+}
+
+
+#ifdef VBAN_INTERLEAVER_X86
+
+// Transposes 2 channels x 2 frames
+VBAN_TARGET("sse2") static inline void transpose2x2(const double* const* input, size_t position, int channel, double* outputFrame, int outputStride)
+{
+	auto row0 = _mm_loadu_pd(input[channel] + position);
+	auto row1 = _mm_loadu_pd(input[channel + 1] + position);
+	_mm_storeu_pd(outputFrame + channel, _mm_unpacklo_pd(row0, row1));
+	_mm_storeu_pd(outputFrame + outputStride + channel, _mm_unpackhi_pd(row0, row1));
+}
+
+
+VBAN_TARGET("sse2") static void interleaveSse2(const double* const* input, size_t offset, int channelCount, int frameCount, double* output, int outputStride)
+{
+	int tiledChannels = channelCount & ~1;
+	int tiledFrames = frameCount & ~1;
+	for (int frame = 0; frame < tiledFrames; frame += 2)
+	{
+		auto outputFrame = output + static_cast<size_t>(frame) * outputStride;
+		for (int channel = 0; channel < tiledChannels; channel += 2)
+			transpose2x2(input, offset + frame, channel, outputFrame, outputStride);
+	}
+	interleaveRemainder(input, offset, channelCount, frameCount, output, outputStride, tiledChannels, tiledFrames);
+}
+
+
+VBAN_TARGET("avx") static void interleaveAvx(const double* const* input, size_t offset, int channelCount, int frameCount, double* output, int outputStride)
+{
+	int quadChannels = channelCount & ~3;
+	int tiledChannels = channelCount & ~1;
+	int tiledFrames = frameCount & ~3;
+	for (int frame = 0; frame < tiledFrames; frame += 4)
+	{
+		auto outputFrame = output + static_cast<size_t>(frame) * outputStride;
+		for (int channel = 0; channel < quadChannels; channel += 4)
+		{
+			// 4 channels x 4 frames: swap within 128-bit lanes, then swap the lanes
+			auto row0 = _mm256_loadu_pd(input[channel] + offset + frame);
+			auto row1 = _mm256_loadu_pd(input[channel + 1] + offset + frame);
+			auto row2 = _mm256_loadu_pd(input[channel + 2] + offset + frame);
+			auto row3 = _mm256_loadu_pd(input[channel + 3] + offset + frame);
+			auto even01 = _mm256_unpacklo_pd(row0, row1);
+			auto odd01 = _mm256_unpackhi_pd(row0, row1);
+			auto even23 = _mm256_unpacklo_pd(row2, row3);
+			auto odd23 = _mm256_unpackhi_pd(row2, row3);
+			_mm256_storeu_pd(outputFrame + channel, _mm256_permute2f128_pd(even01, even23, 0x20));
+			_mm256_storeu_pd(outputFrame + outputStride + channel, _mm256_permute2f128_pd(odd01, odd23, 0x20));
+			_mm256_storeu_pd(outputFrame + 2 * outputStride + channel, _mm256_permute2f128_pd(even01, even23, 0x31));
+			_mm256_storeu_pd(outputFrame + 3 * outputStride + channel, _mm256_permute2f128_pd(odd01, odd23, 0x31));
+		}
+
+		// A remaining pair of channels
+		if (quadChannels < tiledChannels)
+		{
+			transpose2x2(input, offset + frame, quadChannels, outputFrame, outputStride);
+			transpose2x2(input, offset + frame + 2, quadChannels, outputFrame + 2 * outputStride, outputStride);
+		}
+	}
+	interleaveRemainder(input, offset, channelCount, frameCount, output, outputStride, tiledChannels, tiledFrames);
+}
+
+
+// GCC 12 takes the undefined vectors of the AVX-512 intrinsics for uninitialized ones, fixed in GCC 13
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ == 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+VBAN_TARGET("avx512f") static void interleaveAvx512(const double* const* input, size_t offset, int channelCount, int frameCount, double* output, int outputStride)
+{
+	// Too few channels for a tile
+	if (channelCount < 8)
+	{
+		interleaveAvx(input, offset, channelCount, frameCount, output, outputStride);
+		return;
+	}
+
+	int octChannels = channelCount & ~7;
+	int tiledFrames = frameCount & ~7;
+	for (int frame = 0; frame < tiledFrames; frame += 8)
+	{
+		auto outputFrame = output + static_cast<size_t>(frame) * outputStride;
+		for (int channel = 0; channel < octChannels; channel += 8)
+		{
+			// 8 channels x 8 frames: swap within 128-bit lanes, then gather the lanes of 4 channels, then of all 8
+			auto row0 = _mm512_loadu_pd(input[channel] + offset + frame);
+			auto row1 = _mm512_loadu_pd(input[channel + 1] + offset + frame);
+			auto row2 = _mm512_loadu_pd(input[channel + 2] + offset + frame);
+			auto row3 = _mm512_loadu_pd(input[channel + 3] + offset + frame);
+			auto row4 = _mm512_loadu_pd(input[channel + 4] + offset + frame);
+			auto row5 = _mm512_loadu_pd(input[channel + 5] + offset + frame);
+			auto row6 = _mm512_loadu_pd(input[channel + 6] + offset + frame);
+			auto row7 = _mm512_loadu_pd(input[channel + 7] + offset + frame);
+			auto even01 = _mm512_unpacklo_pd(row0, row1);
+			auto odd01 = _mm512_unpackhi_pd(row0, row1);
+			auto even23 = _mm512_unpacklo_pd(row2, row3);
+			auto odd23 = _mm512_unpackhi_pd(row2, row3);
+			auto even45 = _mm512_unpacklo_pd(row4, row5);
+			auto odd45 = _mm512_unpackhi_pd(row4, row5);
+			auto even67 = _mm512_unpacklo_pd(row6, row7);
+			auto odd67 = _mm512_unpackhi_pd(row6, row7);
+			auto frames04Low = _mm512_shuffle_f64x2(even01, even23, 0x88);
+			auto frames26Low = _mm512_shuffle_f64x2(even01, even23, 0xdd);
+			auto frames15Low = _mm512_shuffle_f64x2(odd01, odd23, 0x88);
+			auto frames37Low = _mm512_shuffle_f64x2(odd01, odd23, 0xdd);
+			auto frames04High = _mm512_shuffle_f64x2(even45, even67, 0x88);
+			auto frames26High = _mm512_shuffle_f64x2(even45, even67, 0xdd);
+			auto frames15High = _mm512_shuffle_f64x2(odd45, odd67, 0x88);
+			auto frames37High = _mm512_shuffle_f64x2(odd45, odd67, 0xdd);
+			_mm512_storeu_pd(outputFrame + channel, _mm512_shuffle_f64x2(frames04Low, frames04High, 0x88));
+			_mm512_storeu_pd(outputFrame + outputStride + channel, _mm512_shuffle_f64x2(frames15Low, frames15High, 0x88));
+			_mm512_storeu_pd(outputFrame + 2 * outputStride + channel, _mm512_shuffle_f64x2(frames26Low, frames26High, 0x88));
+			_mm512_storeu_pd(outputFrame + 3 * outputStride + channel, _mm512_shuffle_f64x2(frames37Low, frames37High, 0x88));
+			_mm512_storeu_pd(outputFrame + 4 * outputStride + channel, _mm512_shuffle_f64x2(frames04Low, frames04High, 0xdd));
+			_mm512_storeu_pd(outputFrame + 5 * outputStride + channel, _mm512_shuffle_f64x2(frames15Low, frames15High, 0xdd));
+			_mm512_storeu_pd(outputFrame + 6 * outputStride + channel, _mm512_shuffle_f64x2(frames26Low, frames26High, 0xdd));
+			_mm512_storeu_pd(outputFrame + 7 * outputStride + channel, _mm512_shuffle_f64x2(frames37Low, frames37High, 0xdd));
+		}
+	}
+
+	// The channels and frames around the 8 x 8 tiles are left to the 4 x 4 and 2 x 2 tiles
+	if (octChannels < channelCount)
+		interleaveAvx(input + octChannels, offset, channelCount - octChannels, frameCount, output + octChannels, outputStride);
+	if (tiledFrames < frameCount)
+		interleaveAvx(input, offset + tiledFrames, octChannels, frameCount - tiledFrames, output + static_cast<size_t>(tiledFrames) * outputStride, outputStride);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ == 12
+#pragma GCC diagnostic pop
+#endif
+
+#endif // VBAN_INTERLEAVER_X86
+
+
+#ifdef VBAN_INTERLEAVER_NEON
+
+static void interleaveNeon(const double* const* input, size_t offset, int channelCount, int frameCount, double* output, int outputStride)
+{
+	int tiledChannels = channelCount & ~1;
+	int tiledFrames = frameCount & ~1;
+	for (int frame = 0; frame < tiledFrames; frame += 2)
+	{
+		auto outputFrame = output + static_cast<size_t>(frame) * outputStride;
+		for (int channel = 0; channel < tiledChannels; channel += 2)
+		{
+			// 2 channels x 2 frames
+			auto row0 = vld1q_f64(input[channel] + offset + frame);
+			auto row1 = vld1q_f64(input[channel + 1] + offset + frame);
+			vst1q_f64(outputFrame + channel, vzip1q_f64(row0, row1));
+			vst1q_f64(outputFrame + outputStride + channel, vzip2q_f64(row0, row1));
+		}
+	}
+	interleaveRemainder(input, offset, channelCount, frameCount, output, outputStride, tiledChannels, tiledFrames);
+}
+
+#endif // VBAN_INTERLEAVER_NEON
+
+
+// Kernel selection, done once when the external is loaded
+
+struct InterleaverKernelInfo
+{
+	Interleaver::Kernel mKernel;
+	const char* mName;
+};
+
+
+// The kernels the CPU supports, fastest first
+static std::vector<InterleaverKernelInfo> getSupportedKernels()
+{
+	std::vector<InterleaverKernelInfo> kernels;
+#if defined(VBAN_INTERLEAVER_X86)
+	if (CpuFeatures::hasAvx512())
+		kernels.push_back({ interleaveAvx512, "AVX-512" });
+	if (CpuFeatures::hasAvx2())
+		kernels.push_back({ interleaveAvx, "AVX" });
+	kernels.push_back({ interleaveSse2, "SSE2" });
+#elif defined(VBAN_INTERLEAVER_NEON)
+	kernels.push_back({ interleaveNeon, "NEON" });
+#else
+	kernels.push_back({ interleaveScalar, "scalar" });
+#endif
+	return kernels;
+}
+
+static const std::vector<InterleaverKernelInfo> sSupportedKernels = getSupportedKernels();
+static const Interleaver::Kernel sKernel = sSupportedKernels.front().mKernel;
+
+
+Interleaver::Kernel Interleaver::getKernel()
+{
+	return sKernel;
+}
+
+
+Interleaver::Kernel Interleaver::getScalarKernel()
+{
+	return interleaveScalar;
+}
+
+
+Interleaver::Kernel Interleaver::getSupportedKernel(int index)
+{
+	if (index < 0 || index >= static_cast<int>(sSupportedKernels.size()))
+		return nullptr;
+	return sSupportedKernels[static_cast<size_t>(index)].mKernel;
+}
+
+
+const char* Interleaver::getSupportedInstructionSet(int index)
+{
+	if (index < 0 || index >= static_cast<int>(sSupportedKernels.size()))
+		return nullptr;
+	return sSupportedKernels[static_cast<size_t>(index)].mName;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * Interleaves planar audio, one buffer per channel, into frames of consecutive channels.
+ * Reading one sample per channel for every frame touches a different cache line per channel, so the vectorized kernels
+ * transpose tiles of channels by frames instead: 8 x 8 with AVX-512, 4 x 4 with AVX, 2 x 2 with SSE2 and NEON.
+ * Every tile reads a few full cache lines per channel and writes a few contiguous runs of output.
+ * The fastest kernel the CPU supports is selected once, when the external is loaded.
+ */
+class Interleaver
+{
+public:
+	/**
+	 * Interleaves frameCount frames of channelCount channels, starting at offset in every input buffer.
+	 * Frame f of channel c is written to output[f * outputStride + c], the other channels of an output frame are left untouched.
+	 */
+	using Kernel = void (*)(const double* const* input, size_t offset, int channelCount, int frameCount, double* output, int outputStride);
+
+	/**
+	 * @return the fastest kernel on this CPU
+	 */
+	static Kernel getKernel();
+
+	/**
+	 * @return the scalar reference kernel
+	 */
+	static Kernel getScalarKernel();
+
+	/**
+	 * Gives access to the kernels of every instruction set the CPU supports, to test them against the scalar kernel.
+	 * @param index index of the instruction set, 0 is the one getKernel() selected
+	 * @return the kernel, nullptr when the CPU supports fewer instruction sets
+	 */
+	static Kernel getSupportedKernel(int index);
+
+	/**
+	 * @param index index of the instruction set, as for getSupportedKernel()
+	 * @return name of the instruction set, nullptr when the CPU supports fewer instruction sets
+	 */
+	static const char* getSupportedInstructionSet(int index);
+};
@@ -0,0 +1,439 @@
+#pragma once
+
+#include "interleaver.h"
+#include "losslesscodec.h"
+#include "packetqueue.h"
+#include "sampleconverter.h"
+#include "silencedetector.h"
+#include "silencegapfiller.h"
+
+#include <vban/vban.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Encodes multichannel audio into VBAN packets.
+ * Headers and samples are written straight into packet slots handed out by the sender, so encoding never allocates.
+ * The header is built once from the stream settings, only the frame counter is patched per packet.
+ * A packet that is not completely filled at the end of a signal vector is continued in the next call to process().
+ * Streams with more than VBAN_CHANNELS_MAX_NB channels are split into shards: separate VBAN streams named
+ * "<name>_1", "<name>_2", ... with an equal share of the channels. Shards use the same number of frames per packet
+ * and share the frame counter, so a receiver can realign them sample accurately, and the packets of all shards
+ * for one frame counter are committed together.
+ * In lossless mode integer payloads are compressed with LosslessCodec and marked with VBAN_CODEC_USER,
+ * a packet that doesn't get smaller is sent as PCM so a payload never exceeds its PCM size.
+ * With discontinuous transmission (DTX) the packets of silent shards are skipped, so bandwidth follows the number of
+ * channels with content. Apart from that a silent shard sends keep-alives, as SilenceGapFiller describes: the header of
+ * the packet with VBAN_CODEC_USER in the codec bits and without payload.
+ * The sender is expected to implement:
+ *
+ *     void acquirePackets(PacketQueue::Packet** packets, size_t count); // Slots to write the next packets in
+ *     void commitPackets(size_t count); // Called when the packets in the acquired slots are complete
+ *
+ * Settings can be changed from any thread, they are applied from the start of the next packet.
+ */
+template <typename Sender>
+class PacketEncoder
+{
+public:
+	/**
+	 * Maximum number of streams a stream is split into, VBAN_CHANNELS_MAX_NB channels each.
+	 */
+	static constexpr int sMaxShards = 16;
+
+	/**
+	 * Maximum number of channels that can be encoded.
+	 */
+	static constexpr int sMaxChannelCount = VBAN_CHANNELS_MAX_NB * sMaxShards;
+
+	PacketEncoder(Sender& sender) : mSender(sender) { setStreamName("Stream1"); }
+
+	/**
+	 * Start or stop encoding. A partially filled packet is discarded when stopping.
+	 * @param active true to encode
+	 */
+	void setActive(bool active) { mActive = active; }
+
+	/**
+	 * @param channelCount number of channels in the stream, clamped to sMaxChannelCount.
+	 * Channels beyond getMaxChannelCount() are not sent.
+	 */
+	void setChannelCount(int channelCount)
+	{
+		mChannelCount = std::max(1, std::min(channelCount, sMaxChannelCount));
+		mHeaderDirty = true;
+	}
+
+	/**
+	 * @return number of channels in the stream, can be called from any thread
+	 */
+	int getChannelCount() const { return mChannelCount.load(std::memory_order_relaxed); }
+
+	/**
+	 * A frame of a shard has to fit in a packet, so with small packets sMaxShards shards hold less than sMaxChannelCount channels.
+	 * @return number of channels that can be sent with the current sample format and payload size, can be called from any thread
+	 */
+	int getMaxChannelCount() const
+	{
+		return sMaxShards * getMaxShardChannelCount(mMaxPayloadSize, SampleConverter::getSampleSize(mSampleFormat));
+	}
+
+	/**
+	 * @return number of VBAN streams the channels are currently split into, can be called from any thread
+	 */
+	int getShardCount() const { return mShardCount.load(std::memory_order_relaxed); }
+
+	/**
+	 * @param name name of the stream, truncated to VBAN_STREAM_NAME_SIZE characters
+	 */
+	void setStreamName(const std::string& name)
+	{
+		std::lock_guard<std::mutex> lock(mStreamNameMutex);
+		std::memset(mPendingStreamName, 0, VBAN_STREAM_NAME_SIZE);
+		std::memcpy(mPendingStreamName, name.data(), std::min<size_t>(name.size(), VBAN_STREAM_NAME_SIZE));
+		mStreamNameDirty = true;
+		mHeaderDirty = true;
+	}
+
+	/**
+	 * @param format sample format of the stream
+	 */
+	void setSampleFormat(SampleConverter::Format format)
+	{
+		mSampleFormat = format;
+		mHeaderDirty = true;
+	}
+
+	/**
+	 * @param lossless true to compress integer payloads, float32 streams are always sent as PCM
+	 */
+	void setLossless(bool lossless)
+	{
+		mLossless = lossless;
+		mHeaderDirty = true;
+	}
+
+	/**
+	 * @param dtx true to skip packets in which all channels of a shard are silent
+	 */
+	void setDtx(bool dtx)
+	{
+		mDtx = dtx;
+		mHeaderDirty = true;
+	}
+
+	/**
+	 * @param threshold samples with a magnitude up to this value are silent. When negative, only samples the sample
+	 * format sends as zero are silent, see SampleConverter::getZeroThreshold(), so dtx doesn't change the stream.
+	 */
+	void setSilenceThreshold(double threshold)
+	{
+		mSilenceThreshold = threshold;
+		mHeaderDirty = true;
+	}
+
+	/**
+	 * @return number of silent packets skipped with DTX, can be called from any thread
+	 */
+	int getSkippedPacketCount() const { return mSkippedPacketCount.load(std::memory_order_relaxed); }
+
+	/**
+	 * Packets are filled up to this size, with at most VBAN_SAMPLES_MAX_NB frames.
+	 * Streams with more channels than fit a single frame in a packet are split into shards.
+	 * @param size maximum payload size of a packet in bytes, clamped to PacketQueue::Packet::sMaxPayloadSize
+	 */
+	void setMaxPayloadSize(int size)
+	{
+		mMaxPayloadSize = std::max(1, std::min(size, static_cast<int>(PacketQueue::Packet::sMaxPayloadSize)));
+		mHeaderDirty = true;
+	}
+
+	/**
+	 * @return number of frames in every packet, can be called from any thread
+	 */
+	int getFramesPerPacket() const { return mFramesPerPacket.load(std::memory_order_relaxed); }
+
+	/**
+	 * @param format index of the samplerate in VBanSRList
+	 */
+	void setSampleRateFormat(int format)
+	{
+		mSampleRateFormat = format;
+		mHeaderDirty = true;
+	}
+
+	/**
+	 * Forgets the packet in progress. Call when the packet slots of the sender are reallocated.
+	 */
+	void reset() { mPacketInProgress = false; }
+
+	/**
+	 * Encodes a block of audio. Called from the audio thread.
+	 * @param input one buffer of frameCount samples per input channel
+	 * @param inputChannelCount number of input buffers, stream channels without input are sent as silence
+	 * @param frameCount number of samples per channel
+	 */
+	void process(double** input, int inputChannelCount, int frameCount)
+	{
+		if (!mActive)
+		{
+			mPacketInProgress = false;
+			return;
+		}
+
+		int frame = 0;
+		while (frame < frameCount)
+		{
+			if (!mPacketInProgress)
+				beginPacket();
+
+			int frames = std::min(frameCount - frame, mPacketFrameCount - mPacketFramesWritten);
+			writeSamples(input, inputChannelCount, frame, frames);
+			frame += frames;
+			mPacketFramesWritten += frames;
+
+			if (mPacketFramesWritten == mPacketFrameCount)
+				endPacket();
+		}
+	}
+
+private:
+	// Frames interleaved at once, reads two full cache lines of every input channel
+	static constexpr int sBlockFrameCount = 16;
+
+	void beginPacket()
+	{
+		// Settings are applied from the start of a packet, so a packet is always encoded with consistent settings
+		if (mHeaderDirty.load())
+			updateHeader();
+		mPacketFramesWritten = 0;
+		mPacketInProgress = true;
+
+		mSender.acquirePackets(mPackets, static_cast<size_t>(mPacketShardCount));
+		for (int shard = 0; shard < mPacketShardCount; shard++)
+		{
+			mShardSilent[shard] = mPacketDtx;
+			std::memcpy(mPackets[shard]->header(), &mHeaders[shard], VBAN_HEADER_SIZE);
+			std::memcpy(mPackets[shard]->header() + offsetof(VBanHeader, nuFrame), &mFrameCounter, sizeof(mFrameCounter));
+		}
+	}
+
+	void endPacket()
+	{
+		// Packets that are sent are moved to the front of the acquired slots, so they can be committed together
+		int sendCount = 0;
+		for (int shard = 0; shard < mPacketShardCount; shard++)
+		{
+			auto packet = mPackets[shard];
+			int channelCount = mShards[shard].mChannelCount;
+			packet->mPayloadSize = static_cast<size_t>(mPacketFrameCount * channelCount * mPacketSampleSize);
+			if (mShardSilent[shard])
+			{
+				// The first silent packet and then one every keep-alive interval is sent without payload, marked with
+				// the user codec so receivers don't take it for a PCM packet
+				bool keepAlive = mSilentPacketCount[shard] == 0;
+				mSilentPacketCount[shard] = (mSilentPacketCount[shard] + 1) % mKeepAlivePacketCount;
+				if (!keepAlive)
+				{
+					mSkippedPacketCount.fetch_add(1, std::memory_order_relaxed);
+					continue;
+				}
+				packet->mPayloadSize = 0;
+				packet->header()[offsetof(VBanHeader, format_bit)] |= static_cast<char>(VBAN_CODEC_USER);
+			}
+			else
+			{
+				mSilentPacketCount[shard] = 0;
+				if (mPacketLossless)
+					compress(*packet, channelCount);
+			}
+
+			if (sendCount != shard)
+			{
+				std::memcpy(mPackets[sendCount]->header(), packet->header(), packet->size());
+				mPackets[sendCount]->mPayloadSize = packet->mPayloadSize;
+			}
+			sendCount++;
+		}
+		mSender.commitPackets(static_cast<size_t>(sendCount));
+		mPacketInProgress = false;
+		mFrameCounter++;
+	}
+
+	// Replaces the PCM payload with its compressed form when that is smaller
+	void compress(PacketQueue::Packet& packet, int channelCount)
+	{
+		auto size = LosslessCodec::encode(packet.payload(), mPacketFrameCount, channelCount, mPacketSampleSize, mCompressed.data(), packet.mPayloadSize - 1);
+		if (size == 0)
+			return;
+		std::memcpy(packet.payload(), mCompressed.data(), size);
+		packet.mPayloadSize = size;
+		packet.header()[offsetof(VBanHeader, format_bit)] |= static_cast<char>(VBAN_CODEC_USER);
+	}
+
+	void updateHeader()
+	{
+		mHeaderDirty = false;
+		if (mStreamNameDirty.load())
+		{
+			std::unique_lock<std::mutex> lock(mStreamNameMutex, std::try_to_lock);
+			if (lock.owns_lock())
+			{
+				std::memcpy(mStreamName, mPendingStreamName, VBAN_STREAM_NAME_SIZE);
+				mStreamNameDirty = false;
+			}
+			else
+			{
+				// Try again on the next packet
+				mHeaderDirty = true;
+			}
+		}
+
+		SampleConverter::Format sampleFormat = mSampleFormat;
+		mPacketSampleSize = SampleConverter::getSampleSize(sampleFormat);
+		mConvert = SampleConverter::getKernel(sampleFormat);
+		mPacketLossless = mLossless && sampleFormat != SampleConverter::Format::Float32;
+		mPacketDtx = mDtx;
+		double silenceThreshold = mSilenceThreshold;
+		mPacketSilenceThreshold = silenceThreshold < 0.0 ? SampleConverter::getZeroThreshold(sampleFormat) : silenceThreshold;
+
+		// Split the channels evenly over as few streams as possible. A stream has at most VBAN_CHANNELS_MAX_NB channels,
+		// and a frame of all its channels has to fit in a packet. All shards send the same number of frames per packet.
+		// Channels that don't fit in sMaxShards such streams are not sent.
+		int maxPayloadSize = mMaxPayloadSize;
+		int maxShardChannelCount = getMaxShardChannelCount(maxPayloadSize, mPacketSampleSize);
+		int channelCount = std::min<int>(mChannelCount, sMaxShards * maxShardChannelCount);
+		mPacketShardCount = (channelCount + maxShardChannelCount - 1) / maxShardChannelCount;
+		int shardChannelCount = (channelCount + mPacketShardCount - 1) / mPacketShardCount;
+
+		// As many frames as fit in the payload
+		mPacketFrameCount = std::max(1, std::min<int>(VBAN_SAMPLES_MAX_NB, maxPayloadSize / (shardChannelCount * mPacketSampleSize)));
+		mFramesPerPacket = mPacketFrameCount;
+		mShardCount = mPacketShardCount;
+
+		// Silent stretches start over with a keep-alive
+		int sampleRateFormat = mSampleRateFormat;
+		double packetsPerSecond = sampleRateFormat < VBAN_SR_MAXNUMBER ? VBanSRList[sampleRateFormat] / static_cast<double>(mPacketFrameCount) : 1.0;
+		mKeepAlivePacketCount = std::max(1, static_cast<int>(SilenceGapFiller::sKeepAliveInterval * packetsPerSecond));
+		std::fill(mSilentPacketCount, mSilentPacketCount + sMaxShards, 0);
+
+		for (int shard = 0; shard < mPacketShardCount; shard++)
+		{
+			auto& info = mShards[shard];
+			info.mFirstChannel = shard * shardChannelCount;
+			info.mChannelCount = std::min(shardChannelCount, channelCount - info.mFirstChannel);
+
+			auto& header = mHeaders[shard];
+			std::memcpy(&header.vban, "VBAN", 4);
+			header.format_SR = static_cast<uint8_t>(sampleRateFormat | VBAN_PROTOCOL_AUDIO);
+			header.format_nbs = static_cast<uint8_t>(mPacketFrameCount - 1);
+			header.format_nbc = static_cast<uint8_t>(info.mChannelCount - 1);
+			header.format_bit = static_cast<uint8_t>(static_cast<int>(sampleFormat) | VBAN_CODEC_PCM);
+			getShardName(shard, header.streamname);
+			header.nuFrame = 0;
+		}
+	}
+
+	// Channels of a stream whose frame fits in a packet
+	static int getMaxShardChannelCount(int maxPayloadSize, int sampleSize)
+	{
+		return std::max(1, std::min(VBAN_CHANNELS_MAX_NB, maxPayloadSize / sampleSize));
+	}
+
+	// A single stream keeps the stream name, shards append their 1-based index to it
+	void getShardName(int shard, char* name) const
+	{
+		std::memcpy(name, mStreamName, VBAN_STREAM_NAME_SIZE);
+		if (mPacketShardCount == 1)
+			return;
+
+		auto suffix = "_" + std::to_string(shard + 1);
+		auto length = std::min<size_t>(strnlen(mStreamName, VBAN_STREAM_NAME_SIZE), VBAN_STREAM_NAME_SIZE - suffix.size());
+		std::memset(name + length, 0, VBAN_STREAM_NAME_SIZE - length);
+		std::memcpy(name + length, suffix.data(), suffix.size());
+	}
+
+	// Interleaves the frames of every shard in blocks, and converts them into the packet of the shard
+	void writeSamples(double** input, int inputChannelCount, int offset, int frameCount)
+	{
+		auto block = mBlock.data();
+		for (int shard = 0; shard < mPacketShardCount; shard++)
+		{
+			const auto& info = mShards[shard];
+			int channelCount = std::max(0, std::min(inputChannelCount - info.mFirstChannel, info.mChannelCount));
+			auto payload = mPackets[shard]->payload() + mPacketFramesWritten * info.mChannelCount * mPacketSampleSize;
+			for (int frame = 0; frame < frameCount; frame += sBlockFrameCount)
+			{
+				int blockFrameCount = std::min(frameCount - frame, sBlockFrameCount);
+				auto sampleCount = static_cast<size_t>(blockFrameCount * info.mChannelCount);
+				if (channelCount < info.mChannelCount)
+				{
+					// Silence for stream channels that have no input
+					std::fill(block, block + sampleCount, 0.0);
+				}
+				if (channelCount > 0)
+					mInterleave(input + info.mFirstChannel, static_cast<size_t>(offset + frame), channelCount, blockFrameCount, block, info.mChannelCount);
+
+				mConvert(block, payload, sampleCount);
+				if (mShardSilent[shard])
+					mShardSilent[shard] = mIsSilent(block, sampleCount, mPacketSilenceThreshold);
+				payload += sampleCount * static_cast<size_t>(mPacketSampleSize);
+			}
+		}
+	}
+
+	struct Shard
+	{
+		int mFirstChannel = 0;
+		int mChannelCount = 0;
+	};
+
+	Sender& mSender;
+
+	// Settings
+	std::atomic<bool> mActive = { true };
+	std::atomic<int> mChannelCount = { 2 };
+	std::atomic<int> mSampleRateFormat = { 3 };
+	std::atomic<SampleConverter::Format> mSampleFormat = { SampleConverter::Format::Int16 };
+	std::atomic<bool> mLossless = { false };
+	std::atomic<bool> mDtx = { false };
+	std::atomic<double> mSilenceThreshold = { -1.0 };
+	std::atomic<int> mSkippedPacketCount = { 0 };
+	std::atomic<int> mMaxPayloadSize = { VBAN_DATA_MAX_SIZE };
+	std::mutex mStreamNameMutex;
+	char mPendingStreamName[VBAN_STREAM_NAME_SIZE];
+	std::atomic<bool> mStreamNameDirty = { false };
+	std::atomic<bool> mHeaderDirty = { true };
+	std::atomic<int> mShardCount = { 1 };
+	std::atomic<int> mFramesPerPacket = { 0 };
+
+	// Packets in progress, one per shard, only accessed from the audio thread
+	PacketQueue::Packet* mPackets[sMaxShards] = {};
+	bool mPacketInProgress = false;
+	VBanHeader mHeaders[sMaxShards];
+	Shard mShards[sMaxShards];
+	char mStreamName[VBAN_STREAM_NAME_SIZE] = {};
+	int mPacketShardCount = 1;
+	int mPacketFrameCount = 0;
+	int mPacketSampleSize = 2;
+	bool mPacketLossless = false;
+	std::vector<char> mCompressed = std::vector<char>(PacketQueue::Packet::sMaxPayloadSize);
+	bool mPacketDtx = false;
+	double mPacketSilenceThreshold = 0.0;
+	int mKeepAlivePacketCount = 1;
+	bool mShardSilent[sMaxShards] = {};
+	int mSilentPacketCount[sMaxShards] = {};
+	SilenceDetector::Kernel mIsSilent = SilenceDetector::getKernel();
+	SampleConverter::Kernel mConvert = nullptr;
+	Interleaver::Kernel mInterleave = Interleaver::getKernel();
+	std::vector<double> mBlock = std::vector<double>(sBlockFrameCount * VBAN_CHANNELS_MAX_NB);	// Interleaved frames of a shard
+	int mPacketFramesWritten = 0;
+	uint32_t mFrameCounter = 0;
+};
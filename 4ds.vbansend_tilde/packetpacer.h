@@ -0,0 +1,136 @@
+#pragma once
+
+#include "packetqueue.h"
+
+#include <vban/vban.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+/**
+ * Spreads packets evenly over time instead of sending all packets of a signal vector in one burst.
+ * Every frame of packets, the packets of all shards with the same frame counter, gets a departure time one packet
+ * duration after the previous one, a packet duration being the time its samples take to play. Packets run slightly ahead of real time so a backlog drains, and at most the burst budget
+ * of packets is sent back to back after the network thread was idle.
+ * Only used by the network thread, settings can be changed from any thread.
+ */
+class PacketPacer
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	/**
+	 * @param enable true to pace packets
+	 */
+	void setEnabled(bool enable) { mEnabled = enable; }
+
+	/**
+	 * @return whether packets are paced
+	 */
+	bool isEnabled() const { return mEnabled; }
+
+	/**
+	 * @param packets number of packets that can be sent back to back
+	 */
+	void setBurstBudget(int packets) { mBurstBudget = std::max(packets, 1); }
+
+	/**
+	 * Returns how many packets can leave at the given time.
+	 * @param now current time
+	 * @param packetDuration duration of the packets waiting to be sent
+	 * @return number of packets that can be sent now, 0 when the next packet is not due yet
+	 */
+	size_t allowance(Clock::time_point now, Clock::duration packetDuration)
+	{
+		// Unused departure slots from idle time don't accumulate beyond the burst budget
+		int burstBudget = mBurstBudget;
+		auto earliest = now - packetDuration * (burstBudget - 1);
+		if (mNextDeparture < earliest)
+			mNextDeparture = earliest;
+		if (mNextDeparture > now || packetDuration.count() <= 0)
+			return mNextDeparture > now ? 0 : burstBudget;
+		return static_cast<size_t>((now - mNextDeparture) / packetDuration) + 1;
+	}
+
+	/**
+	 * Moves the departure time of the next packet forward after packets have been sent.
+	 * @param count number of packets sent
+	 * @param packetDuration duration of the packets sent
+	 */
+	void sent(size_t count, Clock::duration packetDuration)
+	{
+		mNextDeparture += std::chrono::duration_cast<Clock::duration>(packetDuration * (count * sDrainFactor));
+	}
+
+	/**
+	 * Waits until the next packet is due. Sleeps most of the time and spins for the last stretch for accuracy.
+	 */
+	void waitForNextDeparture() const
+	{
+		if (Clock::now() + sSpinTime < mNextDeparture)
+			std::this_thread::sleep_until(mNextDeparture - sSpinTime);
+		while (Clock::now() < mNextDeparture)
+			std::this_thread::yield();
+	}
+
+	/**
+	 * Counts the packets of the frames at the front of the queue. The packets of the shards of a stream carry the
+	 * counter of their frame, and with dtx silent shards send no packets, so the number of packets per frame varies.
+	 * @param queue packets in frame order, the packets of a frame are committed together
+	 * @param maxFramePackets maximum number of packets per frame
+	 * @param frameCount number of frames to count the packets of, receives the number of frames found
+	 * @return number of packets of these frames
+	 */
+	size_t getPacketCount(PacketQueue& queue, size_t maxFramePackets, size_t& frameCount)
+	{
+		mPackets.resize(std::max<size_t>(frameCount * maxFramePackets, 1));
+		auto count = queue.peek(mPackets.data(), mPackets.size());
+		size_t frames = 0;
+		size_t packets = 0;
+		uint32_t frame = 0;
+		for (; packets < count; packets++)
+		{
+			uint32_t packetFrame;
+			std::memcpy(&packetFrame, mPackets[packets]->header() + offsetof(VBanHeader, nuFrame), sizeof(packetFrame));
+			if (frames == 0 || packetFrame != frame)
+			{
+				if (frames == frameCount)
+					break;
+				frame = packetFrame;
+				frames++;
+			}
+		}
+		frameCount = frames;
+		return packets;
+	}
+
+	/**
+	 * @param packet a VBAN audio packet
+	 * @return the time the samples in the packet take to play
+	 */
+	static Clock::duration getDuration(const PacketQueue::Packet& packet)
+	{
+		VBanHeader header;
+		std::memcpy(&header, packet.header(), VBAN_HEADER_SIZE);
+		int sampleRateFormat = header.format_SR & VBAN_SR_MASK;
+		if (sampleRateFormat >= VBAN_SR_MAXNUMBER)
+			return Clock::duration::zero();
+		std::chrono::duration<double> duration((header.format_nbs + 1) / static_cast<double>(VBanSRList[sampleRateFormat]));
+		return std::chrono::duration_cast<Clock::duration>(duration);
+	}
+
+private:
+	static constexpr double sDrainFactor = 0.95;								// Run slightly ahead of real time
+	static constexpr std::chrono::microseconds sSpinTime { 100 };		// Sleeping is not accurate below this
+
+	std::atomic<bool> mEnabled = { false };
+	std::atomic<int> mBurstBudget = { 4 };
+	Clock::time_point mNextDeparture;
+	std::vector<PacketQueue::Packet*> mPackets;		// Packets at the front of the queue, only used by the network thread
+};
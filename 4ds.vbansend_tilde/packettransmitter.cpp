@@ -0,0 +1,582 @@
+#include "packettransmitter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <time.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+#ifndef SO_EE_ORIGIN_TXTIME
+#define SO_EE_ORIGIN_TXTIME 6
+#define SO_EE_CODE_TXTIME_INVALID_PARAM 1
+#define SO_EE_CODE_TXTIME_MISSED 2
+#endif
+#endif
+
+
+PacketTransmitter::PacketTransmitter()
+{
+	setBatchSize(64);
+}
+
+
+void PacketTransmitter::setBatchSize(size_t batchSize)
+{
+	batchSize = std::max<size_t>(batchSize, 1);
+	mPackets.resize(batchSize);
+
+#ifdef __linux__
+	mMessages.resize(batchSize * sMaxDestinations);
+	mMessageRuns.resize(batchSize * sMaxDestinations);
+	mIOVectors.resize(batchSize);
+	mRuns.resize(batchSize);
+	mControls.resize(batchSize);
+#endif
+}
+
+
+bool PacketTransmitter::setUringEnabled(PacketQueue& queue, bool enable, std::string& error)
+{
+#ifdef VBAN_HAS_IO_URING
+	mUring.shutdown();
+	mUringQueued = 0;
+	mPartialPackets = 0;
+	if (!enable)
+		return true;
+	return mUring.init(queue, mPackets.size(), error);
+#else
+	(void)queue;
+	if (!enable)
+		return true;
+	error = "io_uring support not available in this build";
+	return false;
+#endif
+}
+
+
+bool PacketTransmitter::isGsoActive() const
+{
+#ifdef VBAN_HAS_IO_URING
+	if (mUring.isInitialized())
+		return false;
+#endif
+
+#ifdef __linux__
+	return mBatchingEnabled && mGsoEnabled && !mGsoRejected && !isTxTimeActive();
+#else
+	return false;
+#endif
+}
+
+
+bool PacketTransmitter::enableTxTime(asio::ip::udp::socket& socket, asio::error_code& errorCode)
+{
+#ifdef __linux__
+	// fq needs departure times on the monotonic clock, missed departures are reported on the error queue
+	sock_txtime config = sock_txtime();
+	config.clockid = CLOCK_MONOTONIC;
+	config.flags = SOF_TXTIME_REPORT_ERRORS;
+	if (::setsockopt(socket.native_handle(), SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) < 0)
+	{
+		errorCode = asio::error_code(errno, asio::error::get_system_category());
+		return false;
+	}
+	return true;
+#else
+	errorCode = asio::error::operation_not_supported;
+	return false;
+#endif
+}
+
+
+void PacketTransmitter::setTxTimeEnabled(bool enable)
+{
+	if (enable == mTxTimeEnabled)
+		return;
+	mTxTimeEnabled = enable;
+	mTxTimeRejected = false;
+	mTxTimeAnchored = false;
+}
+
+
+bool PacketTransmitter::isTxTimeActive() const
+{
+#ifdef VBAN_HAS_IO_URING
+	if (mUring.isInitialized())
+		return false;
+#endif
+
+#ifdef __linux__
+	return mBatchingEnabled && mTxTimeEnabled && !mTxTimeRejected;
+#else
+	return false;
+#endif
+}
+
+
+size_t PacketTransmitter::sendQueue(PacketQueue& queue, asio::ip::udp::socket& socket, const std::vector<asio::ip::udp::endpoint>& endpoints, asio::error_code& errorCode, size_t maxPackets)
+{
+#ifdef VBAN_HAS_IO_URING
+	if (mUring.isInitialized())
+		return sendUring(queue, socket, endpoints, errorCode, maxPackets);
+#endif
+
+#ifdef __linux__
+	if (isTxTimeActive())
+		readTxTimeErrors(socket.native_handle());
+#endif
+
+	size_t sent = 0;
+	bool spinning = false;
+	std::chrono::steady_clock::time_point deadline;
+	while (maxPackets > 0)
+	{
+		auto count = queue.peek(mPackets.data(), std::min(mPackets.size(), maxPackets));
+		if (count == 0)
+			break;
+
+		auto handled = sendBatch(mPackets.data(), count, socket, endpoints, sent, errorCode);
+		queue.pop(handled);
+		maxPackets -= handled;
+		if (handled == count)
+			continue;
+
+		// The send buffer of the socket is full
+		mWouldBlockCount.fetch_add(1, std::memory_order_relaxed);
+		switch (mOverloadPolicy.load())
+		{
+			case OverloadPolicy::DropNewest:
+			{
+				// Stop until the next flush, the packets stay queued. While the socket stays full the queue fills up,
+				// and the newest packets are dropped when they don't fit.
+				return sent;
+			}
+			case OverloadPolicy::DropOldest:
+			{
+				// Keep the most recent batch queued for the next flush and discard the packets before it
+				auto queued = queue.size();
+				auto excess = queued > mPackets.size() ? queued - mPackets.size() : 0;
+				pop(queue, excess);
+				mDropCount.fetch_add(static_cast<int>(excess), std::memory_order_relaxed);
+				return sent;
+			}
+			case OverloadPolicy::Spin:
+			{
+				// Retry the packet until the spin time of this flush is up, then drop it and stop until the next flush
+				if (!spinning)
+				{
+					spinning = true;
+					deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(mSpinTime.load());
+				}
+				auto firstDestination = mPartialPackets > 0 ? mPartialDestinations : 0;
+				bool packetSent = spin(*mPackets[handled], socket, endpoints, firstDestination, deadline, errorCode);
+				pop(queue, 1);
+				maxPackets--;
+				if (!packetSent)
+				{
+					mDropCount.fetch_add(1, std::memory_order_relaxed);
+					return sent;
+				}
+				if (firstDestination == 0)
+					sent++;
+				break;
+			}
+		}
+	}
+	return sent;
+}
+
+
+void PacketTransmitter::pop(PacketQueue& queue, size_t count)
+{
+	queue.pop(count);
+	mPartialPackets = mPartialPackets > count ? mPartialPackets - count : 0;
+}
+
+
+void PacketTransmitter::stopAt(size_t packet, size_t count, size_t destination)
+{
+	// Without progress the packets keep the destinations they reached before, which are relative to the first packet
+	auto reached = packet < mPartialPackets ? mPartialDestinations : 0;
+	if (destination > reached)
+	{
+		mPartialPackets = count;
+		mPartialDestinations = destination;
+	}
+	else
+	{
+		mPartialPackets = mPartialPackets > packet ? mPartialPackets - packet : 0;
+	}
+}
+
+
+bool PacketTransmitter::send(const PacketQueue::Packet& packet, asio::ip::udp::socket& socket, const asio::ip::udp::endpoint& endpoint, asio::error_code& errorCode)
+{
+	socket.send_to(asio::buffer(packet.data(), packet.size()), endpoint, 0, errorCode);
+	return !errorCode;
+}
+
+
+bool PacketTransmitter::spin(const PacketQueue::Packet& packet, asio::ip::udp::socket& socket, const std::vector<asio::ip::udp::endpoint>& endpoints, size_t firstDestination, std::chrono::steady_clock::time_point deadline, asio::error_code& errorCode)
+{
+	auto destinationCount = std::min(endpoints.size(), sMaxDestinations);
+	bool sent = true;
+	for (size_t destination = firstDestination; destination < destinationCount; destination++)
+	{
+		while (true)
+		{
+			asio::error_code error;
+			if (send(packet, socket, endpoints[destination], error))
+				break;
+			if (error != asio::error::would_block)
+				errorCode = error;
+			if (error != asio::error::would_block || std::chrono::steady_clock::now() >= deadline)
+			{
+				sent = false;
+				break;
+			}
+		}
+	}
+	return sent;
+}
+
+
+size_t PacketTransmitter::sendBatch(PacketQueue::Packet** packets, size_t count, asio::ip::udp::socket& socket, const std::vector<asio::ip::udp::endpoint>& endpoints, size_t& sent, asio::error_code& errorCode)
+{
+	auto destinationCount = std::min(endpoints.size(), sMaxDestinations);
+
+#ifdef __linux__
+	if (mBatchingEnabled)
+	{
+		// Segmentation and departure times fall back to plain messages when rejected, which always handle all packets.
+		// Segmented packets would share a departure time, so segmentation is skipped while departure times are used.
+		bool wouldBlock = false;
+		size_t handled = 0;
+		while (handled < count && !wouldBlock)
+		{
+			bool segment = mGsoEnabled && !mGsoRejected && !isTxTimeActive();
+			handled += sendMessages(packets + handled, count - handled, socket, endpoints, segment, sent, wouldBlock, errorCode);
+		}
+		return handled;
+	}
+#endif
+
+	for (size_t i = 0; i < count; i++)
+	{
+		auto firstDestination = i < mPartialPackets ? mPartialDestinations : 0;
+		for (size_t destination = firstDestination; destination < destinationCount; destination++)
+		{
+			asio::error_code error;
+			if (send(*packets[i], socket, endpoints[destination], error))
+			{
+				if (destination == 0)
+					sent++;
+			}
+			else if (error == asio::error::would_block)
+			{
+				// The packet is retried for the destinations it didn't reach yet
+				stopAt(i, 1, destination);
+				return i;
+			}
+			else
+			{
+				errorCode = error;
+			}
+		}
+	}
+	mPartialPackets = 0;
+	return count;
+}
+
+
+#ifdef VBAN_HAS_IO_URING
+size_t PacketTransmitter::sendUring(PacketQueue& queue, asio::ip::udp::socket& socket, const std::vector<asio::ip::udp::endpoint>& endpoints, asio::error_code& errorCode, size_t maxPackets)
+{
+	auto destinationCount = std::min(endpoints.size(), sMaxDestinations);
+	auto policy = mOverloadPolicy.load();
+	const PacketQueue::Packet* retried = nullptr;
+	std::chrono::steady_clock::time_point deadline;
+	size_t sent = 0;
+	while (true)
+	{
+		mUring.reap(sent, errorCode);
+
+		// Release the packets at the front of the queue the kernel is done with, in queue order
+		auto count = queue.peek(mPackets.data(), std::min(mPackets.size(), mUringQueued));
+		size_t released = 0;
+		bool blocked = false;
+		for (; released < count && mUring.isReleased(*mPackets[released]); released++)
+		{
+			auto destinations = mUring.getBlockedDestinations(*mPackets[released]);
+			if (destinations == 0)
+				continue;
+
+			// The send buffer of the socket was full
+			mWouldBlockCount.fetch_add(1, std::memory_order_relaxed);
+			blocked = true;
+			if (policy == OverloadPolicy::Spin && mUring.hasRoom(destinationCount))
+			{
+				// Retry the destinations that didn't get the packet for a limited time
+				auto now = std::chrono::steady_clock::now();
+				if (retried == nullptr)
+					deadline = now + std::chrono::microseconds(mSpinTime.load());
+				if (now < deadline)
+				{
+					for (size_t destination = 0; destination < destinationCount; destination++)
+						if (destinations & (1u << destination))
+							mUring.prepare(socket.native_handle(), *mPackets[released], endpoints[destination].data(), static_cast<socklen_t>(endpoints[destination].size()), destination);
+					retried = mPackets[released];
+					break;
+				}
+			}
+			mDropCount.fetch_add(1, std::memory_order_relaxed);
+			mUring.clearBlockedDestinations(*mPackets[released]);
+		}
+		queue.pop(released);
+		mUringQueued -= released;
+
+		// Keep the most recent batch queued for the next flush and discard the packets before it that weren't sent yet,
+		// the discarded packets stay queued behind the ones in flight without being sent
+		if (blocked && policy == OverloadPolicy::DropOldest)
+		{
+			auto waiting = queue.size() - mUringQueued;
+			auto excess = waiting > mPackets.size() ? waiting - mPackets.size() : 0;
+			mUringQueued += excess;
+			mDropCount.fetch_add(static_cast<int>(excess), std::memory_order_relaxed);
+			mUring.submit(errorCode);
+			return sent;
+		}
+
+		// While a packet is retried the packets behind it wait, otherwise they are sent as far as the ring has room.
+		// With DropNewest nothing more is sent until the next flush once the socket was full, the packets stay queued.
+		bool retrying = retried != nullptr && released < count && mPackets[released] == retried;
+		if (!retrying && !(blocked && policy == OverloadPolicy::DropNewest))
+		{
+			count = queue.peek(mPackets.data(), std::min(mPackets.size(), mUringQueued + std::min(maxPackets, mPackets.size())));
+			while (mUringQueued < count && mUring.hasRoom(destinationCount))
+			{
+				for (size_t destination = 0; destination < destinationCount; destination++)
+					mUring.prepare(socket.native_handle(), *mPackets[mUringQueued], endpoints[destination].data(), static_cast<socklen_t>(endpoints[destination].size()), destination);
+				mUringQueued++;
+			}
+		}
+		mUring.submit(errorCode);
+
+		if (!retrying || std::chrono::steady_clock::now() >= deadline)
+			return sent;
+	}
+}
+#endif
+
+
+#ifdef __linux__
+size_t PacketTransmitter::sendMessages(PacketQueue::Packet** packets, size_t count, asio::ip::udp::socket& socket, const std::vector<asio::ip::udp::endpoint>& endpoints, bool segment, size_t& sent, bool& wouldBlock, asio::error_code& errorCode)
+{
+	// Group the packets in runs, with segmentation consecutive packets of equal size share a message.
+	// Every run becomes one message per destination, all messages are sent with a single sendmmsg call.
+	auto destinationCount = std::min(endpoints.size(), sMaxDestinations);
+	bool txTime = isTxTimeActive();
+	uint64_t now = 0;
+	if (txTime)
+	{
+		timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		now = static_cast<uint64_t>(time.tv_sec) * 1000000000ull + static_cast<uint64_t>(time.tv_nsec);
+	}
+	size_t runCount = 0;
+	size_t messageCount = 0;
+	size_t packet = 0;
+	while (packet < count)
+	{
+		// Packets that already reached some of the destinations are sent to the others, in runs of their own
+		auto& run = mRuns[runCount];
+		bool partial = packet < mPartialPackets;
+		auto end = partial ? std::min(count, mPartialPackets) : count;
+		run.mFirst = packet;
+		run.mCount = 0;
+		run.mFirstDestination = partial ? mPartialDestinations : 0;
+		run.mFirstMessage = messageCount;
+		auto segmentSize = packets[packet]->size();
+		auto maxSegments = segment ? std::min<size_t>(sMaxSegments, sMaxSegmentedSize / segmentSize) : 1;
+		while (packet < end && run.mCount < maxSegments && packets[packet]->size() == segmentSize)
+		{
+			auto& iov = mIOVectors[packet];
+			iov.iov_base = const_cast<char*>(packets[packet]->data());
+			iov.iov_len = packets[packet]->size();
+			run.mCount++;
+			packet++;
+		}
+
+		auto& control = mControls[runCount];
+		control.mSize = 0;
+		if (run.mCount > 1)
+		{
+			// Let the kernel split the message into packets of segmentSize bytes
+			msghdr header = msghdr();
+			header.msg_control = control.mData;
+			header.msg_controllen = sizeof(control.mData);
+			auto cmsg = CMSG_FIRSTHDR(&header);
+			cmsg->cmsg_level = IPPROTO_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			auto size = static_cast<uint16_t>(segmentSize);
+			std::memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+			control.mSize = CMSG_SPACE(sizeof(uint16_t));
+		}
+		else if (txTime)
+		{
+			// Let the qdisc hold the packet until its departure time
+			msghdr header = msghdr();
+			header.msg_control = control.mData;
+			header.msg_controllen = sizeof(control.mData);
+			auto cmsg = CMSG_FIRSTHDR(&header);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_TXTIME;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+			auto departure = getDepartureTime(*packets[run.mFirst], now);
+			std::memcpy(CMSG_DATA(cmsg), &departure, sizeof(departure));
+			control.mSize = CMSG_SPACE(sizeof(uint64_t));
+		}
+
+		for (size_t destination = run.mFirstDestination; destination < destinationCount; destination++)
+		{
+			const auto& endpoint = endpoints[destination];
+			mMessageRuns[messageCount] = runCount;
+			auto& header = mMessages[messageCount++].msg_hdr;
+			header = msghdr();
+			header.msg_name = const_cast<asio::ip::udp::endpoint&>(endpoint).data();
+			header.msg_namelen = static_cast<socklen_t>(endpoint.size());
+			header.msg_iov = &mIOVectors[run.mFirst];
+			header.msg_iovlen = run.mCount;
+			if (control.mSize > 0)
+			{
+				header.msg_control = control.mData;
+				header.msg_controllen = control.mSize;
+			}
+		}
+		runCount++;
+	}
+
+	// sendmmsg can return before all messages are sent, continue where it stopped
+	size_t message = 0;
+	while (message < messageCount)
+	{
+		int result = ::sendmmsg(socket.native_handle(), &mMessages[message], static_cast<unsigned int>(messageCount - message), 0);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// The run that failed is left to the caller, it is only sent to the destinations it didn't reach yet
+			const auto& run = mRuns[mMessageRuns[message]];
+			auto handled = run.mFirst;
+			stopAt(run.mFirst, run.mCount, run.mFirstDestination + message - run.mFirstMessage);
+
+			// The socket buffer is full, leave the rest of the packets to the caller
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				wouldBlock = true;
+				return handled;
+			}
+			errorCode = asio::error_code(errno, asio::error::get_system_category());
+
+			// The kernel or the device doesn't do segmentation, leave the rest of the packets to the caller
+			if (run.mCount > 1 && (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+			{
+				mGsoRejected = true;
+				return handled;
+			}
+
+			// The socket doesn't accept departure times, leave the rest of the packets to the caller
+			if (txTime && errno == EINVAL)
+			{
+				mTxTimeRejected = true;
+				return handled;
+			}
+
+			// Skip the message that failed and carry on with the rest of the batch
+			message++;
+			continue;
+		}
+
+		// Count packets once, when they were sent to the first destination
+		for (size_t i = message; i < message + static_cast<size_t>(result); i++)
+		{
+			const auto& run = mRuns[mMessageRuns[i]];
+			if (i == run.mFirstMessage && run.mFirstDestination == 0)
+				sent += run.mCount;
+		}
+		message += result;
+	}
+	mPartialPackets = 0;
+	return count;
+}
+
+
+uint64_t PacketTransmitter::getDepartureTime(const PacketQueue::Packet& packet, uint64_t now)
+{
+	VBanHeader header;
+	std::memcpy(&header, packet.header(), VBAN_HEADER_SIZE);
+	auto sampleRateFormat = header.format_SR & VBAN_SR_MASK;
+	if (sampleRateFormat >= VBAN_SR_MAXNUMBER)
+		return now;
+
+	// The frame counter counts packets, each of them lasts (format_nbs + 1) samples
+	uint64_t delay = static_cast<uint64_t>(std::max<int>(mTxTimeDelay.load(), 0)) * 1000;
+	auto packetDuration = (header.format_nbs + 1) * 1e9 / VBanSRList[sampleRateFormat];
+	auto offset = static_cast<int32_t>(header.nuFrame - mTxTimeAnchorFrame);
+	auto departure = mTxTimeAnchor + static_cast<uint64_t>(std::max<int32_t>(offset, 0) * packetDuration);
+
+	// Anchor again when the stream restarted, or when the audio clock drifted too far from the system clock
+	if (!mTxTimeAnchored || offset < 0 || departure < now || departure > now + 4 * delay + static_cast<uint64_t>(packetDuration))
+	{
+		mTxTimeAnchored = true;
+		mTxTimeAnchor = now + delay;
+		mTxTimeAnchorFrame = header.nuFrame;
+		departure = mTxTimeAnchor;
+	}
+	return departure;
+}
+
+
+void PacketTransmitter::readTxTimeErrors(int socket)
+{
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+	while (true)
+	{
+		// The packet itself is not needed, only the extended error that comes with it
+		msghdr message = msghdr();
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		if (::recvmsg(socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (auto cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr; cmsg = CMSG_NXTHDR(&message, cmsg))
+		{
+			if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			sock_extended_err error;
+			std::memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+			if (error.ee_origin != SO_EE_ORIGIN_TXTIME)
+				continue;
+			if (error.ee_code == SO_EE_CODE_TXTIME_MISSED)
+				mTxTimeMissedCount.fetch_add(1, std::memory_order_relaxed);
+			else if (error.ee_code == SO_EE_CODE_TXTIME_INVALID_PARAM)
+				mTxTimeRejected = true;
+		}
+	}
+}
+#endif
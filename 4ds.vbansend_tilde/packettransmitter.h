@@ -0,0 +1,264 @@
+#pragma once
+
+#include "packetqueue.h"
+#include "uringtransmitter.h"
+
+#include <asio/ts/internet.hpp>
+#include <asio/system_error.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+/**
+ * Sends the packets in a PacketQueue over a UDP socket, straight from their queue slots where the header is stored
+ * in front of the payload.
+ * Every packet is sent to all destinations. On Linux all packets of a batch, for all destinations, are handed to the kernel
+ * with a single sendmmsg() call, on other platforms every packet is sent with its own send_to().
+ * With UDP generic segmentation offload enabled, equal sized packets are handed to the kernel as one large message,
+ * which it splits into the individual packets in a single pass. GSO falls back to plain messages when the kernel rejects it.
+ * When built with io_uring support batches can be sent through io_uring from registered buffers instead.
+ * On Linux batched packets can carry a departure time (SO_TXTIME), derived from their frame counter and samplerate,
+ * so a qdisc like fq or etf releases them at sample accurate intervals.
+ *
+ * Sockets are expected to be non-blocking. When the send buffer of the socket is full the overload policy decides
+ * which packets are dropped, every time that happens is counted.
+ *
+ * io_uring sends complete in the background: packets stay in the queue until the kernel released their buffers,
+ * so their slots aren't reused while they are being sent, and the overload policy is applied once the kernel
+ * reported that the socket buffer was full. Only use io_uring on a thread that keeps calling sendQueue().
+ */
+class PacketTransmitter
+{
+public:
+	/**
+	 * Maximum number of destinations packets can be sent to.
+	 */
+	static constexpr size_t sMaxDestinations = 16;
+
+	/**
+	 * What to do when the socket can't accept more packets.
+	 */
+	enum class OverloadPolicy
+	{
+		DropNewest,		///< Stop sending until the next attempt, new packets are dropped when the queue is full
+		DropOldest,		///< Keep the most recent batch queued for the next attempt, drop the older packets
+		Spin			///< Retry for a limited time per attempt, then drop the packet and stop until the next attempt
+	};
+
+	PacketTransmitter();
+
+	/**
+	 * Allocates the message headers for batches of the given size. Not thread safe.
+	 * @param batchSize maximum number of packets handed to the kernel at once
+	 */
+	void setBatchSize(size_t batchSize);
+
+	/**
+	 * Enables or disables batching. When disabled every packet is sent with its own send_to().
+	 * @param enable true to send packets in batches
+	 */
+	void setBatchingEnabled(bool enable) { mBatchingEnabled = enable; }
+
+	/**
+	 * Enables or disables UDP generic segmentation offload (Linux only), only used when batching is enabled.
+	 * @param enable true to send equal sized packets as segmented messages
+	 */
+	void setGsoEnabled(bool enable)
+	{
+		mGsoEnabled = enable;
+		mGsoRejected = false;
+	}
+
+	/**
+	 * @return whether packets are currently sent using UDP generic segmentation offload
+	 */
+	bool isGsoActive() const;
+
+	/**
+	 * Enables the socket option that lets packets carry a departure time (Linux only).
+	 * Call on a socket that is not used for sending yet.
+	 * @param socket the socket to enable departure times on
+	 * @param errorCode contains the error if the option is not supported
+	 * @return true if the socket accepts departure times
+	 */
+	static bool enableTxTime(asio::ip::udp::socket& socket, asio::error_code& errorCode);
+
+	/**
+	 * Stamps batched packets with a departure time. Call from the sending thread when the socket changes.
+	 * Only use on sockets on which enableTxTime() succeeded.
+	 * @param enable true to send packets with a departure time
+	 */
+	void setTxTimeEnabled(bool enable);
+
+	/**
+	 * @param delay time in microseconds between sending a packet and its departure time, headroom for the qdisc
+	 */
+	void setTxTimeDelay(int delay) { mTxTimeDelay = delay; }
+
+	/**
+	 * @return whether packets are currently sent with a departure time the kernel accepts
+	 */
+	bool isTxTimeActive() const;
+
+	/**
+	 * @return number of packets the kernel reported to have missed their departure time
+	 */
+	int getTxTimeMissedCount() const { return mTxTimeMissedCount.load(); }
+
+	/**
+	 * @param policy what to do when the socket can't accept more packets
+	 */
+	void setOverloadPolicy(OverloadPolicy policy) { mOverloadPolicy = policy; }
+
+	/**
+	 * @param spinTime maximum time in microseconds sendQueue() retries packets with OverloadPolicy::Spin
+	 */
+	void setSpinTime(int spinTime) { mSpinTime = spinTime; }
+
+	/**
+	 * @return number of times the socket could not accept more packets
+	 */
+	int getWouldBlockCount() const { return mWouldBlockCount.load(); }
+
+	/**
+	 * @return number of packets dropped because the socket could not accept them
+	 */
+	int getDropCount() const { return mDropCount.load(); }
+
+	/**
+	 * Resets the would block and drop counters.
+	 */
+	void resetCounters()
+	{
+		mWouldBlockCount = 0;
+		mDropCount = 0;
+		mTxTimeMissedCount = 0;
+	}
+
+	/**
+	 * Enables or disables sending through io_uring. Not thread safe.
+	 * Registers the packet storage of the queue with the kernel, call again after the queue or batch size changed.
+	 * Disable it before the queue is resized or destroyed, this waits for the kernel to release the packet storage.
+	 * @param queue the queue whose packets will be sent
+	 * @param enable true to send through io_uring
+	 * @param error contains the reason when io_uring could not be enabled
+	 * @return false when io_uring was requested but is not available, the regular socket path is used in that case
+	 */
+	bool setUringEnabled(PacketQueue& queue, bool enable, std::string& error);
+
+	/**
+	 * Sends and removes the packets currently in the queue, oldest first. Called from the consumer thread of the queue.
+	 * Packets that could not be sent are dropped, the last error is reported through errorCode.
+	 * When the socket buffer is full the overload policy decides which packets are dropped, and packets can remain queued.
+	 * @param queue the queue to drain
+	 * @param socket the socket to send the packets over
+	 * @param endpoints destinations of the packets, every packet is sent to all of them
+	 * @param errorCode contains the last error that occurred
+	 * @param maxPackets maximum number of packets to remove from the queue
+	 * @return number of packets sent successfully
+	 */
+	size_t sendQueue(PacketQueue& queue, asio::ip::udp::socket& socket, const std::vector<asio::ip::udp::endpoint>& endpoints, asio::error_code& errorCode, size_t maxPackets = SIZE_MAX);
+
+	/**
+	 * Removes packets from the front of the queue without sending them. Called from the consumer thread of the queue.
+	 * @param queue the queue the packets are removed from
+	 * @param count number of packets to remove
+	 */
+	void pop(PacketQueue& queue, size_t count);
+
+	/**
+	 * Sends a single packet.
+	 * @param packet the packet to send
+	 * @param socket the socket to send the packet over
+	 * @param endpoint destination of the packet
+	 * @param errorCode contains the error if sending failed
+	 * @return true if the packet was sent
+	 */
+	bool send(const PacketQueue::Packet& packet, asio::ip::udp::socket& socket, const asio::ip::udp::endpoint& endpoint, asio::error_code& errorCode);
+
+private:
+	// Returns the number of packets handled, less than count when the socket would block.
+	// The packet at the returned index can have been sent to some of the destinations, see mPartialPackets.
+	size_t sendBatch(PacketQueue::Packet** packets, size_t count, asio::ip::udp::socket& socket, const std::vector<asio::ip::udp::endpoint>& endpoints, size_t& sent, asio::error_code& errorCode);
+	bool spin(const PacketQueue::Packet& packet, asio::ip::udp::socket& socket, const std::vector<asio::ip::udp::endpoint>& endpoints, size_t firstDestination, std::chrono::steady_clock::time_point deadline, asio::error_code& errorCode);
+
+	// Remembers the destinations the count packets from index packet reached before the socket was full.
+	// Only one group of partially sent packets is remembered, packets of an earlier group can reach a destination twice,
+	// which receivers ignore by their frame counter.
+	void stopAt(size_t packet, size_t count, size_t destination);
+
+#ifdef VBAN_HAS_IO_URING
+	// Hands the packets to io_uring and releases the packets the kernel is done with from the front of the queue
+	size_t sendUring(PacketQueue& queue, asio::ip::udp::socket& socket, const std::vector<asio::ip::udp::endpoint>& endpoints, asio::error_code& errorCode, size_t maxPackets);
+#endif
+
+#ifdef __linux__
+	// Sends the packets with sendmmsg, returns the number of packets handled before the socket would block or segmentation was rejected
+	size_t sendMessages(PacketQueue::Packet** packets, size_t count, asio::ip::udp::socket& socket, const std::vector<asio::ip::udp::endpoint>& endpoints, bool segment, size_t& sent, bool& wouldBlock, asio::error_code& errorCode);
+
+	// Departure time of a packet in nanoseconds on CLOCK_MONOTONIC
+	uint64_t getDepartureTime(const PacketQueue::Packet& packet, uint64_t now);
+
+	// Counts the departure time errors the kernel queued on the socket
+	void readTxTimeErrors(int socket);
+
+	static constexpr size_t sMaxSegments = 64;			// UDP_MAX_SEGMENTS in the kernel
+	static constexpr size_t sMaxSegmentedSize = 65000;	// Segmented message has to fit in a single UDP datagram
+
+	struct Run
+	{
+		size_t mFirst = 0;
+		size_t mCount = 0;
+		size_t mFirstDestination = 0;	// Destinations before this already got the packets
+		size_t mFirstMessage = 0;
+	};
+
+	struct Control
+	{
+		alignas(cmsghdr) char mData[CMSG_SPACE(sizeof(uint64_t))];	// Segment size or departure time
+		size_t mSize = 0;
+	};
+#endif
+
+	std::atomic<bool> mBatchingEnabled = { true };
+	std::atomic<bool> mGsoEnabled = { false };
+	std::atomic<bool> mGsoRejected = { false };
+	std::atomic<OverloadPolicy> mOverloadPolicy = { OverloadPolicy::DropNewest };
+	std::atomic<int> mSpinTime = { 200 };
+	std::atomic<int> mWouldBlockCount = { 0 };
+	std::atomic<int> mDropCount = { 0 };
+	std::vector<PacketQueue::Packet*> mPackets;
+
+	// Packets at the front of the queue that were sent to the destinations before mPartialDestinations only
+	size_t mPartialPackets = 0;
+	size_t mPartialDestinations = 0;
+
+	// Departure times, the stream is anchored to the system clock at the first packet and whenever they drift apart
+	std::atomic<bool> mTxTimeEnabled = { false };
+	std::atomic<bool> mTxTimeRejected = { false };
+	std::atomic<int> mTxTimeDelay = { 2000 };
+	std::atomic<int> mTxTimeMissedCount = { 0 };
+	bool mTxTimeAnchored = false;
+	uint64_t mTxTimeAnchor = 0;
+	uint32_t mTxTimeAnchorFrame = 0;
+
+#ifdef VBAN_HAS_IO_URING
+	UringTransmitter mUring;
+	size_t mUringQueued = 0;			// Packets at the front of the queue that were handed to io_uring
+#endif
+
+#ifdef __linux__
+	std::vector<mmsghdr> mMessages;
+	std::vector<iovec> mIOVectors;
+	std::vector<Run> mRuns;				// Packets in each group of messages to all destinations
+	std::vector<size_t> mMessageRuns;	// Run of every message
+	std::vector<Control> mControls;		// Segmentation control message of each group
+#endif
+};
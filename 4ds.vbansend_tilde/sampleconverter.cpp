@@ -0,0 +1,481 @@
+#include "sampleconverter.h"
+#include "cpufeatures.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define VBAN_CONVERTER_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define VBAN_CONVERTER_NEON
+#include <arm_neon.h>
+#endif
+
+// Kernels for instruction sets beyond the baseline are compiled for their target only, MSVC doesn't need this
+#if defined(__GNUC__) || defined(__clang__)
+#define VBAN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define VBAN_TARGET(isa)
+#endif
+
+static constexpr double sInt16Scale = 32767.0;
+static constexpr double sInt24Scale = 8388607.0;
+static constexpr double sInt32Scale = 2147483647.0;
+
+
+// Scalar reference kernels
+
+static inline double clip(double sample)
+{
+	return std::max(-1.0, std::min(1.0, sample));
+}
+
+
+static inline void writeInt24(char* output, int32_t value)
+{
+	output[0] = static_cast<char>(value & 0xFF);
+	output[1] = static_cast<char>((value >> 8) & 0xFF);
+	output[2] = static_cast<char>((value >> 16) & 0xFF);
+}
+
+
+static void convertInt16Scalar(const double* input, char* output, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		auto value = static_cast<int16_t>(clip(input[i]) * sInt16Scale);
+		std::memcpy(output + i * 2, &value, 2);
+	}
+}
+
+
+static void convertInt24Scalar(const double* input, char* output, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		writeInt24(output + i * 3, static_cast<int32_t>(clip(input[i]) * sInt24Scale));
+}
+
+
+static void convertInt32Scalar(const double* input, char* output, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		auto value = static_cast<int32_t>(clip(input[i]) * sInt32Scale);
+		std::memcpy(output + i * 4, &value, 4);
+	}
+}
+
+
+static void convertFloat32Scalar(const double* input, char* output, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		auto value = static_cast<float>(clip(input[i]));
+		std::memcpy(output + i * 4, &value, 4);
+	}
+}
+
+
+#ifdef VBAN_CONVERTER_X86
+
+// SSE2 kernels, min returns its second operand for NaN so NaN clips to 1 like the scalar kernel
+
+VBAN_TARGET("sse2") static inline __m128d clipSse2(__m128d samples)
+{
+	return _mm_max_pd(_mm_min_pd(samples, _mm_set1_pd(1.0)), _mm_set1_pd(-1.0));
+}
+
+
+// Converts 4 samples to int32, truncating towards zero
+VBAN_TARGET("sse2") static inline __m128i convertSse2(const double* input, __m128d scale)
+{
+	auto low = _mm_cvttpd_epi32(_mm_mul_pd(clipSse2(_mm_loadu_pd(input)), scale));
+	auto high = _mm_cvttpd_epi32(_mm_mul_pd(clipSse2(_mm_loadu_pd(input + 2)), scale));
+	return _mm_unpacklo_epi64(low, high);
+}
+
+
+VBAN_TARGET("sse2") static void convertInt16Sse2(const double* input, char* output, size_t count)
+{
+	auto scale = _mm_set1_pd(sInt16Scale);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		auto values = _mm_packs_epi32(convertSse2(input + i, scale), convertSse2(input + i + 4, scale));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i * 2), values);
+	}
+	convertInt16Scalar(input + i, output + i * 2, count - i);
+}
+
+
+VBAN_TARGET("sse2") static void convertInt24Sse2(const double* input, char* output, size_t count)
+{
+	// Without byte shuffles the 24-bit values are written one by one
+	auto scale = _mm_set1_pd(sInt24Scale);
+	size_t i = 0;
+	alignas(16) int32_t values[4];
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm_store_si128(reinterpret_cast<__m128i*>(values), convertSse2(input + i, scale));
+		for (int j = 0; j < 4; j++)
+			writeInt24(output + (i + j) * 3, values[j]);
+	}
+	convertInt24Scalar(input + i, output + i * 3, count - i);
+}
+
+
+VBAN_TARGET("sse2") static void convertInt32Sse2(const double* input, char* output, size_t count)
+{
+	auto scale = _mm_set1_pd(sInt32Scale);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i * 4), convertSse2(input + i, scale));
+	convertInt32Scalar(input + i, output + i * 4, count - i);
+}
+
+
+VBAN_TARGET("sse2") static void convertFloat32Sse2(const double* input, char* output, size_t count)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		auto low = _mm_cvtpd_ps(clipSse2(_mm_loadu_pd(input + i)));
+		auto high = _mm_cvtpd_ps(clipSse2(_mm_loadu_pd(input + i + 2)));
+		_mm_storeu_ps(reinterpret_cast<float*>(output + i * 4), _mm_movelh_ps(low, high));
+	}
+	convertFloat32Scalar(input + i, output + i * 4, count - i);
+}
+
+
+// AVX2 kernels
+
+VBAN_TARGET("avx2") static inline __m256d clipAvx2(__m256d samples)
+{
+	return _mm256_max_pd(_mm256_min_pd(samples, _mm256_set1_pd(1.0)), _mm256_set1_pd(-1.0));
+}
+
+
+// Converts 4 samples to int32, truncating towards zero
+VBAN_TARGET("avx2") static inline __m128i convertAvx2(const double* input, __m256d scale)
+{
+	return _mm256_cvttpd_epi32(_mm256_mul_pd(clipAvx2(_mm256_loadu_pd(input)), scale));
+}
+
+
+// Writes the low 3 bytes of 4 int32 values as 12 packed bytes
+VBAN_TARGET("avx2") static inline void storeInt24(char* output, __m128i values)
+{
+	auto packed = _mm_shuffle_epi8(values, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(output), packed);
+	auto last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+	std::memcpy(output + 8, &last, 4);
+}
+
+
+VBAN_TARGET("avx2") static void convertInt16Avx2(const double* input, char* output, size_t count)
+{
+	auto scale = _mm256_set1_pd(sInt16Scale);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		auto first = _mm_packs_epi32(convertAvx2(input + i, scale), convertAvx2(input + i + 4, scale));
+		auto second = _mm_packs_epi32(convertAvx2(input + i + 8, scale), convertAvx2(input + i + 12, scale));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i * 2), first);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i * 2 + 16), second);
+	}
+	convertInt16Scalar(input + i, output + i * 2, count - i);
+}
+
+
+VBAN_TARGET("avx2") static void convertInt24Avx2(const double* input, char* output, size_t count)
+{
+	auto scale = _mm256_set1_pd(sInt24Scale);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		storeInt24(output + i * 3, convertAvx2(input + i, scale));
+		storeInt24(output + i * 3 + 12, convertAvx2(input + i + 4, scale));
+	}
+	convertInt24Scalar(input + i, output + i * 3, count - i);
+}
+
+
+VBAN_TARGET("avx2") static void convertInt32Avx2(const double* input, char* output, size_t count)
+{
+	auto scale = _mm256_set1_pd(sInt32Scale);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		auto values = _mm256_set_m128i(convertAvx2(input + i + 4, scale), convertAvx2(input + i, scale));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i * 4), values);
+	}
+	convertInt32Scalar(input + i, output + i * 4, count - i);
+}
+
+
+VBAN_TARGET("avx2") static void convertFloat32Avx2(const double* input, char* output, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		auto values = _mm256_set_m128(_mm256_cvtpd_ps(clipAvx2(_mm256_loadu_pd(input + i + 4))), _mm256_cvtpd_ps(clipAvx2(_mm256_loadu_pd(input + i))));
+		_mm256_storeu_ps(reinterpret_cast<float*>(output + i * 4), values);
+	}
+	convertFloat32Scalar(input + i, output + i * 4, count - i);
+}
+
+
+// AVX-512 kernels
+
+// GCC 12 takes the undefined vectors of the AVX-512 intrinsics for uninitialized ones, fixed in GCC 13
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ == 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+VBAN_TARGET("avx512f") static inline __m512d clipAvx512(__m512d samples)
+{
+	return _mm512_max_pd(_mm512_min_pd(samples, _mm512_set1_pd(1.0)), _mm512_set1_pd(-1.0));
+}
+
+
+// Converts 8 samples to int32, truncating towards zero
+VBAN_TARGET("avx512f") static inline __m256i convertAvx512(const double* input, __m512d scale)
+{
+	return _mm512_cvttpd_epi32(_mm512_mul_pd(clipAvx512(_mm512_loadu_pd(input)), scale));
+}
+
+
+VBAN_TARGET("avx512f") static void convertInt16Avx512(const double* input, char* output, size_t count)
+{
+	auto scale = _mm512_set1_pd(sInt16Scale);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		auto values = _mm512_inserti64x4(_mm512_castsi256_si512(convertAvx512(input + i, scale)), convertAvx512(input + i + 8, scale), 1);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i * 2), _mm512_cvtsepi32_epi16(values));
+	}
+	convertInt16Scalar(input + i, output + i * 2, count - i);
+}
+
+
+VBAN_TARGET("avx512f") static void convertInt24Avx512(const double* input, char* output, size_t count)
+{
+	auto scale = _mm512_set1_pd(sInt24Scale);
+	auto shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		auto values = convertAvx512(input + i, scale);
+		auto low = _mm_shuffle_epi8(_mm256_castsi256_si128(values), shuffle);
+		auto high = _mm_shuffle_epi8(_mm256_extracti128_si256(values, 1), shuffle);
+
+		// 24 bytes: the 12 bytes of the low half followed by the 12 bytes of the high half
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(output + i * 3), low);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(output + i * 3 + 8), _mm_or_si128(_mm_srli_si128(low, 8), _mm_slli_si128(high, 4)));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(output + i * 3 + 16), _mm_srli_si128(high, 4));
+	}
+	convertInt24Scalar(input + i, output + i * 3, count - i);
+}
+
+
+VBAN_TARGET("avx512f") static void convertInt32Avx512(const double* input, char* output, size_t count)
+{
+	auto scale = _mm512_set1_pd(sInt32Scale);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i * 4), convertAvx512(input + i, scale));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i * 4 + 32), convertAvx512(input + i + 8, scale));
+	}
+	convertInt32Scalar(input + i, output + i * 4, count - i);
+}
+
+
+VBAN_TARGET("avx512f") static void convertFloat32Avx512(const double* input, char* output, size_t count)
+{
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		_mm256_storeu_ps(reinterpret_cast<float*>(output + i * 4), _mm512_cvtpd_ps(clipAvx512(_mm512_loadu_pd(input + i))));
+		_mm256_storeu_ps(reinterpret_cast<float*>(output + i * 4 + 32), _mm512_cvtpd_ps(clipAvx512(_mm512_loadu_pd(input + i + 8))));
+	}
+	convertFloat32Scalar(input + i, output + i * 4, count - i);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ == 12
+#pragma GCC diagnostic pop
+#endif
+
+
+#endif // VBAN_CONVERTER_X86
+
+
+#ifdef VBAN_CONVERTER_NEON
+
+// NEON kernels, minnm and maxnm return the number for NaN so NaN clips to 1 like the scalar kernel
+
+static inline float64x2_t clipNeon(float64x2_t samples)
+{
+	return vmaxnmq_f64(vminnmq_f64(samples, vdupq_n_f64(1.0)), vdupq_n_f64(-1.0));
+}
+
+
+// Converts 4 samples to int32, truncating towards zero
+static inline int32x4_t convertNeon(const double* input, float64x2_t scale)
+{
+	auto low = vmovn_s64(vcvtq_s64_f64(vmulq_f64(clipNeon(vld1q_f64(input)), scale)));
+	auto high = vmovn_s64(vcvtq_s64_f64(vmulq_f64(clipNeon(vld1q_f64(input + 2)), scale)));
+	return vcombine_s32(low, high);
+}
+
+
+static void convertInt16Neon(const double* input, char* output, size_t count)
+{
+	auto scale = vdupq_n_f64(sInt16Scale);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		auto values = vcombine_s16(vqmovn_s32(convertNeon(input + i, scale)), vqmovn_s32(convertNeon(input + i + 4, scale)));
+		vst1q_s16(reinterpret_cast<int16_t*>(output + i * 2), values);
+	}
+	convertInt16Scalar(input + i, output + i * 2, count - i);
+}
+
+
+static void convertInt24Neon(const double* input, char* output, size_t count)
+{
+	auto scale = vdupq_n_f64(sInt24Scale);
+	size_t i = 0;
+	int32_t values[4];
+	for (; i + 4 <= count; i += 4)
+	{
+		vst1q_s32(values, convertNeon(input + i, scale));
+		for (int j = 0; j < 4; j++)
+			writeInt24(output + (i + j) * 3, values[j]);
+	}
+	convertInt24Scalar(input + i, output + i * 3, count - i);
+}
+
+
+static void convertInt32Neon(const double* input, char* output, size_t count)
+{
+	auto scale = vdupq_n_f64(sInt32Scale);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+		vst1q_s32(reinterpret_cast<int32_t*>(output + i * 4), convertNeon(input + i, scale));
+	convertInt32Scalar(input + i, output + i * 4, count - i);
+}
+
+
+static void convertFloat32Neon(const double* input, char* output, size_t count)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		auto low = vcvt_f32_f64(clipNeon(vld1q_f64(input + i)));
+		auto high = vcvt_f32_f64(clipNeon(vld1q_f64(input + i + 2)));
+		vst1q_f32(reinterpret_cast<float*>(output + i * 4), vcombine_f32(low, high));
+	}
+	convertFloat32Scalar(input + i, output + i * 4, count - i);
+}
+
+#endif // VBAN_CONVERTER_NEON
+
+
+// Kernel selection, done once when the external is loaded
+
+struct KernelSet
+{
+	SampleConverter::Kernel mInt16;
+	SampleConverter::Kernel mInt24;
+	SampleConverter::Kernel mInt32;
+	SampleConverter::Kernel mFloat32;
+	const char* mName;
+};
+
+static const KernelSet sScalarKernels = { convertInt16Scalar, convertInt24Scalar, convertInt32Scalar, convertFloat32Scalar, "scalar" };
+
+
+// The kernel sets the CPU supports, fastest first
+static std::vector<KernelSet> getSupportedKernels()
+{
+	std::vector<KernelSet> kernels;
+#if defined(VBAN_CONVERTER_X86)
+	if (CpuFeatures::hasAvx512())
+		kernels.push_back({ convertInt16Avx512, convertInt24Avx512, convertInt32Avx512, convertFloat32Avx512, "AVX-512" });
+	if (CpuFeatures::hasAvx2())
+		kernels.push_back({ convertInt16Avx2, convertInt24Avx2, convertInt32Avx2, convertFloat32Avx2, "AVX2" });
+	kernels.push_back({ convertInt16Sse2, convertInt24Sse2, convertInt32Sse2, convertFloat32Sse2, "SSE2" });
+#elif defined(VBAN_CONVERTER_NEON)
+	kernels.push_back({ convertInt16Neon, convertInt24Neon, convertInt32Neon, convertFloat32Neon, "NEON" });
+#else
+	kernels.push_back(sScalarKernels);
+#endif
+	return kernels;
+}
+
+static const std::vector<KernelSet> sSupportedKernels = getSupportedKernels();
+static const KernelSet sKernels = sSupportedKernels.front();
+
+
+static SampleConverter::Kernel getFromSet(const KernelSet& kernels, SampleConverter::Format format)
+{
+	switch (format)
+	{
+		case SampleConverter::Format::Int24: return kernels.mInt24;
+		case SampleConverter::Format::Int32: return kernels.mInt32;
+		case SampleConverter::Format::Float32: return kernels.mFloat32;
+		default: return kernels.mInt16;
+	}
+}
+
+
+SampleConverter::Kernel SampleConverter::getKernel(Format format)
+{
+	return getFromSet(sKernels, format);
+}
+
+
+SampleConverter::Kernel SampleConverter::getScalarKernel(Format format)
+{
+	return getFromSet(sScalarKernels, format);
+}
+
+
+double SampleConverter::getZeroThreshold(Format format)
+{
+	// Integer samples truncate towards zero, half a step leaves room for the rounding of the scaling
+	switch (format)
+	{
+		case Format::Int16: return 0.5 / sInt16Scale;
+		case Format::Int24: return 0.5 / sInt24Scale;
+		case Format::Int32: return 0.5 / sInt32Scale;
+		default: return 0.0;
+	}
+}
+
+
+const char* SampleConverter::getInstructionSet()
+{
+	return sKernels.mName;
+}
+
+
+SampleConverter::Kernel SampleConverter::getSupportedKernel(Format format, int index)
+{
+	if (index < 0 || index >= static_cast<int>(sSupportedKernels.size()))
+		return nullptr;
+	return getFromSet(sSupportedKernels[static_cast<size_t>(index)], format);
+}
+
+
+const char* SampleConverter::getSupportedInstructionSet(int index)
+{
+	if (index < 0 || index >= static_cast<int>(sSupportedKernels.size()))
+		return nullptr;
+	return sSupportedKernels[static_cast<size_t>(index)].mName;
+}
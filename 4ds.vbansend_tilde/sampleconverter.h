@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * Converts 64-bit samples to the sample formats VBAN transports, clipping them to [-1, 1].
+ * Every format has a scalar kernel and vectorized kernels for SSE2, AVX2 and AVX-512 on x86 and NEON on ARM.
+ * The fastest kernel the CPU supports is selected once, when the external is loaded.
+ * All kernels produce the same output as the scalar kernel: integer formats scale by the largest positive value
+ * and truncate towards zero, float32 rounds to nearest, NaN is converted as 1.
+ */
+class SampleConverter
+{
+public:
+	/**
+	 * Sample formats, the values match the VBAN bit resolution of the format.
+	 */
+	enum class Format
+	{
+		Int16 = 1,		///< VBAN_BITFMT_16_INT
+		Int24 = 2,		///< VBAN_BITFMT_24_INT
+		Int32 = 3,		///< VBAN_BITFMT_32_INT
+		Float32 = 4		///< VBAN_BITFMT_32_FLOAT
+	};
+
+	/**
+	 * Converts count samples, output is packed little endian.
+	 * Input and output don't need to be aligned.
+	 */
+	using Kernel = void (*)(const double* input, char* output, size_t count);
+
+	/**
+	 * @param format the sample format
+	 * @return the fastest kernel for the format on this CPU
+	 */
+	static Kernel getKernel(Format format);
+
+	/**
+	 * @param format the sample format
+	 * @return the scalar reference kernel for the format
+	 */
+	static Kernel getScalarKernel(Format format);
+
+	/**
+	 * @return name of the instruction set of the selected kernels
+	 */
+	static const char* getInstructionSet();
+
+	/**
+	 * Gives access to the kernels of every instruction set the CPU supports, to test them against the scalar kernels.
+	 * @param format the sample format
+	 * @param index index of the instruction set, 0 is the one getKernel() selected
+	 * @return the kernel, nullptr when the CPU supports fewer instruction sets
+	 */
+	static Kernel getSupportedKernel(Format format, int index);
+
+	/**
+	 * @param index index of the instruction set, as for getSupportedKernel()
+	 * @return name of the instruction set, nullptr when the CPU supports fewer instruction sets
+	 */
+	static const char* getSupportedInstructionSet(int index);
+
+	/**
+	 * @param format the sample format
+	 * @return largest magnitude that is safely converted to zero: half a step of the integer formats, 0 for float32
+	 */
+	static double getZeroThreshold(Format format);
+
+	/**
+	 * @param format the sample format
+	 * @return size of a sample in bytes
+	 */
+	static int getSampleSize(Format format) { return format == Format::Int16 ? 2 : format == Format::Int24 ? 3 : 4; }
+};
@@ -0,0 +1,145 @@
+#include "silencedetector.h"
+#include "cpufeatures.h"
+
+#include <cmath>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define VBAN_SILENCE_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define VBAN_SILENCE_NEON
+#include <arm_neon.h>
+#endif
+
+// Kernels for instruction sets beyond the baseline are compiled for their target only, MSVC doesn't need this
+#if defined(__GNUC__) || defined(__clang__)
+#define VBAN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define VBAN_TARGET(isa)
+#endif
+
+
+static bool isSilentScalar(const double* input, size_t count, double threshold)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		// Written so NaN is loud
+		if (!(std::fabs(input[i]) <= threshold))
+			return false;
+	}
+	return true;
+}
+
+
+#ifdef VBAN_SILENCE_X86
+
+VBAN_TARGET("sse2") static bool isSilentSse2(const double* input, size_t count, double threshold)
+{
+	auto signMask = _mm_set1_pd(-0.0);
+	auto limit = _mm_set1_pd(threshold);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		auto loud0 = _mm_cmpnle_pd(_mm_andnot_pd(signMask, _mm_loadu_pd(input + i)), limit);
+		auto loud1 = _mm_cmpnle_pd(_mm_andnot_pd(signMask, _mm_loadu_pd(input + i + 2)), limit);
+		if (_mm_movemask_pd(_mm_or_pd(loud0, loud1)) != 0)
+			return false;
+	}
+	return isSilentScalar(input + i, count - i, threshold);
+}
+
+
+VBAN_TARGET("avx") static bool isSilentAvx(const double* input, size_t count, double threshold)
+{
+	auto signMask = _mm256_set1_pd(-0.0);
+	auto limit = _mm256_set1_pd(threshold);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		auto loud0 = _mm256_cmp_pd(_mm256_andnot_pd(signMask, _mm256_loadu_pd(input + i)), limit, _CMP_NLE_UQ);
+		auto loud1 = _mm256_cmp_pd(_mm256_andnot_pd(signMask, _mm256_loadu_pd(input + i + 4)), limit, _CMP_NLE_UQ);
+		if (_mm256_movemask_pd(_mm256_or_pd(loud0, loud1)) != 0)
+			return false;
+	}
+	return isSilentScalar(input + i, count - i, threshold);
+}
+
+#endif // VBAN_SILENCE_X86
+
+
+#ifdef VBAN_SILENCE_NEON
+
+static bool isSilentNeon(const double* input, size_t count, double threshold)
+{
+	auto limit = vdupq_n_f64(threshold);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		// Quiet lanes compare all ones, NaN compares zero
+		auto quiet0 = vcleq_f64(vabsq_f64(vld1q_f64(input + i)), limit);
+		auto quiet1 = vcleq_f64(vabsq_f64(vld1q_f64(input + i + 2)), limit);
+		if (vminvq_u32(vreinterpretq_u32_u64(vandq_u64(quiet0, quiet1))) == 0)
+			return false;
+	}
+	return isSilentScalar(input + i, count - i, threshold);
+}
+
+#endif // VBAN_SILENCE_NEON
+
+
+// Kernel selection, done once when the external is loaded
+
+struct SilenceKernelInfo
+{
+	SilenceDetector::Kernel mKernel;
+	const char* mName;
+};
+
+
+// The kernels the CPU supports, fastest first
+static std::vector<SilenceKernelInfo> getSupportedKernels()
+{
+	std::vector<SilenceKernelInfo> kernels;
+#if defined(VBAN_SILENCE_X86)
+	if (CpuFeatures::hasAvx2())
+		kernels.push_back({ isSilentAvx, "AVX" });
+	kernels.push_back({ isSilentSse2, "SSE2" });
+#elif defined(VBAN_SILENCE_NEON)
+	kernels.push_back({ isSilentNeon, "NEON" });
+#else
+	kernels.push_back({ isSilentScalar, "scalar" });
+#endif
+	return kernels;
+}
+
+static const std::vector<SilenceKernelInfo> sSupportedKernels = getSupportedKernels();
+static const SilenceDetector::Kernel sKernel = sSupportedKernels.front().mKernel;
+
+
+SilenceDetector::Kernel SilenceDetector::getKernel()
+{
+	return sKernel;
+}
+
+
+SilenceDetector::Kernel SilenceDetector::getScalarKernel()
+{
+	return isSilentScalar;
+}
+
+
+SilenceDetector::Kernel SilenceDetector::getSupportedKernel(int index)
+{
+	if (index < 0 || index >= static_cast<int>(sSupportedKernels.size()))
+		return nullptr;
+	return sSupportedKernels[static_cast<size_t>(index)].mKernel;
+}
+
+
+const char* SilenceDetector::getSupportedInstructionSet(int index)
+{
+	if (index < 0 || index >= static_cast<int>(sSupportedKernels.size()))
+		return nullptr;
+	return sSupportedKernels[static_cast<size_t>(index)].mName;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * Checks whether blocks of samples are silent, meaning no sample exceeds a threshold in magnitude.
+ * Used for discontinuous transmission, so it runs on every sample of every channel and stops at the first loud sample.
+ * The fastest kernel the CPU supports is selected once, when the external is loaded. NaN is never silent.
+ */
+class SilenceDetector
+{
+public:
+	/**
+	 * @return true when the magnitude of none of the count samples exceeds threshold
+	 */
+	using Kernel = bool (*)(const double* input, size_t count, double threshold);
+
+	/**
+	 * @return the fastest kernel on this CPU
+	 */
+	static Kernel getKernel();
+
+	/**
+	 * @return the scalar reference kernel
+	 */
+	static Kernel getScalarKernel();
+
+	/**
+	 * Gives access to the kernels of every instruction set the CPU supports, to test them against the scalar kernel.
+	 * @param index index of the instruction set, 0 is the one getKernel() selected
+	 * @return the kernel, nullptr when the CPU supports fewer instruction sets
+	 */
+	static Kernel getSupportedKernel(int index);
+
+	/**
+	 * @param index index of the instruction set, as for getSupportedKernel()
+	 * @return name of the instruction set, nullptr when the CPU supports fewer instruction sets
+	 */
+	static const char* getSupportedInstructionSet(int index);
+};
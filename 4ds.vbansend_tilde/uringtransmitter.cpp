@@ -0,0 +1,175 @@
+#ifdef VBAN_HAS_IO_URING
+
+#include "uringtransmitter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+
+UringTransmitter::~UringTransmitter()
+{
+	shutdown();
+}
+
+
+bool UringTransmitter::init(PacketQueue& queue, size_t sendCount, std::string& error)
+{
+	shutdown();
+
+	// Every send posts up to two completions, the completion queue holds twice the entries of the submission queue
+	int result = io_uring_queue_init(static_cast<unsigned int>(sendCount), &mRing, 0);
+	if (result < 0)
+	{
+		error = std::string("io_uring not available: ") + std::strerror(-result);
+		return false;
+	}
+	mInitialized = true;
+
+	// Zero copy sends need Linux 6.0 or later
+	auto probe = io_uring_get_probe_ring(&mRing);
+	bool supported = probe != nullptr && io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+	if (probe != nullptr)
+		io_uring_free_probe(probe);
+	if (!supported)
+	{
+		error = "io_uring zero copy send not supported by this kernel";
+		shutdown();
+		return false;
+	}
+
+	// Register the packet storage as a single fixed buffer
+	iovec buffer;
+	buffer.iov_base = queue.storage();
+	buffer.iov_len = queue.storageSize();
+	result = io_uring_register_buffers(&mRing, &buffer, 1);
+	if (result < 0)
+	{
+		error = std::string("Unable to register io_uring buffers: ") + std::strerror(-result);
+		shutdown();
+		return false;
+	}
+	mBuffersRegistered = true;
+
+	mStorage = queue.storage();
+	mSlots.assign(queue.storageSize() / sizeof(PacketQueue::Packet), Slot());
+	mSendCount = sendCount;
+	mInFlight = 0;
+	mPrepared = 0;
+	return true;
+}
+
+
+void UringTransmitter::shutdown()
+{
+	if (!mInitialized)
+		return;
+
+	// The kernel may still read from the packet storage, give the sends in flight a moment to complete
+	asio::error_code errorCode;
+	submit(errorCode);
+	size_t sent = 0;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	while (mInFlight > mPrepared && std::chrono::steady_clock::now() < deadline)
+	{
+		__kernel_timespec timeout = { 0, 10000000 };
+		io_uring_cqe* cqe = nullptr;
+		int result = io_uring_wait_cqe_timeout(&mRing, &cqe, &timeout);
+		if (result == 0)
+		{
+			process(*cqe, sent, errorCode);
+			io_uring_cqe_seen(&mRing, cqe);
+		}
+		else if (result != -ETIME && result != -EINTR)
+		{
+			break;
+		}
+	}
+
+	if (mBuffersRegistered)
+		io_uring_unregister_buffers(&mRing);
+	mBuffersRegistered = false;
+
+	io_uring_queue_exit(&mRing);
+	mInitialized = false;
+	mSlots.clear();
+	mInFlight = 0;
+	mPrepared = 0;
+}
+
+
+bool UringTransmitter::prepare(int socket, const PacketQueue::Packet& packet, const sockaddr* address, socklen_t addressSize, size_t destination)
+{
+	if (!hasRoom(1))
+		return false;
+	auto sqe = io_uring_get_sqe(&mRing);
+	if (sqe == nullptr)
+		return false;
+
+	auto slot = index(packet);
+	io_uring_prep_send_zc_fixed(sqe, socket, packet.data(), packet.size(), MSG_DONTWAIT, 0, 0);
+	io_uring_prep_send_set_addr(sqe, address, static_cast<__u16>(addressSize));
+	io_uring_sqe_set_data64(sqe, (static_cast<uint64_t>(slot) << 4) | destination);
+	mSlots[slot].mPending++;
+	mSlots[slot].mBlocked &= ~(1u << destination);
+	mInFlight++;
+	mPrepared++;
+	return true;
+}
+
+
+void UringTransmitter::submit(asio::error_code& errorCode)
+{
+	if (mPrepared == 0)
+		return;
+
+	int result = io_uring_submit(&mRing);
+	if (result >= 0)
+		mPrepared -= std::min(static_cast<size_t>(result), mPrepared);
+	else if (result != -EINTR && result != -EAGAIN && result != -EBUSY)
+		errorCode = asio::error_code(-result, asio::error::get_system_category());
+}
+
+
+void UringTransmitter::reap(size_t& sent, asio::error_code& errorCode)
+{
+	io_uring_cqe* cqe = nullptr;
+	while (io_uring_peek_cqe(&mRing, &cqe) == 0)
+	{
+		process(*cqe, sent, errorCode);
+		io_uring_cqe_seen(&mRing, cqe);
+	}
+}
+
+
+void UringTransmitter::process(const io_uring_cqe& cqe, size_t& sent, asio::error_code& errorCode)
+{
+	// Every send completes with a result, followed by a notification once the kernel released the buffer.
+	// Sends that failed don't post a notification.
+	auto data = io_uring_cqe_get_data64(&cqe);
+	auto& slot = mSlots[static_cast<size_t>(data >> 4)];
+	auto destination = static_cast<uint32_t>(data & 15);
+	if (!(cqe.flags & IORING_CQE_F_NOTIF))
+	{
+		if (cqe.res >= 0)
+		{
+			if (destination == 0)
+				sent++;
+		}
+		else if (cqe.res == -EAGAIN)
+		{
+			slot.mBlocked |= 1u << destination;
+		}
+		else
+		{
+			errorCode = asio::error_code(-cqe.res, asio::error::get_system_category());
+		}
+		if (cqe.flags & IORING_CQE_F_MORE)
+			return;
+	}
+	slot.mPending--;
+	mInFlight--;
+}
+
+#endif // VBAN_HAS_IO_URING
@@ -0,0 +1,115 @@
+#pragma once
+
+#ifdef VBAN_HAS_IO_URING
+
+#include "packetqueue.h"
+
+#include <asio/error.hpp>
+#include <asio/error_code.hpp>
+
+#include <liburing.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Sends packets through io_uring.
+ * The storage of the packet queue is registered with the kernel once, packets are sent from it with
+ * zero copy fixed buffer sends, using the contiguous layout of header and payload in the packet slot.
+ * Sends are submitted without waiting for them. Their completions are reaped on later calls, without system calls,
+ * and the transmitter keeps track of which packets the kernel still reads from: a packet slot can only be reused
+ * once every send of it completed and the kernel released its buffer.
+ */
+class UringTransmitter
+{
+public:
+	~UringTransmitter();
+
+	/**
+	 * Sets up the ring and registers the packet storage of the queue.
+	 * Fails when io_uring or zero copy sends are not supported by the kernel, or when the buffers can't be registered.
+	 * @param queue queue whose packet storage is registered, can't be resized while the transmitter is initialized
+	 * @param sendCount maximum number of sends in flight
+	 * @param error contains the error message when initialization failed
+	 * @return true on success
+	 */
+	bool init(PacketQueue& queue, size_t sendCount, std::string& error);
+
+	/**
+	 * Waits for the sends in flight, unregisters the packet storage and tears down the ring.
+	 */
+	void shutdown();
+
+	/**
+	 * @return whether the transmitter is ready to send
+	 */
+	bool isInitialized() const { return mInitialized; }
+
+	/**
+	 * @param count number of sends
+	 * @return whether that many more sends can be prepared
+	 */
+	bool hasRoom(size_t count) const { return mInFlight + count <= mSendCount; }
+
+	/**
+	 * Prepares a send of a packet from the registered queue storage, it is handed to the kernel by submit().
+	 * @param socket native handle of the socket to send on
+	 * @param packet packet to send, stored in the registered queue
+	 * @param address destination address
+	 * @param addressSize size of the destination address
+	 * @param destination index of the destination, below 16. Successful sends to destination 0 are counted as sent.
+	 * @return false when there is no room for another send
+	 */
+	bool prepare(int socket, const PacketQueue::Packet& packet, const sockaddr* address, socklen_t addressSize, size_t destination);
+
+	/**
+	 * Hands the prepared sends to the kernel without waiting for them.
+	 * Sends the kernel didn't take stay prepared and are submitted on the next call.
+	 * @param errorCode contains the error when submitting failed
+	 */
+	void submit(asio::error_code& errorCode);
+
+	/**
+	 * Processes the completions the kernel posted so far, without waiting.
+	 * @param sent incremented for every packet sent to destination 0
+	 * @param errorCode contains the last error a send failed with
+	 */
+	void reap(size_t& sent, asio::error_code& errorCode);
+
+	/**
+	 * @return whether the kernel is done with the packet: all its sends completed and released its buffer
+	 */
+	bool isReleased(const PacketQueue::Packet& packet) const { return mSlots[index(packet)].mPending == 0; }
+
+	/**
+	 * @return a bit for every destination index the packet could not be sent to because the socket buffer was full
+	 */
+	uint32_t getBlockedDestinations(const PacketQueue::Packet& packet) const { return mSlots[index(packet)].mBlocked; }
+
+	/**
+	 * Forgets the destinations the packet could not be sent to, a new send to a destination forgets it as well.
+	 */
+	void clearBlockedDestinations(const PacketQueue::Packet& packet) { mSlots[index(packet)].mBlocked = 0; }
+
+private:
+	struct Slot
+	{
+		uint32_t mPending = 0;		// Sends of the packet that haven't completed or released the buffer yet
+		uint32_t mBlocked = 0;		// Destinations the socket buffer was full for
+	};
+
+	size_t index(const PacketQueue::Packet& packet) const { return static_cast<size_t>(&packet - mStorage); }
+	void process(const io_uring_cqe& cqe, size_t& sent, asio::error_code& errorCode);
+
+	io_uring mRing;
+	bool mInitialized = false;
+	bool mBuffersRegistered = false;
+	const PacketQueue::Packet* mStorage = nullptr;
+	std::vector<Slot> mSlots;
+	size_t mSendCount = 0;
+	size_t mInFlight = 0;		// Prepared sends that haven't completed or released their buffer yet
+	size_t mPrepared = 0;		// Prepared sends that haven't been submitted yet
+};
+
+#endif // VBAN_HAS_IO_URING
@@ -0,0 +1,51 @@
+#include "cpufeatures.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define VBAN_CPU_X86
+#ifdef _MSC_VER
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+#endif
+
+
+bool CpuFeatures::hasAvx2()
+{
+#if defined(VBAN_CPU_X86) && defined(_MSC_VER)
+	// The operating system has to save the AVX registers as well
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#elif defined(VBAN_CPU_X86)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+
+bool CpuFeatures::hasAvx512()
+{
+#if defined(VBAN_CPU_X86) && defined(_MSC_VER)
+	// The operating system has to save the AVX-512 registers as well
+	if (!hasAvx2() || (_xgetbv(0) & 0xE6) != 0xE6)
+		return false;
+	int info[4];
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 16)) != 0;
+#elif defined(VBAN_CPU_X86)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+/**
+ * Instruction set extensions the CPU and operating system support, for selecting vectorized kernels at load time.
+ * Always false on other architectures than x86.
+ */
+class CpuFeatures
+{
+public:
+	/**
+	 * @return whether AVX2 can be used
+	 */
+	static bool hasAvx2();
+
+	/**
+	 * @return whether AVX-512 Foundation can be used
+	 */
+	static bool hasAvx512();
+};
@@ -0,0 +1,276 @@
+#include "losslesscodec.h"
+
+#include <algorithm>
+#include <cstdint>
+
+// Frames per packet are limited by VBAN_SAMPLES_MAX_NB
+static constexpr int sMaxFrameCount = 256;
+
+
+// Little endian sample of sampleSize bytes, sign extended
+static int64_t readSample(const char* data, int sampleSize)
+{
+	uint32_t value = 0;
+	for (int i = 0; i < sampleSize; i++)
+		value |= static_cast<uint32_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+	int unused = 32 - 8 * sampleSize;
+	return static_cast<int64_t>(static_cast<int32_t>(value << unused)) >> unused;
+}
+
+
+static void writeSample(char* data, int sampleSize, int64_t value)
+{
+	for (int i = 0; i < sampleSize; i++)
+		data[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+
+// Fixed polynomial predictors, sample n is predicted from the order samples before it
+static int64_t predict(const int64_t* samples, int n, int order)
+{
+	switch (order)
+	{
+		case 1: return samples[n - 1];
+		case 2: return 2 * samples[n - 1] - samples[n - 2];
+		case 3: return 3 * samples[n - 1] - 3 * samples[n - 2] + samples[n - 3];
+		default: return 0;
+	}
+}
+
+
+static uint64_t zigzag(int64_t value)
+{
+	return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+
+static int64_t unzigzag(uint64_t value)
+{
+	return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+
+// Writes bits most significant first, stops writing when the output is full
+class BitWriter
+{
+public:
+	BitWriter(char* output, size_t capacity) : mOutput(output), mCapacity(capacity) { }
+
+	// Appends the lowest bitCount bits of value, at most 32
+	void write(uint64_t value, int bitCount)
+	{
+		uint64_t mask = (uint64_t(1) << bitCount) - 1;
+		mAccumulator = (mAccumulator << bitCount) | (value & mask);
+		mBitCount += bitCount;
+		while (mBitCount >= 8)
+		{
+			mBitCount -= 8;
+			if (mSize < mCapacity)
+				mOutput[mSize++] = static_cast<char>((mAccumulator >> mBitCount) & 0xFF);
+			else
+				mOverflow = true;
+		}
+	}
+
+	// Pads the last byte with zeros
+	void align()
+	{
+		if (mBitCount > 0)
+			write(0, 8 - mBitCount);
+	}
+
+	size_t getSize() const { return mSize; }
+	bool hasOverflowed() const { return mOverflow; }
+
+private:
+	char* mOutput;
+	size_t mCapacity;
+	size_t mSize = 0;
+	uint64_t mAccumulator = 0;
+	int mBitCount = 0;
+	bool mOverflow = false;
+};
+
+
+// Reads bits most significant first, fails when reading past the end
+class BitReader
+{
+public:
+	BitReader(const char* input, size_t size) : mInput(reinterpret_cast<const uint8_t*>(input)), mSize(size) { }
+
+	bool readBit(uint64_t& bit)
+	{
+		if (mPosition >= mSize * 8)
+			return false;
+		bit = (mInput[mPosition >> 3] >> (7 - (mPosition & 7))) & 1;
+		mPosition++;
+		return true;
+	}
+
+	bool read(int bitCount, uint64_t& value)
+	{
+		value = 0;
+		for (int i = 0; i < bitCount; i++)
+		{
+			uint64_t bit;
+			if (!readBit(bit))
+				return false;
+			value = (value << 1) | bit;
+		}
+		return true;
+	}
+
+	void align() { mPosition = (mPosition + 7) & ~size_t(7); }
+
+private:
+	const uint8_t* mInput;
+	size_t mSize;
+	size_t mPosition = 0;
+};
+
+
+static void writeRice(BitWriter& writer, uint64_t value, int parameter)
+{
+	uint64_t quotient = value >> parameter;
+	if (quotient < static_cast<uint64_t>(LosslessCodec::sEscapeQuotient))
+	{
+		// quotient ones and a terminating zero, then the remainder
+		writer.write(((uint64_t(1) << quotient) - 1) << 1, static_cast<int>(quotient) + 1);
+		writer.write(value, parameter);
+	}
+	else
+	{
+		writer.write(0xFFFFFFFF, LosslessCodec::sEscapeQuotient);
+		writer.write(value >> 32, LosslessCodec::sEscapeBits - 32);
+		writer.write(value, 32);
+	}
+}
+
+
+static bool readRice(BitReader& reader, int parameter, uint64_t& value)
+{
+	uint64_t quotient = 0;
+	uint64_t bit = 1;
+	while (quotient < static_cast<uint64_t>(LosslessCodec::sEscapeQuotient))
+	{
+		if (!reader.readBit(bit))
+			return false;
+		if (bit == 0)
+			break;
+		quotient++;
+	}
+	if (quotient == static_cast<uint64_t>(LosslessCodec::sEscapeQuotient))
+		return reader.read(LosslessCodec::sEscapeBits, value);
+
+	uint64_t remainder;
+	if (!reader.read(parameter, remainder))
+		return false;
+	value = (quotient << parameter) | remainder;
+	return true;
+}
+
+
+size_t LosslessCodec::encode(const char* input, int frameCount, int channelCount, int sampleSize, char* output, size_t capacity)
+{
+	if (frameCount < 1 || frameCount > sMaxFrameCount || channelCount < 1 || sampleSize < 2 || sampleSize > 4)
+		return 0;
+
+	BitWriter writer(output, capacity);
+	int64_t samples[sMaxFrameCount];
+	for (int channel = 0; channel < channelCount && !writer.hasOverflowed(); channel++)
+	{
+		for (int frame = 0; frame < frameCount; frame++)
+			samples[frame] = readSample(input + (static_cast<size_t>(frame) * channelCount + channel) * sampleSize, sampleSize);
+
+		// Pick the predictor and Rice parameter that take the fewest bits, including the first samples stored as is
+		int maxOrder = std::min(sMaxOrder, frameCount - 1);
+		int order = 0;
+		int parameter = 0;
+		uint64_t smallest = UINT64_MAX;
+		uint64_t residuals[sMaxFrameCount];
+		for (int candidate = 0; candidate <= maxOrder; candidate++)
+		{
+			uint64_t sum = 0;
+			for (int n = candidate; n < frameCount; n++)
+			{
+				residuals[n] = zigzag(samples[n] - predict(samples, n, candidate));
+				sum += residuals[n];
+			}
+
+			// Rice parameter close to the log2 of the mean residual
+			auto residualCount = static_cast<uint64_t>(frameCount - candidate);
+			int candidateParameter = 0;
+			while (candidateParameter < sMaxRiceParameter && (residualCount << (candidateParameter + 1)) <= sum)
+				candidateParameter++;
+
+			uint64_t bits = static_cast<uint64_t>(candidate * sampleSize * 8);
+			for (int n = candidate; n < frameCount; n++)
+			{
+				auto quotient = residuals[n] >> candidateParameter;
+				bits += quotient < static_cast<uint64_t>(sEscapeQuotient) ? quotient + 1 + candidateParameter : sEscapeQuotient + sEscapeBits;
+			}
+			if (bits < smallest)
+			{
+				smallest = bits;
+				order = candidate;
+				parameter = candidateParameter;
+			}
+		}
+
+		writer.write(static_cast<uint64_t>(order | (parameter << 2)), 8);
+		for (int n = 0; n < order; n++)
+			for (int i = 0; i < sampleSize; i++)
+				writer.write(static_cast<uint64_t>(samples[n] >> (8 * i)), 8);
+		for (int n = order; n < frameCount; n++)
+			writeRice(writer, zigzag(samples[n] - predict(samples, n, order)), parameter);
+		writer.align();
+	}
+	return writer.hasOverflowed() ? 0 : writer.getSize();
+}
+
+
+bool LosslessCodec::decode(const char* input, size_t size, int frameCount, int channelCount, int sampleSize, char* output)
+{
+	if (frameCount < 1 || frameCount > sMaxFrameCount || channelCount < 1 || sampleSize < 2 || sampleSize > 4)
+		return false;
+
+	BitReader reader(input, size);
+	int64_t samples[sMaxFrameCount];
+	for (int channel = 0; channel < channelCount; channel++)
+	{
+		uint64_t settings;
+		if (!reader.read(8, settings))
+			return false;
+		int order = static_cast<int>(settings & 3);
+		int parameter = static_cast<int>((settings >> 2) & 31);
+		if (order >= frameCount)
+			return false;
+
+		for (int n = 0; n < order; n++)
+		{
+			uint64_t value = 0;
+			for (int i = 0; i < sampleSize; i++)
+			{
+				uint64_t byte;
+				if (!reader.read(8, byte))
+					return false;
+				value |= byte << (8 * i);
+			}
+			char bytes[4];
+			writeSample(bytes, sampleSize, static_cast<int64_t>(value));
+			samples[n] = readSample(bytes, sampleSize);
+		}
+		for (int n = order; n < frameCount; n++)
+		{
+			uint64_t value;
+			if (!readRice(reader, parameter, value))
+				return false;
+			samples[n] = unzigzag(value) + predict(samples, n, order);
+		}
+		reader.align();
+
+		for (int frame = 0; frame < frameCount; frame++)
+			writeSample(output + (static_cast<size_t>(frame) * channelCount + channel) * sampleSize, sampleSize, samples[frame]);
+	}
+	return true;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * Lossless compression of VBAN integer PCM payloads, sent with VBAN_CODEC_USER in the codec bits of the header.
+ * Frame count, channel count and bit resolution stay in the VBAN header, the payload holds one block per channel:
+ *
+ *     1 byte     predictor order (bits 0-1) and Rice parameter (bits 2-6)
+ *     order x    first samples of the channel, little endian, sample size bytes each
+ *     bits       Rice coded prediction residuals of the remaining samples, padded to a whole byte
+ *
+ * The predictors are the fixed polynomial predictors of order 0 to 3, the encoder picks the one with the smallest
+ * residuals for every channel. Residuals are zigzag mapped to unsigned values and Rice coded, a quotient of
+ * sEscapeQuotient or more is written as sEscapeQuotient ones followed by the value in sEscapeBits bits.
+ */
+class LosslessCodec
+{
+public:
+	static constexpr int sMaxOrder = 3;
+	static constexpr int sMaxRiceParameter = 31;
+	static constexpr int sEscapeQuotient = 32;
+	static constexpr int sEscapeBits = 40;
+
+	/**
+	 * Compresses interleaved little endian integer samples.
+	 * @param input frameCount frames of channelCount samples
+	 * @param frameCount number of frames
+	 * @param channelCount number of channels
+	 * @param sampleSize bytes per sample: 2, 3 or 4
+	 * @param output receives the compressed payload
+	 * @param capacity size of the output buffer
+	 * @return size of the compressed payload, 0 when it doesn't fit in capacity bytes
+	 */
+	static size_t encode(const char* input, int frameCount, int channelCount, int sampleSize, char* output, size_t capacity);
+
+	/**
+	 * Restores the interleaved samples from a compressed payload.
+	 * @param input the compressed payload
+	 * @param size size of the compressed payload
+	 * @param frameCount number of frames, from the VBAN header
+	 * @param channelCount number of channels, from the VBAN header
+	 * @param sampleSize bytes per sample: 2, 3 or 4
+	 * @param output receives frameCount * channelCount * sampleSize bytes
+	 * @return false when the payload is malformed
+	 */
+	static bool decode(const char* input, size_t size, int frameCount, int channelCount, int sampleSize, char* output);
+};
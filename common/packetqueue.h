@@ -0,0 +1,183 @@
+#pragma once
+
+#include <vban/vban.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Lock-free single producer / single consumer queue of VBAN packets.
+ * All packet storage is allocated up front in resize(), the queue doubles as the packet pool.
+ * Packets are written, or received, in place with acquire() and commit().
+ * None of the queue operations allocate or block.
+ * In the sender the producer is the audio thread and the consumer is the network thread,
+ * in the receiver it is the other way around.
+ */
+class PacketQueue
+{
+public:
+	/**
+	 * A VBAN packet. The payload is cache line aligned for the sample conversion, the header is stored directly
+	 * in front of it so the packet is sent and received as one contiguous buffer.
+	 */
+	struct alignas(64) Packet
+	{
+		static constexpr size_t sPayloadOffset = 64;
+		static constexpr size_t sMaxPayloadSize = 9000 - 20 - 8 - VBAN_HEADER_SIZE; ///< Fills a 9000 byte jumbo frame over IPv4
+
+		char* header() { return mData + sPayloadOffset - VBAN_HEADER_SIZE; }
+		const char* header() const { return mData + sPayloadOffset - VBAN_HEADER_SIZE; }
+		char* payload() { return mData + sPayloadOffset; }
+		const char* payload() const { return mData + sPayloadOffset; }
+
+		const char* data() const { return header(); }					///< Start of the contiguous packet
+		size_t size() const { return VBAN_HEADER_SIZE + mPayloadSize; } ///< Size of the contiguous packet
+
+		char mData[sPayloadOffset + sMaxPayloadSize];
+		size_t mPayloadSize = 0;
+		std::chrono::steady_clock::time_point mArrivalTime;	///< When a received packet arrived
+	};
+
+	/**
+	 * (Re)allocates storage for the given number of packets and empties the queue.
+	 * Not thread safe: neither producer nor consumer can be active while resizing.
+	 * @param capacity maximum number of packets the queue can hold
+	 */
+	void resize(size_t capacity)
+	{
+		mPackets.clear();
+		mPackets.resize(capacity + 1);
+		mHead.store(0, std::memory_order_relaxed);
+		mTail.store(0, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Returns the next free packet slot so the producer can write a packet in place.
+	 * The slot stays owned by the producer, and invisible to the consumer, until commit() is called.
+	 * @return free packet slot, nullptr when the queue is full
+	 */
+	Packet* acquire()
+	{
+		if (mPackets.empty())
+			return nullptr;
+
+		auto tail = mTail.load(std::memory_order_relaxed);
+		if (increment(tail) == mHead.load(std::memory_order_acquire))
+			return nullptr;
+		return &mPackets[tail];
+	}
+
+	/**
+	 * Returns the next free packet slots so the producer can write several packets in place at once.
+	 * The slots stay owned by the producer, and invisible to the consumer, until commit() is called.
+	 * @param packets receives count free packet slots, in queue order
+	 * @param count number of slots to acquire
+	 * @return false when the queue doesn't have count free slots
+	 */
+	bool acquire(Packet** packets, size_t count)
+	{
+		if (mPackets.empty() || count > capacity() - size())
+			return false;
+
+		auto tail = mTail.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < count; i++)
+		{
+			packets[i] = &mPackets[tail];
+			tail = increment(tail);
+		}
+		return true;
+	}
+
+	/**
+	 * Hands packets returned by acquire() to the consumer. Called from the producer thread.
+	 * @param count number of acquired packets to hand over, they become visible to the consumer together
+	 */
+	void commit(size_t count = 1)
+	{
+		auto tail = mTail.load(std::memory_order_relaxed);
+		tail += count;
+		if (tail >= mPackets.size())
+			tail -= mPackets.size();
+		mTail.store(tail, std::memory_order_release);
+	}
+
+	/**
+	 * Called from the consumer thread.
+	 * @return the oldest packet in the queue, nullptr when the queue is empty
+	 */
+	Packet* front()
+	{
+		auto head = mHead.load(std::memory_order_relaxed);
+		if (head == mTail.load(std::memory_order_acquire))
+			return nullptr;
+		return &mPackets[head];
+	}
+
+	/**
+	 * Collects the oldest packets in the queue without removing them. Called from the consumer thread.
+	 * @param packets receives pointers to at most maxCount packets, oldest first
+	 * @param maxCount maximum number of packets to collect
+	 * @return number of packets collected
+	 */
+	size_t peek(Packet** packets, size_t maxCount)
+	{
+		auto head = mHead.load(std::memory_order_relaxed);
+		auto tail = mTail.load(std::memory_order_acquire);
+		size_t count = 0;
+		while (head != tail && count < maxCount)
+		{
+			packets[count++] = &mPackets[head];
+			head = increment(head);
+		}
+		return count;
+	}
+
+	/**
+	 * Releases packets returned by front() or peek(). Called from the consumer thread.
+	 * @param count number of packets to release
+	 */
+	void pop(size_t count = 1)
+	{
+		auto head = mHead.load(std::memory_order_relaxed);
+		head += count;
+		if (head >= mPackets.size())
+			head -= mPackets.size();
+		mHead.store(head, std::memory_order_release);
+	}
+
+	/**
+	 * @return number of packets currently queued, can be called from any thread
+	 */
+	size_t size() const
+	{
+		if (mPackets.empty())
+			return 0;
+		auto head = mHead.load(std::memory_order_acquire);
+		auto tail = mTail.load(std::memory_order_acquire);
+		return tail >= head ? tail - head : tail + mPackets.size() - head;
+	}
+
+	/**
+	 * @return maximum number of packets the queue can hold
+	 */
+	size_t capacity() const { return mPackets.empty() ? 0 : mPackets.size() - 1; }
+
+	/**
+	 * @return start of the contiguous packet storage, stable until the next resize()
+	 */
+	Packet* storage() { return mPackets.data(); }
+
+	/**
+	 * @return size of the packet storage in bytes
+	 */
+	size_t storageSize() const { return mPackets.size() * sizeof(Packet); }
+
+private:
+	size_t increment(size_t index) const { return index + 1 == mPackets.size() ? 0 : index + 1; }
+
+	std::vector<Packet> mPackets;
+	alignas(64) std::atomic<size_t> mHead = { 0 }; // Written by the consumer
+	alignas(64) std::atomic<size_t> mTail = { 0 }; // Written by the producer
+};
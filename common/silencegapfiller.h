@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vban/vban.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Reconstructs a stream sent with discontinuous transmission (DTX).
+ * A sender in DTX mode skips packets in which every channel is silent. The first packet of a silent stretch,
+ * and one packet every sKeepAliveInterval seconds after it, is sent as a keep-alive standing for a packet of zeros:
+ * the header of the packet with VBAN_CODEC_USER in the codec bits, and an empty payload. Receivers that don't know
+ * the user codec discard it like any packet they can't decode, instead of taking it for a malformed PCM packet.
+ * A packet of the lossless codec, which is sent with the same codec bits, always has a payload.
+ * Skipped packets show up as a gap in the frame counter, and the receiver plays silence for them.
+ */
+class SilenceGapFiller
+{
+public:
+	/**
+	 * A sender in DTX mode sends a keep-alive at least this often, in seconds.
+	 */
+	static constexpr double sKeepAliveInterval = 0.1;
+
+	/**
+	 * Gaps longer than this, in seconds, are a restart of the stream rather than silence and are not filled.
+	 */
+	static constexpr double sMaxGapDuration = 1.0;
+
+	/**
+	 * @param header header of a VBAN audio packet
+	 * @param payloadSize size of the payload of the packet
+	 * @return whether the packet is a keep-alive that stands for a packet of silence
+	 */
+	static bool isKeepAlive(const VBanHeader& header, size_t payloadSize)
+	{
+		return (header.format_bit & VBAN_CODEC_MASK) == VBAN_CODEC_USER && payloadSize == 0;
+	}
+
+	/**
+	 * Writes the samples of a keep-alive or a gap.
+	 * @param output receives frameCount frames of silence
+	 * @param frameCount number of frames
+	 * @param channelCount number of channels
+	 * @param sampleSize bytes per sample
+	 */
+	static void fill(char* output, size_t frameCount, int channelCount, int sampleSize)
+	{
+		std::memset(output, 0, frameCount * static_cast<size_t>(channelCount * sampleSize));
+	}
+
+	/**
+	 * Forgets the stream position, the next packet starts the stream again.
+	 */
+	void reset() { mSynchronized = false; }
+
+	/**
+	 * Call for every audio packet of the stream, in the order they arrive.
+	 * @param header header of the packet
+	 * @return number of frames of silence to play before the frames of the packet,
+	 *         -1 when the packet is older than the previous one and should be discarded
+	 */
+	int64_t getGapFrameCount(const VBanHeader& header)
+	{
+		uint32_t frameCounter = header.nuFrame;
+		int64_t framesPerPacket = header.format_nbs + 1;
+		int sampleRateFormat = header.format_SR & VBAN_SR_MASK;
+		int64_t maxGap = sampleRateFormat < VBAN_SR_MAXNUMBER ? static_cast<int64_t>(VBanSRList[sampleRateFormat] * sMaxGapDuration) : 0;
+
+		// Frame counters wrap, so the difference is taken modulo 2^32. A jump further than the longest gap,
+		// in either direction, is a restarted sender.
+		int64_t gap = static_cast<int32_t>(frameCounter - mNextFrameCounter) * framesPerPacket;
+		bool restarted = !mSynchronized || gap > maxGap || -gap > maxGap;
+		if (gap < 0 && !restarted)
+			return -1;
+
+		mNextFrameCounter = frameCounter + 1;
+		mSynchronized = true;
+		return restarted ? 0 : gap;
+	}
+
+private:
+	uint32_t mNextFrameCounter = 0;
+	bool mSynchronized = false;
+};
@@ -0,0 +1,13 @@
+find_path(LIBURING_INCLUDE_DIR
+          NAMES liburing.h
+          )
+
+find_library(LIBURING_LIBRARY
+          NAMES uring
+          )
+
+mark_as_advanced(LIBURING_INCLUDE_DIR LIBURING_LIBRARY)
+
+# promote package for find
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(liburing REQUIRED_VARS LIBURING_INCLUDE_DIR LIBURING_LIBRARY)